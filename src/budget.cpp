@@ -0,0 +1,61 @@
+#include "budget.hpp"
+
+namespace k4json {
+
+BudgetTracker::BudgetTracker(const QueryBudget& budget) : budget(budget) {}
+
+void BudgetTracker::add_nodes(size_t n) {
+    charge(n, n);
+}
+
+void BudgetTracker::charge(size_t n, size_t work) {
+    size_t total = nodes.fetch_add(n, std::memory_order_relaxed) + n;
+    if (total > budget.max_nodes) {
+        exceeded("query visited more than " +
+                 std::to_string(budget.max_nodes) + " nodes");
+    }
+    check(work);
+}
+
+void BudgetTracker::add_work(size_t n) {
+    check(n);
+}
+
+void BudgetTracker::add_bytes(size_t n) {
+    size_t total = bytes.fetch_add(n, std::memory_order_relaxed) + n;
+    if (total > budget.max_bytes) {
+        exceeded("query copied more than " +
+                 std::to_string(budget.max_bytes) + " bytes");
+    }
+    check(0);
+}
+
+bool BudgetTracker::counts_bytes() const {
+    return budget.max_bytes != SIZE_MAX;
+}
+
+void BudgetTracker::check(size_t n) {
+    if (budget.stop.stop_requested()) {
+        exceeded("query was cancelled");
+    }
+    if (budget.deadline == std::chrono::steady_clock::time_point::max()) {
+        return;
+    }
+    // The clock is read by the first work, then whenever the work of all
+    // the threads crosses a multiple of budget_chunk, however it was split
+    // between the calls
+    size_t done = work.fetch_add(n, std::memory_order_relaxed);
+    bool first = done == 0 && n != 0;
+    if (!first && done / budget_chunk == (done + n) / budget_chunk) {
+        return;
+    }
+    if (std::chrono::steady_clock::now() > budget.deadline) {
+        exceeded("query ran past its deadline");
+    }
+}
+
+[[noreturn]] void BudgetTracker::exceeded(const std::string& msg) const {
+    throw ExprBudgetErr("Json Expression Budget Error: " + msg);
+}
+
+} // namespace k4json
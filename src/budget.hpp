@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+
+namespace k4json {
+
+class ExprBudgetErr : public std::runtime_error {
+public:
+    explicit ExprBudgetErr(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+// Iterations of a loop (nodes visited, numbers computed) between two reads
+// of the clock. Reading it costs about as much as visiting a few dozen
+// nodes.
+constexpr size_t budget_chunk = 4096;
+// Kernels get through numbers much faster than loops through nodes, so
+// they are charged larger chunks at a time
+constexpr size_t kernel_chunk = 16 * budget_chunk;
+
+// Bounds on the work of a query, going over any of them makes it fail with
+// ExprBudgetErr
+struct QueryBudget {
+    // Nodes visited: the nodes name, index, wildcard and slice selectors
+    // produce, the candidates filters test and the nodes descendant
+    // segments walk through
+    size_t max_nodes = SIZE_MAX;
+    // Bytes of the values evaluation computes and of the copied result
+    size_t max_bytes = SIZE_MAX;
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::time_point::max();
+    // Lets another thread cancel the query
+    std::stop_token stop;
+};
+
+// What a query has used of its budget, shared by all the threads evaluating
+// it. Every call also checks the stop token, and the deadline once enough
+// work was done since the clock was last read (and on the first call). The
+// evaluator charges its loops as they run, a chunk at a time (see
+// BudgetMeter and for_chunks()).
+class BudgetTracker {
+public:
+    explicit BudgetTracker(const QueryBudget& budget);
+
+    void add_nodes(size_t n);
+    void add_bytes(size_t n);
+    // nodes visited (counted against max_nodes) in work iterations of a
+    // loop, whether they visited nodes or not
+    void charge(size_t nodes, size_t work);
+    // Work which doesn't visit nodes, e.g. arithmetic over numbers
+    void add_work(size_t n);
+    // Whether bytes need to be counted at all, counting them means
+    // walking the values
+    bool counts_bytes() const;
+
+private:
+    void check(size_t work);
+    [[noreturn]] void exceeded(const std::string& msg) const;
+
+    QueryBudget budget;
+    std::atomic<size_t> nodes = 0;
+    std::atomic<size_t> bytes = 0;
+    std::atomic<size_t> work = 0;
+};
+
+// Charges the iterations of a loop to a budget (or to nothing, if it is
+// null) a chunk at a time, so long loops check the deadline and the stop
+// token as they run without an atomic operation per iteration.
+// Every thread running part of a loop needs its own meter.
+class BudgetMeter {
+public:
+    explicit BudgetMeter(BudgetTracker* budget) : budget(budget) {}
+
+    // One iteration of the loop, which visited nodes nodes
+    void step(size_t nodes = 0) {
+        pending_nodes += nodes;
+        if (++pending_work == budget_chunk) {
+            flush();
+        }
+    }
+    // Charges the rest, once the loop is done
+    void flush() {
+        if (budget != nullptr && pending_work != 0) {
+            budget->charge(pending_nodes, pending_work);
+        }
+        pending_nodes = 0;
+        pending_work = 0;
+    }
+
+private:
+    BudgetTracker* budget;
+    size_t pending_nodes = 0;
+    size_t pending_work = 0;
+};
+
+// Runs kernel(begin, end) over [0, n) kernel_chunk numbers at a time,
+// charging every chunk as work before running it. The chunks don't depend
+// on the budget, so neither does the result of a kernel.
+template <typename Kernel>
+void for_chunks(BudgetTracker* budget, size_t n, Kernel kernel) {
+    for (size_t begin = 0; begin < n; begin += kernel_chunk) {
+        size_t end = begin + kernel_chunk < n ? begin + kernel_chunk : n;
+        if (budget != nullptr) {
+            budget->add_work(end - begin);
+        }
+        kernel(begin, end);
+    }
+}
+
+} // namespace k4json
@@ -0,0 +1,125 @@
+#include "cache.hpp"
+#include "utils.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+#include <unistd.h>
+
+namespace k4json {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+std::string hex(uint64_t value) {
+    char buf[17];
+    std::snprintf(buf, sizeof(buf), "%016llx",
+                  static_cast<unsigned long long>(value));
+    return buf;
+}
+
+} // namespace
+
+uint64_t hash_file(const std::string& file_name) {
+    std::ifstream infile(file_name, std::ios::binary);
+    if (!infile.good()) {
+        throw std::runtime_error("Failed opening file " + file_name +
+                                 ". Does it exit?");
+    }
+    // A multiple of 8, so words never straddle two reads
+    std::vector<char> chunk(1 << 20);
+    uint64_t hash = hash_seed;
+    while (infile.read(chunk.data(), chunk.size()) || infile.gcount() > 0) {
+        hash = hash_words(hash, chunk.data(), infile.gcount());
+    }
+    return finish_hash(hash);
+}
+
+CacheEntry::CacheEntry(const fs::path& cache_dir, const std::string& file_name)
+    : dir(cache_dir) {
+    std::error_code ec;
+    fs::path absolute = fs::weakly_canonical(fs::absolute(file_name), ec);
+    if (ec) {
+        absolute = fs::absolute(file_name);
+    }
+    std::string absolute_str = absolute.string();
+    prefix = hex(finish_hash(
+        hash_words(hash_seed, absolute_str.data(), absolute_str.size())));
+
+    uint64_t size = fs::file_size(file_name, ec);
+    int64_t mtime = fs::last_write_time(file_name, ec)
+                        .time_since_epoch()
+                        .count();
+    uint64_t state[3] = {size, static_cast<uint64_t>(mtime),
+                         hash_file(file_name)};
+    uint64_t version = finish_hash(
+        hash_words(hash_seed, reinterpret_cast<const char*>(state),
+                   sizeof(state)));
+    path = dir / (prefix + '-' + hex(version) + ".pack");
+}
+
+std::optional<PackedDocument> CacheEntry::open() const {
+    std::error_code ec;
+    if (!fs::exists(path, ec)) {
+        return std::nullopt;
+    }
+    try {
+        PackedDocument doc(path.string());
+        doc.verify();
+        return doc;
+    } catch (const std::runtime_error&) {
+        remove();
+        return std::nullopt;
+    }
+}
+
+void CacheEntry::store(const Json& json) const {
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec) {
+        return;
+    }
+
+    // Written next to the entry and renamed over it, so readers never
+    // see half an entry
+    fs::path tmp = path;
+    tmp += ".tmp" + std::to_string(::getpid());
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        try {
+            pack(json, out);
+        } catch (const PackErr&) {
+            out.setstate(std::ios::failbit);
+        }
+        out.close();
+        if (!out.good()) {
+            fs::remove(tmp, ec);
+            return;
+        }
+    }
+    fs::rename(tmp, path, ec);
+    if (ec) {
+        fs::remove(tmp, ec);
+        return;
+    }
+
+    // The entries of the file's older versions
+    for (const fs::directory_entry& entry : fs::directory_iterator(dir, ec)) {
+        std::string name = entry.path().filename().string();
+        if (name.starts_with(prefix + '-') && name.ends_with(".pack") &&
+            entry.path() != path) {
+            fs::remove(entry.path(), ec);
+        }
+    }
+}
+
+void CacheEntry::remove() const {
+    std::error_code ec;
+    fs::remove(path, ec);
+}
+
+} // namespace k4json
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "json.hpp"
+#include "packed.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+
+namespace k4json {
+
+// The packed copy (see packed.hpp) of a json file in a cache directory.
+// Entries are named after the file's absolute path, size, modification
+// time and a hash of its contents, so a changed file never finds the
+// entry of its old contents. The cache is only an optimization: entries
+// which can't be read or written are ignored, and callers fall back to
+// parsing the file.
+class CacheEntry {
+public:
+    // Reads the whole file to hash it, throws std::runtime_error if it
+    // can't be opened
+    CacheEntry(const std::filesystem::path& cache_dir,
+               const std::string& file_name);
+
+    // nullopt if there is no entry for the file as it is now, or if the
+    // entry is damaged (it is then removed). Reads the whole entry to
+    // verify its checksum.
+    std::optional<PackedDocument> open() const;
+    // Packs json as the entry of the file, replacing the entries of its
+    // older versions
+    void store(const Json& json) const;
+    // Drops an entry which turned out to be damaged
+    void remove() const;
+
+private:
+    std::filesystem::path dir;
+    // Same for every version of the file
+    std::string prefix;
+    std::filesystem::path path;
+};
+
+// 64 bit hash of the file's contents
+uint64_t hash_file(const std::string& file_name);
+
+} // namespace k4json
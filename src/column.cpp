@@ -0,0 +1,118 @@
+#include "column.hpp"
+
+#include <algorithm>
+
+namespace k4json {
+
+Column::Column(const NodeList& records, std::string_view field,
+               BudgetTracker* budget) {
+    reserve(records.size());
+    BudgetMeter meter(budget);
+    for (const Json* record : records) {
+        meter.step();
+        add_field(record, field);
+    }
+    meter.flush();
+}
+
+Column::Column(const std::vector<const Json*>& records, std::string_view field,
+               BudgetTracker* budget) {
+    reserve(records.size());
+    BudgetMeter meter(budget);
+    for (const Json* record : records) {
+        meter.step();
+        add_field(record, field);
+    }
+    meter.flush();
+}
+
+Column::Column(const NodeList& values, BudgetTracker* budget) {
+    reserve(values.size());
+    BudgetMeter meter(budget);
+    for (const Json* value : values) {
+        meter.step();
+        add(value);
+    }
+    meter.flush();
+}
+
+void Column::reserve(size_t n) {
+    _numbers.reserve(n);
+    _is_number.reserve(n);
+    _strings.reserve(n);
+    _is_string.reserve(n);
+    _nodes.reserve(n);
+}
+
+void Column::add_field(const Json* record, std::string_view field) {
+    if (record->get_type() == JsonType::OBJECT) {
+        add(record->obj_find(field));
+    } else {
+        add(nullptr);
+    }
+}
+
+// value is nullptr for a missing row
+void Column::add(const Json* value) {
+    JsonType type = value ? value->get_type() : JsonType::INVALID;
+    bool number = type == JsonType::NUMBER;
+    bool string = type == JsonType::STRING;
+
+    _nodes.push_back(value);
+    _numbers.push_back(number ? value->get_number() : 0);
+    _is_number.push_back(number);
+    _strings.push_back(string ? std::string_view(value->get_string_ref())
+                              : std::string_view());
+    _is_string.push_back(string);
+}
+
+size_t Column::size() const {
+    return _nodes.size();
+}
+
+size_t Column::first_non_number() const {
+    return std::find(_is_number.begin(), _is_number.end(), 0) -
+           _is_number.begin();
+}
+
+const double* Column::numbers() const {
+    return _numbers.data();
+}
+
+const unsigned char* Column::number_mask() const {
+    return _is_number.data();
+}
+
+const std::string_view* Column::strings() const {
+    return _strings.data();
+}
+
+const unsigned char* Column::string_mask() const {
+    return _is_string.data();
+}
+
+const Json* Column::node(size_t row) const {
+    return _nodes[row];
+}
+
+Json Column::to_json(BudgetTracker* budget) const {
+    JsonArray res;
+    res.reserve(size());
+    BudgetMeter meter(budget);
+    for (size_t i = 0; i < size(); ++i) {
+        meter.step();
+        if (_is_number[i]) {
+            res.push_back(Json(_numbers[i]));
+        } else if (_is_string[i]) {
+            res.push_back(Json(std::string(_strings[i])));
+        } else if (_nodes[i] != nullptr) {
+            res.push_back(*_nodes[i]);
+        } else {
+            res.push_back(Json());
+        }
+    }
+    meter.flush();
+    return Json(res);
+}
+
+} // namespace k4json
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "budget.hpp"
+#include "json.hpp"
+#include "nodelist.hpp"
+
+#include <string_view>
+#include <vector>
+
+namespace k4json {
+
+// The values of a field across a list of records, split by type into
+// contiguous buffers which kernels can scan linearly.
+// number(i) is only meaningful where is_number(i), same for strings.
+// Rows whose record isn't an object or doesn't have the field are missing.
+// Building a column and copying it out go through every row, with a budget
+// the rows are charged to it as work while they do.
+class Column {
+public:
+    // The field of every record
+    Column(const NodeList& records, std::string_view field,
+           BudgetTracker* budget = nullptr);
+    Column(const std::vector<const Json*>& records, std::string_view field,
+           BudgetTracker* budget = nullptr);
+    // The values themselves
+    explicit Column(const NodeList& values, BudgetTracker* budget = nullptr);
+
+    size_t size() const;
+    // Index of the first row which isn't a number, size() if there is none
+    size_t first_non_number() const;
+
+    const double* numbers() const;
+    const unsigned char* number_mask() const;
+    const std::string_view* strings() const;
+    const unsigned char* string_mask() const;
+    // nullptr for missing rows
+    const Json* node(size_t row) const;
+
+    // The column as an array, missing rows become null
+    Json to_json(BudgetTracker* budget = nullptr) const;
+
+private:
+    void reserve(size_t n);
+    void add(const Json* value);
+    void add_field(const Json* record, std::string_view field);
+
+    std::vector<double> _numbers;
+    std::vector<unsigned char> _is_number;
+    std::vector<std::string_view> _strings;
+    std::vector<unsigned char> _is_string;
+    std::vector<const Json*> _nodes;
+};
+
+} // namespace k4json
@@ -1,10 +1,15 @@
 #include "expressions.hpp"
+#include "groups.hpp"
+#include "index.hpp"
 #include "json.hpp"
+#include "kernels.hpp"
+#include "thread_pool.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
-#include <limits>
+#include <unordered_set>
 
 namespace k4json {
 
@@ -13,15 +18,145 @@ JsonExpressionParser::JsonExpressionParser(const Json& json,
     // As per the spec
     // https://www.rfc-editor.org/rfc/rfc9535#name-json-values-as-trees-of-nod
     // we will model the result of a query as a nodelist
-    this->rootlist = JsonArray();
-    this->rootlist.push_back(json);
+    this->rootlist = NodeList();
+    this->rootlist.push_back(&json);
     this->buffer = expression;
 }
 
+// Copies the nodes referenced by nodelist
+JsonArray to_json_array(const NodeList& nodelist) {
+    JsonArray res;
+    res.reserve(nodelist.size());
+    for (const Json* node : nodelist) {
+        res.push_back(*node);
+    }
+    return res;
+}
+
+// Runs select(node, res) for every node of the nodelist. Large nodelists
+// are split into chunks evaluated on the thread pool, the partial results
+// are concatenated in chunk order so nothing changes compared to a
+// sequential run.
+// With a limit, the nodes are gone through in order and only until
+// enough results have been found.
+// The nodes select produces are charged to the budget as they come.
+template <typename Select>
+NodeList select_each(const NodeList& nodelist, BudgetTracker* budget,
+                     Select select, size_t limit = SIZE_MAX) {
+    NodeList res;
+    // One node and its selected children
+    auto visit = [&select](const Json* node, NodeList& out,
+                           BudgetMeter& meter) {
+        size_t before = out.size();
+        select(node, out);
+        meter.step(out.size() - before);
+    };
+
+    BudgetMeter meter(budget);
+    if (limit != SIZE_MAX) {
+        for (const Json* node : nodelist) {
+            if (res.size() >= limit) {
+                break;
+            }
+            visit(node, res, meter);
+        }
+        meter.flush();
+        return res;
+    }
+
+    size_t n = nodelist.size();
+    if (n < parallel_threshold()) {
+        for (const Json* node : nodelist) {
+            visit(node, res, meter);
+        }
+        meter.flush();
+        return res;
+    }
+
+    std::vector<const Json*> nodes;
+    nodes.reserve(n);
+    for (const Json* node : nodelist) {
+        nodes.push_back(node);
+    }
+    std::vector<NodeList> partial(4 * ThreadPool::instance().size());
+    size_t nchunks = parallel_ranges(
+        n, partial.size(), [&](size_t chunk, size_t begin, size_t end) {
+            BudgetMeter chunk_meter(budget);
+            for (size_t i = begin; i < end; ++i) {
+                visit(nodes[i], partial[chunk], chunk_meter);
+            }
+            chunk_meter.flush();
+        });
+    for (size_t i = 0; i < nchunks; ++i) {
+        res.append(partial[i]);
+    }
+    return res;
+}
+
 JsonArray JsonExpressionParser::parse(const Json& json,
-                                      const std::string& expression) {
+                                      const std::string& expression,
+                                      QueryProfile* profile,
+                                      const QueryBudget* budget) {
     JsonExpressionParser jep(json, expression);
-    return jep.parse();
+    jep.profile = profile;
+    std::optional<BudgetTracker> tracker;
+    if (budget != nullptr) {
+        tracker.emplace(*budget);
+        jep.budget = &*tracker;
+    }
+    NodeList nodes = jep.parse();
+    if (tracker && tracker->counts_bytes()) {
+        // Before copying them
+        for (const Json* node : nodes) {
+            tracker->add_bytes(json_bytes(*node));
+        }
+    }
+    // The only place where the result nodes get copied
+    JsonArray res = to_json_array(nodes);
+    if (profile != nullptr) {
+        size_t bytes = 0;
+        for (const Json& node : res) {
+            bytes += json_bytes(node);
+        }
+        profile->set_result(res.size(), bytes);
+    }
+    return res;
+}
+
+std::vector<const Json*>
+JsonExpressionParser::select(const Json& json, const std::string& expression,
+                             QueryProfile* profile,
+                             const QueryBudget* budget) {
+    JsonExpressionParser jep(json, expression);
+    jep.profile = profile;
+    std::optional<BudgetTracker> tracker;
+    if (budget != nullptr) {
+        tracker.emplace(*budget);
+        jep.budget = &*tracker;
+    }
+    NodeList nodes = jep.parse();
+    // Looked up once per node instead of going through every owned value
+    std::unordered_set<const Json*> computed;
+    if (!jep.owned.empty()) {
+        computed.reserve(jep.owned.size());
+        for (const Json& value : jep.owned) {
+            computed.insert(&value);
+        }
+    }
+    std::vector<const Json*> res;
+    res.reserve(nodes.size());
+    for (const Json* node : nodes) {
+        if (computed.contains(node)) {
+            jep.value_err("expression must select nodes of the json, "
+                          "not compute values");
+        }
+        res.push_back(node);
+    }
+    if (profile != nullptr) {
+        // Nothing gets copied
+        profile->set_result(res.size(), 0);
+    }
+    return res;
 }
 
 [[noreturn]] void JsonExpressionParser::syntax_err(const std::string& msg) {
@@ -40,74 +175,185 @@ JsonArray JsonExpressionParser::parse(const Json& json,
     throw ExprValueErr(res);
 }
 
-JsonArray JsonExpressionParser::evaluate_max(std::vector<Json>& arguments) {
-    double mx = std::numeric_limits<double>::lowest(); // min() is closest to
-                                                       // zero.. wow.
-    int idx = 0;
+// A parser at the same spot of the same query, but with nothing owned yet.
+// Lets a chunk of the work be evaluated on another thread.
+JsonExpressionParser JsonExpressionParser::fork() const {
+    JsonExpressionParser jep(*rootlist[0], buffer);
+    jep.current = current;
+    jep.line = line;
+    jep.filter_nodes = filter_nodes;
+    jep.first_argument = first_argument;
+    jep.budget = budget;
+    return jep;
+}
 
-    JsonArray args;
-    if (arguments.size() == 1 && arguments[0].get_type() == JsonType::ARRAY) {
-        args = arguments[0].get_array();
-    } else {
-        args = arguments;
+// Takes ownership of a value computed during evaluation
+const Json* JsonExpressionParser::own(Json&& value) {
+    if (profile != nullptr) {
+        profile->add_copied(json_bytes(value));
+    }
+    if (budget != nullptr && budget->counts_bytes()) {
+        budget->add_bytes(json_bytes(value));
     }
+    owned.push_back(std::move(value));
+    return &owned.back();
+}
 
-    for (auto& arg : args) {
-        if (arg.get_type() != JsonType::NUMBER) {
-            current -= 1;
-            value_err("function max() only accepts numerical arguments but "
-                      "argument " +
-                      std::to_string(idx) + " is:\n" + arg.to_string());
+// Counts visited nodes against the budget of the query, if it has one
+void JsonExpressionParser::charge_nodes(size_t n) {
+    if (budget != nullptr) {
+        budget->add_nodes(n);
+    }
+}
+
+// A single array argument stands for its elements, which are charged to
+// the budget as visited
+NodeList flatten_arguments(std::vector<NodeList>& arguments,
+                           BudgetTracker* budget) {
+    NodeList args;
+    if (arguments.size() == 1 && arguments[0].size() == 1 &&
+        arguments[0][0]->get_type() == JsonType::ARRAY) {
+        const JsonArray& arr = arguments[0][0]->get_array_ref();
+        args.push_slice(arr, 0, 1, arr.size());
+        if (budget != nullptr) {
+            budget->charge(arr.size(), 1);
+        }
+    } else {
+        for (NodeList& arg : arguments) {
+            args.append(arg);
         }
-        mx = std::max(mx, arg.get_number());
-        idx += 1;
     }
+    return args;
+}
 
-    JsonArray res;
-    res.push_back(Json(mx));
+// Gathers the arguments of func into a column for the kernels
+Column
+JsonExpressionParser::numeric_arguments(std::string_view func,
+                                        std::vector<NodeList>& arguments) {
+    Column values(flatten_arguments(arguments, budget), budget);
+
+    size_t idx = values.first_non_number();
+    if (idx != values.size()) {
+        current -= 1;
+        value_err("function " + std::string(func) +
+                  "() only accepts numerical arguments but argument " +
+                  std::to_string(idx) + " is:\n" +
+                  values.node(idx)->to_string());
+    }
+
+    return values;
+}
+
+NodeList JsonExpressionParser::own_number(double number) {
+    NodeList res;
+    res.push_back(own(Json(number)));
     return res;
 }
 
-JsonArray JsonExpressionParser::evaluate_min(std::vector<Json>& arguments) {
-    double mn = std::numeric_limits<double>::max();
-    int idx = 0;
+NodeList
+JsonExpressionParser::evaluate_max(std::vector<NodeList>& arguments) {
+    Column values = numeric_arguments("max", arguments);
+    double res = max_value(values.numbers(), 0);
+    for_chunks(budget, values.size(), [&](size_t begin, size_t end) {
+        res = std::max(res, max_value(values.numbers() + begin, end - begin));
+    });
+    return own_number(res);
+}
 
-    JsonArray args;
-    if (arguments.size() == 1 && arguments[0].get_type() == JsonType::ARRAY) {
-        args = arguments[0].get_array();
-    } else {
-        args = arguments;
+NodeList
+JsonExpressionParser::evaluate_min(std::vector<NodeList>& arguments) {
+    Column values = numeric_arguments("min", arguments);
+    double res = min_value(values.numbers(), 0);
+    for_chunks(budget, values.size(), [&](size_t begin, size_t end) {
+        res = std::min(res, min_value(values.numbers() + begin, end - begin));
+    });
+    return own_number(res);
+}
+
+// sum, avg, count, variance and stddev
+NodeList
+JsonExpressionParser::evaluate_aggregate(FuncType func,
+                                         std::vector<NodeList>& arguments) {
+    // count is the only one which doesn't care about the values
+    if (func == FuncType::COUNT) {
+        return own_number(
+            static_cast<double>(flatten_arguments(arguments, budget).size()));
     }
 
-    for (auto& arg : args) {
-        if (arg.get_type() != JsonType::NUMBER) {
-            current -= 1;
-            value_err("function min() only accepts numerical arguments but "
-                      "argument " +
-                      std::to_string(idx) + " is:\n" + arg.to_string());
-        }
-        mn = std::min(mn, arg.get_number());
-        idx += 1;
+    std::string_view name;
+    switch (func) {
+    case FuncType::SUM:
+        name = "sum";
+        break;
+    case FuncType::AVG:
+        name = "avg";
+        break;
+    case FuncType::VARIANCE:
+        name = "variance";
+        break;
+    default:
+        name = "stddev";
     }
 
-    JsonArray res;
-    res.push_back(Json(mn));
-    return res;
+    Column values = numeric_arguments(name, arguments);
+    size_t n = values.size();
+    double total = 0;
+    for_chunks(budget, n, [&](size_t begin, size_t end) {
+        total += sum(values.numbers() + begin, end - begin);
+    });
+    if (func == FuncType::SUM) {
+        return own_number(total);
+    }
+
+    if (n == 0) {
+        current -= 1;
+        value_err("function " + std::string(name) +
+                  "() needs at least one number");
+    }
+    double mean = total / n;
+    if (func == FuncType::AVG) {
+        return own_number(mean);
+    }
+
+    // population variance, two passes for numerical stability
+    double deviations = 0;
+    for_chunks(budget, n, [&](size_t begin, size_t end) {
+        deviations +=
+            sum_squared_deviations(values.numbers() + begin, end - begin, mean);
+    });
+    double variance = deviations / n;
+    if (func == FuncType::VARIANCE) {
+        return own_number(variance);
+    }
+    return own_number(std::sqrt(variance));
 }
 
-JsonArray JsonExpressionParser::evaluate_size(std::vector<Json>& arguments) {
+NodeList
+JsonExpressionParser::evaluate_size(std::vector<NodeList>& arguments) {
     if (arguments.size() != 1) {
         syntax_err("function size() only accepts one argument");
     }
 
-    Json arg = std::move(arguments[0]);
-    JsonArray res;
+    NodeList res;
+    // For queries which can select any number of nodes (e.g. arr[*] or
+    // arr[0:1]) it's the amount of nodes, even if it is one or none. There
+    // is no need to look at them.
+    if (nodelist_argument) {
+        res.push_back(own(Json(static_cast<double>(arguments[0].size()))));
+        return res;
+    }
+    if (arguments[0].size() != 1) {
+        value_err("argument of function size() must be a single value or a "
+                  "nodelist query");
+    }
 
-    switch (arg.get_type()) {
+    const Json* arg = arguments[0][0];
+
+    switch (arg->get_type()) {
     case JsonType::ARRAY:
     case JsonType::OBJECT:
     case JsonType::STRING:
-        res.push_back(Json(static_cast<double>(arg.size())));
+        res.push_back(own(Json(static_cast<double>(arg->size()))));
         break;
     default:
         value_err("function size() is only valid for Json arrays, objects and "
@@ -118,24 +364,67 @@ JsonArray JsonExpressionParser::evaluate_size(std::vector<Json>& arguments) {
 }
 
 // Adds up the total amount of jsons compromising the arguments
-JsonArray
-JsonExpressionParser::evaluate_nchildren(std::vector<Json>& arguments) {
+NodeList
+JsonExpressionParser::evaluate_nchildren(std::vector<NodeList>& arguments) {
     int res = 0;
 
-    for (auto& arg : arguments) {
-        res += arg.nchildren();
+    BudgetMeter meter(budget);
+    for (NodeList& arg : arguments) {
+        for (const Json* node : arg) {
+            meter.step();
+            res += node->nchildren();
+        }
     }
+    meter.flush();
 
-    JsonArray ret;
-    ret.push_back(Json(static_cast<double>(res)));
+    NodeList ret;
+    ret.push_back(own(Json(static_cast<double>(res))));
     return ret;
 }
 
+// column(records, "field")
+// The field of every record (or element of an array of records) as an array
+NodeList
+JsonExpressionParser::evaluate_column(std::vector<NodeList>& arguments) {
+    if (arguments.size() != 2) {
+        syntax_err("function column() takes exactly two arguments");
+    }
+    if (arguments[1].size() != 1 ||
+        arguments[1][0]->get_type() != JsonType::STRING) {
+        current -= 1;
+        value_err("second argument of function column() must be a string");
+    }
+
+    std::vector<NodeList> records_arg;
+    records_arg.push_back(arguments[0]);
+    Column column(flatten_arguments(records_arg, budget),
+                  arguments[1][0]->get_string_ref(), budget);
+
+    NodeList res;
+    res.push_back(own(column.to_json(budget)));
+    return res;
+}
+
 // arguments is assumed to have at least one element
 // the function may modify arguments
-JsonArray
+NodeList
 JsonExpressionParser::evaluate_function(FuncType func,
-                                        std::vector<Json>& arguments) {
+                                        std::vector<NodeList>& arguments) {
+    ProfileScope scope(profile, "evaluate", current);
+    NodeList res = dispatch_function(func, arguments);
+    if (profile != nullptr) {
+        size_t nodes_in = 0;
+        for (const NodeList& arg : arguments) {
+            nodes_in += arg.size();
+        }
+        scope.finish("", nodes_in, res.size());
+    }
+    return res;
+}
+
+NodeList
+JsonExpressionParser::dispatch_function(FuncType func,
+                                        std::vector<NodeList>& arguments) {
     switch (func) {
     case FuncType::MAX:
         return evaluate_max(arguments);
@@ -145,29 +434,61 @@ JsonExpressionParser::evaluate_function(FuncType func,
         return evaluate_size(arguments);
     case FuncType::NCHILDREN:
         return evaluate_nchildren(arguments);
+    case FuncType::SUM:
+    case FuncType::AVG:
+    case FuncType::COUNT:
+    case FuncType::VARIANCE:
+    case FuncType::STDDEV:
+        return evaluate_aggregate(func, arguments);
+    case FuncType::COLUMN:
+        return evaluate_column(arguments);
+    case FuncType::FIRST:
+        return evaluate_first(arguments);
+    case FuncType::LOOKUP:
+        return evaluate_lookup(arguments);
+    case FuncType::TOPK:
+        return evaluate_topk(arguments);
+    case FuncType::SORT:
+        return evaluate_sort(arguments);
+    case FuncType::DISTINCT:
+        return evaluate_distinct(arguments);
+    case FuncType::COUNT_BY:
+        return evaluate_count_by(arguments);
     }
     assert(0);
 }
 
-JsonArray JsonExpressionParser::parse_func(FuncType func) {
+// start: where the function name begins
+NodeList JsonExpressionParser::parse_func(FuncType func, int start) {
+    ProfileScope scope(profile, "function", start);
     assert_match('(');
 
-    std::vector<Json> arguments;
+    // Arguments may select several nodes, e.g. max(arr[*])
+    std::vector<NodeList> arguments;
     // Are we expecting another expression (in terms of , )
     bool expecting = true;
+    // Of the expression the call is part of
+    bool outer_nodelist = nodelist_query;
+    bool size_of_nodelist = false;
 
     while (!reached_end()) {
         skip();
 
         if (expecting) {
-            JsonArray cur = parse_inner();
-            if (cur.empty()) {
-                value_err("function argument cannot evaluate to nothing");
+            if (func == FuncType::FIRST) {
+                first_argument = current;
+            }
+            nodelist_query = false;
+            NodeList cur = parse_inner();
+            if (func == FuncType::SIZE) {
+                size_of_nodelist = nodelist_query;
             }
-            if (cur.size() != 1) {
-                value_err("function argument must evaluate to one Json");
+            // The only functions which are fine with nothing
+            if (cur.empty() && func != FuncType::FIRST &&
+                !(func == FuncType::SIZE && nodelist_query)) {
+                value_err("function argument cannot evaluate to nothing");
             }
-            arguments.push_back(std::move(cur[0]));
+            arguments.push_back(std::move(cur));
             expecting = false;
             continue;
         }
@@ -183,7 +504,15 @@ JsonArray JsonExpressionParser::parse_func(FuncType func) {
         syntax_err("function call unterminated, expected )");
     }
 
-    return evaluate_function(func, arguments);
+    // These select nodes of their arguments, any number of them
+    nodelist_query = outer_nodelist || func == FuncType::LOOKUP ||
+                     func == FuncType::TOPK || func == FuncType::SORT ||
+                     func == FuncType::DISTINCT;
+    nodelist_argument = size_of_nodelist;
+    NodeList res = evaluate_function(func, arguments);
+    scope.finish(std::string_view(buffer).substr(start, current - start),
+                 arguments, res);
+    return res;
 }
 
 FuncType JsonExpressionParser::string_to_functype(std::string_view sv) {
@@ -195,17 +524,367 @@ FuncType JsonExpressionParser::string_to_functype(std::string_view sv) {
         return FuncType::SIZE;
     } else if (sv == "nchildren") {
         return FuncType::NCHILDREN;
+    } else if (sv == "sum") {
+        return FuncType::SUM;
+    } else if (sv == "avg") {
+        return FuncType::AVG;
+    } else if (sv == "count") {
+        return FuncType::COUNT;
+    } else if (sv == "variance") {
+        return FuncType::VARIANCE;
+    } else if (sv == "stddev") {
+        return FuncType::STDDEV;
+    } else if (sv == "column") {
+        return FuncType::COLUMN;
+    } else if (sv == "first") {
+        return FuncType::FIRST;
+    } else if (sv == "lookup") {
+        return FuncType::LOOKUP;
+    } else if (sv == "topk") {
+        return FuncType::TOPK;
+    } else if (sv == "sort") {
+        return FuncType::SORT;
+    } else if (sv == "distinct") {
+        return FuncType::DISTINCT;
+    } else if (sv == "count_by") {
+        return FuncType::COUNT_BY;
     } else {
         syntax_err("invalid function name '" + std::string(sv) + "'");
         __builtin_unreachable();
     }
 }
 
+// The first node its argument selects, or nothing
+NodeList JsonExpressionParser::evaluate_first(std::vector<NodeList>& arguments) {
+    if (arguments.size() != 1) {
+        syntax_err("function first() only accepts one argument");
+    }
+
+    NodeList res;
+    if (!arguments[0].empty()) {
+        res.push_back(arguments[0][0]);
+    }
+    return res;
+}
+
+// lookup(arr, 'field', value): the records of arr whose field == value,
+// answered by an index if one was built (see Json::build_index())
+NodeList
+JsonExpressionParser::evaluate_lookup(std::vector<NodeList>& arguments) {
+    if (arguments.size() != 3) {
+        syntax_err("function lookup() takes exactly three arguments");
+    }
+    if (arguments[0].size() != 1 ||
+        arguments[0][0]->get_type() != JsonType::ARRAY) {
+        value_err("first argument of function lookup() must be an array");
+    }
+    if (arguments[1].size() != 1 ||
+        arguments[1][0]->get_type() != JsonType::STRING) {
+        value_err("second argument of function lookup() must be a string");
+    }
+    if (arguments[2].size() != 1) {
+        value_err("third argument of function lookup() must be one value");
+    }
+
+    const Json& array = *arguments[0][0];
+    const JsonArray& records = array.get_array_ref();
+    std::string_view field = arguments[1][0]->get_string_ref();
+    const Json& value = *arguments[2][0];
+
+    NodeList res;
+    const FieldIndex* index = array.field_index(field);
+    // Arrays and objects aren't indexed
+    if (index != nullptr && value.get_type() != JsonType::ARRAY &&
+        value.get_type() != JsonType::OBJECT) {
+        for (uint32_t row : index->equal(value)) {
+            res.push_back(&records[row]);
+        }
+        return res;
+    }
+
+    BudgetMeter meter(budget);
+    for (const Json& record : records) {
+        meter.step(1);
+        if (record.get_type() != JsonType::OBJECT) {
+            continue;
+        }
+        const Json* found = record.obj_find(field);
+        if (found != nullptr && *found == value) {
+            res.push_back(&record);
+        }
+    }
+    meter.flush();
+    return res;
+}
+
+// The values of the first argument of func (the elements of a single
+// array, otherwise the nodes it selects)
+Column
+JsonExpressionParser::values_argument(std::string_view func,
+                                      std::vector<NodeList>& arguments) {
+    if (arguments[0].empty()) {
+        current -= 1;
+        value_err("first argument of function " + std::string(func) +
+                  "() must select something");
+    }
+    std::vector<NodeList> values_arg;
+    values_arg.push_back(std::move(arguments[0]));
+    return Column(flatten_arguments(values_arg, budget), budget);
+}
+
+// Whether the values are all numbers (otherwise they are all strings)
+bool JsonExpressionParser::comparable_values(std::string_view func,
+                                             const Column& values) {
+    size_t n = values.size();
+    // The first value decides
+    bool numbers = n == 0 || values.number_mask()[0];
+    const unsigned char* mask =
+        numbers ? values.number_mask() : values.string_mask();
+    size_t idx = std::find(mask, mask + n, 0) - mask;
+    if (idx != n) {
+        current -= 1;
+        value_err("function " + std::string(func) +
+                  "() only accepts all numbers or all strings but argument " +
+                  std::to_string(idx) + " is:\n" +
+                  values.node(idx)->to_string());
+    }
+    return numbers;
+}
+
+// topk(arr, k): the k largest values of arr, largest first
+NodeList JsonExpressionParser::evaluate_topk(std::vector<NodeList>& arguments) {
+    if (arguments.size() != 2) {
+        syntax_err("function topk() takes exactly two arguments");
+    }
+    if (arguments[1].size() != 1 ||
+        arguments[1][0]->get_type() != JsonType::NUMBER ||
+        arguments[1][0]->get_number() < 0 ||
+        arguments[1][0]->get_number() !=
+            std::floor(arguments[1][0]->get_number())) {
+        current -= 1;
+        value_err("second argument of function topk() must be a "
+                  "non-negative integer");
+    }
+    double number = arguments[1][0]->get_number();
+
+    Column values = values_argument("topk", arguments);
+    // number can be beyond the range of size_t
+    size_t k = number >= values.size() ? values.size()
+                                       : static_cast<size_t>(number);
+    std::vector<size_t> rows =
+        comparable_values("topk", values)
+            ? top_k(values.numbers(), values.size(), k)
+            : top_k(values.strings(), values.size(), k);
+
+    NodeList res;
+    for (size_t row : rows) {
+        res.push_back(values.node(row));
+    }
+    return res;
+}
+
+// sort(arr): the values of arr, ascending
+NodeList JsonExpressionParser::evaluate_sort(std::vector<NodeList>& arguments) {
+    if (arguments.size() != 1) {
+        syntax_err("function sort() only accepts one argument");
+    }
+
+    Column values = values_argument("sort", arguments);
+    std::vector<size_t> rows =
+        comparable_values("sort", values)
+            ? sorted_rows(values.numbers(), values.size())
+            : sorted_rows(values.strings(), values.size());
+
+    NodeList res;
+    for (size_t row : rows) {
+        res.push_back(values.node(row));
+    }
+    return res;
+}
+
+// Arrays and objects can't be grouped
+void JsonExpressionParser::check_groupable(std::string_view func,
+                                           const Column& values) {
+    size_t idx = ValueGroups::first_ungroupable(values);
+    if (idx != values.size()) {
+        current -= 1;
+        value_err("function " + std::string(func) +
+                  "() doesn't accept arrays and objects but argument " +
+                  std::to_string(idx) + " is:\n" +
+                  values.node(idx)->to_string());
+    }
+}
+
+// distinct(arr): the first occurrence of every value of arr
+NodeList
+JsonExpressionParser::evaluate_distinct(std::vector<NodeList>& arguments) {
+    if (arguments.size() != 1) {
+        syntax_err("function distinct() only accepts one argument");
+    }
+
+    Column values = values_argument("distinct", arguments);
+    check_groupable("distinct", values);
+
+    ValueGroups groups(values);
+    NodeList res;
+    for (size_t row : groups.rows()) {
+        res.push_back(values.node(row));
+    }
+    return res;
+}
+
+// count_by(arr): object mapping every value of arr to how many times it
+// appears. Strings are their own keys, other values their json text.
+NodeList
+JsonExpressionParser::evaluate_count_by(std::vector<NodeList>& arguments) {
+    if (arguments.size() != 1) {
+        syntax_err("function count_by() only accepts one argument");
+    }
+
+    Column values = values_argument("count_by", arguments);
+    check_groupable("count_by", values);
+
+    ValueGroups groups(values);
+    std::map<std::string, double, std::less<>> counts;
+    for (size_t i = 0; i < groups.rows().size(); ++i) {
+        size_t row = groups.rows()[i];
+        std::string key = values.string_mask()[row]
+                              ? std::string(values.strings()[row])
+                              : values.node(row)->to_string();
+        // "1" and 1 share a key
+        counts[key] += groups.counts()[i];
+    }
+
+    JsonObject obj;
+    for (auto& [key, count] : counts) {
+        obj.emplace(key, Json(count));
+    }
+    NodeList res;
+    res.push_back(own(Json(obj)));
+    return res;
+}
+
+// https://www.rfc-editor.org/rfc/rfc9535#name-wildcard-selector
+// The children are referred to, not enumerated (but charged to the budget)
+NodeList select_children(const NodeList& nodelist, BudgetTracker* budget) {
+    NodeList res;
+    BudgetMeter meter(budget);
+    for (const Json* node : nodelist) {
+        if (node->get_type() == JsonType::ARRAY) {
+            const JsonArray& arr = node->get_array_ref();
+            res.push_slice(arr, 0, 1, arr.size());
+            meter.step(arr.size());
+        } else if (node->get_type() == JsonType::OBJECT) {
+            res.push_values(node->get_obj_ref());
+            meter.step(node->get_obj_ref().size());
+        } else {
+            meter.step();
+        }
+    }
+    meter.flush();
+    return res;
+}
+
+// https://www.rfc-editor.org/rfc/rfc9535#name-semantics-4
+void select_slice(NodeList& res, const JsonArray& arr,
+                  std::optional<long> start, std::optional<long> end,
+                  long step) {
+    long len = arr.size();
+    if (step == 0) {
+        return;
+    }
+
+    auto normalize = [len](long idx) {
+        return idx >= 0 ? idx : len + idx;
+    };
+
+    if (step > 0) {
+        long lower = std::min(std::max(normalize(start.value_or(0)), 0L), len);
+        long upper = std::min(std::max(normalize(end.value_or(len)), 0L), len);
+        if (lower < upper) {
+            res.push_slice(arr, lower, step, (upper - lower + step - 1) / step);
+        }
+    } else {
+        long upper = std::min(std::max(normalize(start.value_or(len - 1)), -1L),
+                              len - 1);
+        long lower = std::min(std::max(normalize(end.value_or(-len - 1)), -1L),
+                              len - 1);
+        if (lower < upper) {
+            res.push_slice(arr, upper, step,
+                           (upper - lower - step - 1) / -step);
+        }
+    }
+}
+
+// Slice bounds are expressions as well, but need to evaluate to an integer
+long JsonExpressionParser::slice_bound(const NodeList& value) {
+    if (value.size() != 1 || value[0]->get_type() != JsonType::NUMBER ||
+        std::floor(value[0]->get_number()) != value[0]->get_number()) {
+        value_err("slice bound must evaluate to an integer");
+    }
+    return static_cast<long>(value[0]->get_number());
+}
+
+// [start:end:step], with this->current at the first :
+NodeList JsonExpressionParser::parse_slice_selector(const NodeList& nodelist,
+                                                    std::optional<long> start) {
+    assert_match(':');
+
+    std::optional<long> end;
+    skip();
+    if (peek() != ':' && peek() != ']') {
+        end = slice_bound(parse_inner());
+        skip();
+    }
+
+    long step = 1;
+    if (match(':')) {
+        skip();
+        if (peek() != ']') {
+            step = slice_bound(parse_inner());
+            skip();
+        }
+    }
+
+    if (!match(']')) {
+        syntax_err("expected ]");
+    }
+
+    nodelist_query = true;
+    NodeList res;
+    BudgetMeter meter(budget);
+    for (const Json* node : nodelist) {
+        size_t before = res.size();
+        // Nothing on non-arrays
+        if (node->get_type() == JsonType::ARRAY) {
+            select_slice(res, node->get_array_ref(), start, end, step);
+        }
+        meter.step(res.size() - before);
+    }
+    meter.flush();
+    return res;
+}
+
 // For situations like [a.b[1]]
 // Number literals also count as expressions: [7]
-JsonArray JsonExpressionParser::parse_expr_selector(const JsonArray& nodelist) {
+// Also handles the wildcard [*] and slices [1:10:2]
+NodeList JsonExpressionParser::parse_expr_selector(const NodeList& nodelist,
+                                                   size_t limit) {
     assert_match('[');
 
+    skip();
+    if (match('*')) {
+        skip();
+        if (!match(']')) {
+            syntax_err("expected ]");
+        }
+        nodelist_query = true;
+        return select_children(nodelist, budget);
+    }
+    if (peek() == ':') {
+        return parse_slice_selector(nodelist, std::nullopt);
+    }
+
     // Weirdness due to the the spec extension coming from two facts:
     // 1. We allow "a" as a valid path, no need for "$.a"
     // 2. We allow expressions inside [ ]
@@ -222,9 +901,15 @@ JsonArray JsonExpressionParser::parse_expr_selector(const JsonArray& nodelist) {
     // names, so we always interpret digits like literals (as index) in cases
     // like this.
 
-    JsonArray inside = parse_inner();
+    // The expression inside doesn't make the path select more nodes
+    bool outer_nodelist = nodelist_query;
+    NodeList inside = parse_inner();
+    nodelist_query = outer_nodelist;
 
     skip();
+    if (peek() == ':') {
+        return parse_slice_selector(nodelist, slice_bound(inside));
+    }
     if (!match(']')) {
         syntax_err("expected ]");
     }
@@ -235,21 +920,21 @@ JsonArray JsonExpressionParser::parse_expr_selector(const JsonArray& nodelist) {
         current -= 1;
         value_err("expression inside [...] must evaluate to one value, "
                   "evaluates to:\n" +
-                  Json(inside).to_string());
+                  Json(to_json_array(inside)).to_string());
     }
 
-    if (inside[0].get_type() == JsonType::STRING) {
-        return parse_name(nodelist, inside[0].get_string());
+    if (inside[0]->get_type() == JsonType::STRING) {
+        return parse_name(nodelist, inside[0]->get_string(), limit);
     }
 
-    if (inside[0].get_type() != JsonType::NUMBER) {
+    if (inside[0]->get_type() != JsonType::NUMBER) {
         current -= 1;
         value_err("expression inside [...] must evaluate to [string] or "
                   "[number], evaluates to:\n" +
-                  Json(inside).to_string());
+                  Json(to_json_array(inside)).to_string());
     }
 
-    double number = inside[0].get_number();
+    double number = inside[0]->get_number();
     if (std::floor(number) != number) {
         current -= 1;
         value_err("expression inside [...] evaluates to number (" +
@@ -258,58 +943,37 @@ JsonArray JsonExpressionParser::parse_expr_selector(const JsonArray& nodelist) {
 
     // https://www.rfc-editor.org/rfc/rfc9535#name-semantics-5
     int idx = static_cast<int>(number);
-    JsonArray res;
-    for (auto& node : nodelist) {
+    auto select = [idx](const Json* node, NodeList& res) {
         // Nothing on non-arrays
-        if (node.get_type() != JsonType::ARRAY) {
-            continue;
+        if (node->get_type() != JsonType::ARRAY) {
+            return;
         }
         int cidx = idx;
         // We need to accept negative numbers
         if (cidx < 0) {
-            cidx = node.size() + cidx;
+            cidx = node->size() + cidx;
         }
         // Nothing on out of bounds
-        if (cidx < 0 || cidx >= node.size()) {
-            continue;
+        if (cidx < 0 || cidx >= node->size()) {
+            return;
         }
-        res.push_back(node[cidx]);
-    }
-
-    return res;
+        res.push_back(&node->get_array_ref()[cidx]);
+    };
+    return select_each(nodelist, budget, select, limit);
 }
 
-JsonArray JsonExpressionParser::parse_name(const JsonArray& nodelist,
-                                           std::string_view name) const {
-    JsonArray res;
-    for (auto& node : nodelist) {
-        if (node.get_type() == JsonType::OBJECT && node.obj_contains(name)) {
-            res.push_back(node[name]);
+NodeList JsonExpressionParser::parse_name(const NodeList& nodelist,
+                                          std::string_view name,
+                                          size_t limit) const {
+    auto select = [name](const Json* node, NodeList& res) {
+        if (node->get_type() != JsonType::OBJECT) {
+            return;
         }
-    }
-    return res;
-}
-
-bool valid_dot_name_first(unsigned char c) {
-    // name-first          = ALPHA /
-    //                       "_"   /
-    //                       %x80-D7FF /
-    //                          ; skip surrogate code points
-    //                       %xE000-10FFFF
-    // ALPHA               = %x41-5A / %x61-7A    ; A-Z / a-z
-
-    // Since we are assuming our input is in UTF-8 we don't
-    // need to check for surrogates.
-    // We allow all UTF-8 bytes with the (c > 127) check.
-    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_' ||
-           c > 127;
-}
-
-bool valid_dot_name_char(unsigned char c) {
-    // name-char           = name-first / DIGIT
-    // DIGIT               = %x30-39              ; 0-9
-
-    return valid_dot_name_first(c) || ('0' <= c && c <= '9');
+        if (const Json* child = node->obj_find(name)) {
+            res.push_back(child);
+        }
+    };
+    return select_each(nodelist, budget, select, limit);
 }
 
 bool valid_dot_notation_name(std::string_view name) {
@@ -331,10 +995,8 @@ bool valid_dot_notation_name(std::string_view name) {
     return true;
 }
 
-JsonArray
-JsonExpressionParser::parse_name_selector_dotted(const JsonArray& nodelist) {
-    assert_match('.');
-
+// Consumes a dot-notation name, without the dot
+std::string_view JsonExpressionParser::parse_dot_name() {
     int start = current;
     char c = peek();
     if (!valid_dot_name_first(c)) {
@@ -345,13 +1007,74 @@ JsonExpressionParser::parse_name_selector_dotted(const JsonArray& nodelist) {
         c = next(); // bounds checking is implicit
     }
 
-    return parse_name(nodelist,
-                      std::string_view(buffer).substr(start, current - start));
+    return std::string_view(buffer).substr(start, current - start);
+}
+
+NodeList
+JsonExpressionParser::parse_name_selector_dotted(const NodeList& nodelist,
+                                                 size_t limit) {
+    assert_match('.');
+    return parse_name(nodelist, parse_dot_name(), limit);
+}
+
+// Appends node and all of its descendants in document order
+void collect_descendants(const Json* node, NodeList& out, BudgetMeter& meter) {
+    meter.step(1);
+    out.push_back(node);
+    if (node->get_type() == JsonType::ARRAY) {
+        for (const Json& child : node->get_array_ref()) {
+            collect_descendants(&child, out, meter);
+        }
+    } else if (node->get_type() == JsonType::OBJECT) {
+        for (auto& kv : node->get_obj_ref()) {
+            collect_descendants(&kv.second, out, meter);
+        }
+    }
+}
+
+// The nodes of nodelist and all of their descendants
+NodeList collect_descendants(const NodeList& nodelist, BudgetTracker* budget) {
+    NodeList res;
+    BudgetMeter meter(budget);
+    for (const Json* node : nodelist) {
+        collect_descendants(node, res, meter);
+    }
+    meter.flush();
+    return res;
+}
+
+// https://www.rfc-editor.org/rfc/rfc9535#name-descendant-segment
+// descendant-segment  = ".." (bracketed-selection /
+//                             wildcard-selector /
+//                             member-name-shorthand)
+NodeList
+JsonExpressionParser::parse_descendant_segment(const NodeList& nodelist) {
+    assert_match('.');
+    assert_match('.');
+
+    if (match('*')) {
+        return select_children(collect_descendants(nodelist, budget), budget);
+    }
+
+    if (peek() != '[') {
+        std::string_view name = parse_dot_name();
+        // $..name is answered by the key index of the document, which
+        // is built once and reused by later queries
+        if (nodelist.size() == 1 && nodelist[0] == rootlist[0]) {
+            NodeList res;
+            res.push_nodes(rootlist[0]->key_index(budget).postings(name));
+            charge_nodes(res.size());
+            return res;
+        }
+        return parse_name(collect_descendants(nodelist, budget), name);
+    }
+
+    return parse_selector(collect_descendants(nodelist, budget));
 }
 
-JsonArray
-JsonExpressionParser::parse_name_selector_quoted(const JsonArray& nodelist,
-                                                 char quote) {
+NodeList
+JsonExpressionParser::parse_name_selector_quoted(const NodeList& nodelist,
+                                                 char quote, size_t limit) {
     assert_match('[');
     assert_match(quote);
 
@@ -372,20 +1095,554 @@ JsonExpressionParser::parse_name_selector_quoted(const JsonArray& nodelist,
     if (!match(']')) {
         syntax_err("unterminated name selector, expected ]");
     }
-    return parse_name(nodelist, name);
+    return parse_name(nodelist, name, limit);
 }
 
-JsonArray JsonExpressionParser::parse_selector(const JsonArray& nodelist) {
-    // I) We have three valid selectors inside brackets:
+// Compares two comparables as defined in
+// https://www.rfc-editor.org/rfc/rfc9535#name-comparisons
+// Both nodelists have at most one node, an empty one stands for Nothing
+bool compare_nodes(const NodeList& left, const NodeList& right,
+                   Comparison op) {
+    switch (op) {
+    case Comparison::EQ:
+        if (left.empty() || right.empty()) {
+            return left.empty() && right.empty();
+        }
+        return *left[0] == *right[0];
+    case Comparison::NE:
+        return !compare_nodes(left, right, Comparison::EQ);
+    case Comparison::LT: {
+        if (left.empty() || right.empty()) {
+            return false;
+        }
+        JsonType ltype = left[0]->get_type();
+        JsonType rtype = right[0]->get_type();
+        if (ltype == JsonType::NUMBER && rtype == JsonType::NUMBER) {
+            return left[0]->get_number() < right[0]->get_number();
+        }
+        // Byte order of UTF-8 is the same as code point order
+        if (ltype == JsonType::STRING && rtype == JsonType::STRING) {
+            return left[0]->get_string_ref() < right[0]->get_string_ref();
+        }
+        return false;
+    }
+    case Comparison::LE:
+        return compare_nodes(left, right, Comparison::LT) ||
+               compare_nodes(left, right, Comparison::EQ);
+    case Comparison::GT:
+        return compare_nodes(right, left, Comparison::LT);
+    case Comparison::GE:
+        return compare_nodes(right, left, Comparison::LE);
+    case Comparison::NONE:
+        break;
+    }
+    assert(0);
+}
+
+Comparison JsonExpressionParser::match_comparison() {
+    char c = peek();
+    char cn = peekNext();
+    if (c == '=' && cn == '=') {
+        next();
+        next();
+        return Comparison::EQ;
+    }
+    if (c == '!' && cn == '=') {
+        next();
+        next();
+        return Comparison::NE;
+    }
+    if (c == '<') {
+        next();
+        return match('=') ? Comparison::LE : Comparison::LT;
+    }
+    if (c == '>') {
+        next();
+        return match('=') ? Comparison::GE : Comparison::GT;
+    }
+    return Comparison::NONE;
+}
+
+// Matches true / false / null, but not e.g. "trueish"
+bool JsonExpressionParser::match_keyword(std::string_view keyword) {
+    if (std::string_view(buffer).substr(current, keyword.size()) != keyword) {
+        return false;
+    }
+    if (current + keyword.size() < buffer.size() &&
+        valid_dot_name_char(buffer[current + keyword.size()])) {
+        return false;
+    }
+    current += keyword.size();
+    return true;
+}
+
+// 'abc' or "abc", escapes aren't supported (same as in name selectors)
+NodeList JsonExpressionParser::parse_string_literal() {
+    char quote = peek();
+    assert(quote == '\'' || quote == '"');
+    next();
+
+    int start = current;
+    while (!reached_end() && peek() != quote) {
+        next();
+    }
+    if (reached_end()) {
+        syntax_err("query ended early: unterminated string literal");
+    }
+
+    NodeList res;
+    res.push_back(own(Json(buffer.substr(start, current - start))));
+    next();
+    return res;
+}
+
+// comparable          = literal / singular-query / function-expr
+// literal             = number / string-literal / true / false / null
+// Numbers, queries and functions are left to parse_inner, which
+// also allows arithmetic between them.
+NodeList JsonExpressionParser::parse_comparable(bool& is_literal) {
+    skip();
+    is_literal = true;
+    NodeList res;
+
+    char c = peek();
+    if (c == '\'' || c == '"') {
+        res = parse_string_literal();
+    } else if (match_keyword("true")) {
+        res.push_back(own(Json(true)));
+    } else if (match_keyword("false")) {
+        res.push_back(own(Json(false)));
+    } else if (match_keyword("null")) {
+        res.push_back(own(Json()));
+    } else {
+        is_literal = false;
+        res = parse_inner();
+    }
+
+    return res;
+}
+
+// basic-expr          = paren-expr / comparison-expr / test-expr
+bool JsonExpressionParser::parse_logical_basic() {
+    skip();
+
+    bool negate = false;
+    if (peek() == '!' && peekNext() != '=') {
+        next();
+        skip();
+        negate = true;
+    }
+
+    if (match('(')) {
+        bool res = parse_logical_or();
+        skip();
+        if (!match(')')) {
+            syntax_err("expected )");
+        }
+        return negate != res;
+    }
+
+    int start = current;
+    bool left_literal;
+    NodeList left = parse_comparable(left_literal);
+    skip();
+
+    Comparison op = match_comparison();
+    if (op == Comparison::NONE) {
+        // test-expr, holds if the query selects anything
+        if (left_literal) {
+            current = start;
+            syntax_err("a literal cannot be used as an existence test");
+        }
+        return negate != !left.empty();
+    }
+
+    if (negate) {
+        current = start;
+        syntax_err("! can only be applied to an existence test or to a "
+                   "parenthesized expression");
+    }
+
+    bool right_literal;
+    NodeList right = parse_comparable(right_literal);
+    if (left.size() > 1 || right.size() > 1) {
+        value_err("comparison operands must evaluate to at most one value");
+    }
+
+    return compare_nodes(left, right, op);
+}
+
+// logical-and-expr    = basic-expr *(S "&&" S basic-expr)
+bool JsonExpressionParser::parse_logical_and() {
+    bool res = parse_logical_basic();
+    skip();
+    while (peek() == '&' && peekNext() == '&') {
+        next();
+        next();
+        // Parsing and evaluation happen in the same pass, so there is
+        // no short-circuiting: the right side always needs to be parsed
+        bool rhs = parse_logical_basic();
+        res = res && rhs;
+        skip();
+    }
+    return res;
+}
+
+// logical-or-expr     = logical-and-expr *(S "||" S logical-and-expr)
+bool JsonExpressionParser::parse_logical_or() {
+    bool res = parse_logical_and();
+    skip();
+    while (peek() == '|' && peekNext() == '|') {
+        next();
+        next();
+        bool rhs = parse_logical_and();
+        res = res || rhs;
+        skip();
+    }
+    return res;
+}
+
+// Moves to the ] closing the filter selector without evaluating it
+void JsonExpressionParser::skip_filter() {
+    int depth = 0;
+    while (!reached_end()) {
+        char c = peek();
+        if (c == '\'' || c == '"') {
+            next();
+            while (!reached_end() && peek() != c) {
+                next();
+            }
+        } else if (c == '[' || c == '(') {
+            depth += 1;
+        } else if (c == ']' || c == ')') {
+            if (depth == 0) {
+                return;
+            }
+            depth -= 1;
+        }
+        next();
+    }
+}
+
+// Consumes the .a or ['a'] of @.a, false if it is something else
+bool JsonExpressionParser::parse_filter_field(std::string_view& name) {
+    int name_start;
+    if (peek() == '.' && valid_dot_name_first(peekNext())) {
+        next();
+        name_start = current;
+        while (valid_dot_name_char(peek())) {
+            next();
+        }
+        name = std::string_view(buffer).substr(name_start, current - name_start);
+        return true;
+    }
+    if (peek() == '[' && (peekNext() == '\'' || peekNext() == '"')) {
+        next();
+        char quote = peek();
+        next();
+        name_start = current;
+        while (!reached_end() && peek() != quote) {
+            next();
+        }
+        name = std::string_view(buffer).substr(name_start, current - name_start);
+        return match(quote) && match(']');
+    }
+    return false;
+}
+
+// Recognizes filters of the form `@.a > 1 && @['b'] <= 2 && ...`
+// which can be evaluated a column at a time instead of a node at a time.
+// Leaves this->current untouched if the filter is of any other form.
+bool JsonExpressionParser::parse_column_filter(
+    std::vector<ColumnPredicate>& predicates) {
+    int start = current;
+
+    while (true) {
+        skip();
+        if (!match('@')) {
+            break;
+        }
+
+        ColumnPredicate pred;
+        if (!parse_filter_field(pred.name)) {
+            break;
+        }
+
+        skip();
+        pred.op = match_comparison();
+        if (pred.op == Comparison::NONE) {
+            break;
+        }
+        skip();
+        if (!match_number(pred.literal)) {
+            break;
+        }
+        predicates.push_back(pred);
+
+        skip();
+        if (peek() == ']') {
+            return true;
+        }
+        if (peek() != '&' || peekNext() != '&') {
+            break;
+        }
+        next();
+        next();
+    }
+
+    current = start;
+    predicates.clear();
+    return false;
+}
+
+// Answers `@.a == literal` and conjunctions of numeric comparisons from
+// an index of the filtered array (see Json::build_index()), if one was
+// built for one of the fields. Leaves this->current untouched otherwise.
+bool JsonExpressionParser::parse_indexed_filter(const Json& array,
+                                                NodeList& res) {
+    int start = current;
+    const JsonArray& records = array.get_array_ref();
+
+    std::vector<ColumnPredicate> predicates;
+    if (parse_column_filter(predicates)) {
+        for (const ColumnPredicate& pred : predicates) {
+            const FieldIndex* index = array.field_index(pred.name);
+            if (index == nullptr || pred.op == Comparison::NE) {
+                continue;
+            }
+            std::vector<const Json*> candidates;
+            for (uint32_t row : index->compare(pred.op, pred.literal)) {
+                candidates.push_back(&records[row]);
+            }
+            // The rest of the predicates only see what the index let through
+            res = evaluate_column_filter(candidates, predicates);
+            return true;
+        }
+        current = start;
+        return false;
+    }
+
+    std::string_view name;
+    std::optional<Json> literal;
+    skip();
+    if (match('@') && parse_filter_field(name)) {
+        skip();
+        if (match_comparison() == Comparison::EQ) {
+            skip();
+            char quote = peek();
+            if (quote == '\'' || quote == '"') {
+                next();
+                int literal_start = current;
+                while (!reached_end() && peek() != quote) {
+                    next();
+                }
+                if (match(quote)) {
+                    literal = Json(buffer.substr(literal_start,
+                                                 current - 1 - literal_start));
+                }
+            } else if (match_keyword("true")) {
+                literal = Json(true);
+            } else if (match_keyword("false")) {
+                literal = Json(false);
+            } else if (match_keyword("null")) {
+                literal = Json();
+            }
+            skip();
+        }
+    }
+
+    const FieldIndex* index = literal ? array.field_index(name) : nullptr;
+    if (index == nullptr || peek() != ']') {
+        current = start;
+        return false;
+    }
+    for (uint32_t row : index->equal(*literal)) {
+        res.push_back(&records[row]);
+    }
+    return true;
+}
+
+NodeList JsonExpressionParser::evaluate_column_filter(
+    const std::vector<const Json*>& candidates,
+    const std::vector<ColumnPredicate>& preds) {
+    size_t n = candidates.size();
+    std::vector<unsigned char> mask(n, 1);
+    // Every field is gathered once, even if it appears in several
+    // predicates (e.g. a range)
+    std::map<std::string_view, Column> columns;
+
+    for (const ColumnPredicate& pred : preds) {
+        auto [it, _] =
+            columns.try_emplace(pred.name, candidates, pred.name, budget);
+        const Column& column = it->second;
+        for_chunks(budget, n, [&](size_t begin, size_t end) {
+            mask_compare(column.numbers() + begin, column.number_mask() + begin,
+                         end - begin, pred.op, pred.literal,
+                         mask.data() + begin);
+        });
+    }
+
+    // Compact the matching candidates
+    NodeList res;
+    for_chunks(budget, n, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (mask[i]) {
+                res.push_back(candidates[i]);
+            }
+        }
+    });
+    return res;
+}
+
+// https://www.rfc-editor.org/rfc/rfc9535#name-filter-selector
+NodeList
+JsonExpressionParser::parse_filter_selector(const NodeList& nodelist,
+                                            size_t limit) {
+    assert_match('[');
+    assert_match('?');
+
+    // The filter is applied to the children of every node
+    std::vector<const Json*> candidates;
+    BudgetMeter meter(budget);
+    for (const Json* node : nodelist) {
+        if (node->get_type() == JsonType::ARRAY) {
+            for (const Json& child : node->get_array_ref()) {
+                meter.step(1);
+                candidates.push_back(&child);
+            }
+        } else if (node->get_type() == JsonType::OBJECT) {
+            for (auto& kv : node->get_obj_ref()) {
+                meter.step(1);
+                candidates.push_back(&kv.second);
+            }
+        }
+    }
+    meter.flush();
+
+    NodeList res;
+    std::vector<ColumnPredicate> predicates;
+    if (candidates.empty()) {
+        // Nothing to evaluate the expression against
+        skip_filter();
+    } else if (nodelist.size() == 1 &&
+               nodelist[0]->get_type() == JsonType::ARRAY &&
+               parse_indexed_filter(*nodelist[0], res)) {
+        // Answered by an index
+    } else if (parse_column_filter(predicates)) {
+        res = evaluate_column_filter(candidates, predicates);
+    } else {
+        // Evaluate the expression once for every candidate,
+        // re-reading it from the start every time
+        std::vector<unsigned char> keep(candidates.size());
+        int start = current;
+        int end = current;
+        auto evaluate = [&](JsonExpressionParser& jep, size_t begin,
+                            size_t stop) {
+            BudgetMeter chunk_meter(budget);
+            for (size_t i = begin; i < stop; ++i) {
+                chunk_meter.step();
+                jep.current = start;
+                jep.filter_nodes.push_back(candidates[i]);
+                keep[i] = jep.parse_logical_or();
+                jep.filter_nodes.pop_back();
+            }
+            chunk_meter.flush();
+        };
+        if (limit != SIZE_MAX || profile != nullptr) {
+            // In order, until enough candidates were kept. The first one
+            // is always evaluated, so this->current ends up past the
+            // expression.
+            size_t kept = 0;
+            for (size_t i = 0; i < candidates.size() && kept < limit; ++i) {
+                evaluate(*this, i, i + 1);
+                kept += keep[i];
+            }
+            end = current;
+        } else if (candidates.size() < parallel_threshold()) {
+            evaluate(*this, 0, candidates.size());
+            end = current;
+        } else {
+            // Every chunk gets its own parser since evaluation moves
+            // this->current around and owns temporaries
+            parallel_ranges(
+                candidates.size(), 4 * ThreadPool::instance().size(),
+                [&](size_t chunk, size_t begin, size_t stop) {
+                    JsonExpressionParser jep = fork();
+                    evaluate(jep, begin, stop);
+                    if (chunk == 0) {
+                        end = jep.current;
+                    }
+                });
+        }
+        current = end;
+
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            if (keep[i]) {
+                res.push_back(candidates[i]);
+            }
+        }
+    }
+
+    skip();
+    if (!match(']')) {
+        syntax_err("expected ] after filter expression");
+    }
+    return res;
+}
+
+// The kind of the selector at this->current, for profiles
+const char* selector_kind(char p, char pn) {
+    if (p == '[') {
+        if (pn == '\'' || pn == '"') {
+            return "name";
+        } else if (pn == '?') {
+            return "filter";
+        } else if (pn == '*') {
+            return "wildcard";
+        }
+        return "bracket";
+    } else if (pn == '.') {
+        return "descendant";
+    } else if (pn == '*') {
+        return "wildcard";
+    }
+    return "name";
+}
+
+NodeList JsonExpressionParser::parse_selector(const NodeList& nodelist,
+                                              size_t limit) {
+    // The selectors charge the budget themselves, as they go
+    if (profile == nullptr) {
+        return dispatch_selector(nodelist, limit);
+    }
+
+    int start = current;
+    ProfileScope scope(profile, selector_kind(peek(), peekNext()), start);
+    NodeList res = dispatch_selector(nodelist, limit);
+    scope.finish(std::string_view(buffer).substr(start, current - start),
+                 nodelist, res);
+    return res;
+}
+
+NodeList JsonExpressionParser::dispatch_selector(const NodeList& nodelist,
+                                                 size_t limit) {
+    // I) We have four valid selectors inside brackets:
     // 1. (single or double) quote escaped: ["some field"]; ['some field']
     //     denoting an object key
     // 2. integer: [10]
     //     denoting an array index
     // 3. expression (non-rfc extension): [a.b["c"]]
     //     which evaluates to one 1. or 2.
+    // 4. filter: [?@.price > 10]
+    //     selecting the children for which the logical expression holds
+    // 5. wildcard: [*] and slice: [start:end:step]
+    //     selecting (a range of) all children
 
     // II) We also have the dot-shorthand: .something
-    //     denoting an object key
+    //     denoting an object key, or .* denoting all children
+
+    // III) And the descendant segment: ..something or ..[<one of I)>]
+    //     applying the selector to every node of the subtree
 
     // No error should be produced when applying indexing to objects
     // or keying to arrays, simply output nothing.
@@ -399,33 +1656,58 @@ JsonArray JsonExpressionParser::parse_selector(const JsonArray& nodelist) {
         // I)
         if (pn == '\'' || pn == '"') {
             // I) 1.
-            return parse_name_selector_quoted(nodelist, pn);
+            return parse_name_selector_quoted(nodelist, pn, limit);
+        } else if (pn == '?') {
+            // I) 4.
+            NodeList res = parse_filter_selector(nodelist, limit);
+            nodelist_query = true;
+            return res;
         } else {
             // I) 2. && 3.
-            return parse_expr_selector(nodelist);
+            return parse_expr_selector(nodelist, limit);
         }
+    } else if (pn == '.') {
+        // III)
+        NodeList res = parse_descendant_segment(nodelist);
+        nodelist_query = true;
+        return res;
+    } else if (pn == '*') {
+        // II) wildcard
+        next();
+        next();
+        nodelist_query = true;
+        return select_children(nodelist, budget);
     } else {
         // II)
-        return parse_name_selector_dotted(nodelist);
+        return parse_name_selector_dotted(nodelist, limit);
     }
 }
 
-JsonArray JsonExpressionParser::parse_path(std::string_view obj_beginning) {
+// Applies the segments that follow to res
+// first_only: the path is the whole argument of first()
+NodeList JsonExpressionParser::parse_path(NodeList res,
+                                          std::string_view obj_beginning,
+                                          bool first_only) {
     char c = peek();
     assert(c == '.' || c == '[');
 
-    JsonArray res = rootlist;
     if (obj_beginning != "") {
         // We need to parse this before we continue with this->current.
         // Doing it this way is an optimization circumventing the fact that
         // we needed to figure out whether this was a function call or
         // a path expression.
-        res = parse_name(res, obj_beginning);
+        res = parse_leading_name(obj_beginning);
     }
 
     while (!reached_end() && (c == '.' || c == '[')) {
+        // Only the last selector can stop early, the ones before it
+        // don't know which of their nodes the rest of the path needs
+        size_t limit = SIZE_MAX;
+        if (first_only && at_last_selector()) {
+            limit = 1;
+        }
         // this->current gets advanced inside \/
-        res = parse_selector(res);
+        res = parse_selector(res, limit);
         skip();
         c = peek();
     }
@@ -433,11 +1715,49 @@ JsonArray JsonExpressionParser::parse_path(std::string_view obj_beginning) {
     return res;
 }
 
+// Looks past the selector at this->current without evaluating it,
+// true if the expression ends right after it
+bool JsonExpressionParser::at_last_selector() {
+    int start = current;
+    int start_line = line;
+    if (match('.')) {
+        // descendant segment
+        match('.');
+    }
+    if (match('[')) {
+        // up to the matching ]
+        skip_filter();
+        next();
+    } else {
+        while (!reached_end() &&
+               (peek() == '*' || valid_dot_name_char(peek()))) {
+            next();
+        }
+    }
+    skip();
+    bool last = peek() == ')';
+    current = start;
+    line = start_line;
+    return last;
+}
+
+// The name a path may start with instead of $, "a" in "a.b"
+NodeList JsonExpressionParser::parse_leading_name(std::string_view name) {
+    int start = name.data() - buffer.data();
+    ProfileScope scope(profile, "name", start);
+    NodeList res = parse_name(rootlist, name);
+    scope.finish(name, rootlist, res);
+    return res;
+}
+
 bool is_binary_operator(char c) {
     return c == '+' || c == '-' || c == '*' || c == '/';
 }
 
-JsonArray JsonExpressionParser::parse_func_or_path() {
+NodeList JsonExpressionParser::parse_func_or_path() {
+    // first_argument may be left over from an earlier call, but a position
+    // which started the argument of first() once always does
+    bool first_only = static_cast<int>(current) == first_argument;
     char c;
     // $ means we are for sure in a path
     if (match('$')) {
@@ -446,11 +1766,27 @@ JsonArray JsonExpressionParser::parse_func_or_path() {
         skip();
         c = peek();
         if (c == '.' || c == '[') {
-            return parse_path("");
+            return parse_path(rootlist, "", first_only);
         } else {
             return rootlist;
         }
     }
+    // Same as above, but relative to the node being filtered
+    if (match('@')) {
+        if (filter_nodes.empty()) {
+            current -= 1;
+            syntax_err("@ can only be used inside a filter selector");
+        }
+        NodeList res;
+        res.push_back(filter_nodes.back());
+        skip();
+        c = peek();
+        if (c == '.' || c == '[') {
+            return parse_path(res, "", first_only);
+        } else {
+            return res;
+        }
+    }
     // Posibilities:
     // [
     //     spec segment
@@ -471,7 +1807,10 @@ JsonArray JsonExpressionParser::parse_func_or_path() {
 
     c = peek();
     if (c == '[') {
-        return parse_path("");
+        return parse_path(rootlist, "", first_only);
+    }
+    if (c == '\'' || c == '"') {
+        return parse_string_literal();
     }
 
     int start = current;
@@ -494,19 +1833,20 @@ JsonArray JsonExpressionParser::parse_func_or_path() {
             std::string_view sv =
                 std::string_view(buffer).substr(start, end - start);
             FuncType func = string_to_functype(sv);
-            return parse_func(func);
+            return parse_func(func, start);
         }
         case '.':
         case '[':
             // something. or something[ path
             return parse_path(
-                std::string_view(buffer).substr(start, end - start));
+                rootlist, std::string_view(buffer).substr(start, end - start),
+                first_only);
         default:
             if (expecting_control) {
                 // Could be valid if character is ) or ] etc.
                 // will let the caller handle it
-                return parse_name(rootlist, std::string_view(buffer).substr(
-                                                start, end - start));
+                return parse_leading_name(
+                    std::string_view(buffer).substr(start, end - start));
             }
 
             // Part of the name
@@ -523,8 +1863,8 @@ JsonArray JsonExpressionParser::parse_func_or_path() {
             } else {
                 // Could be an error or a valid subexpression like "[something]"
                 // the caller will decide
-                return parse_name(rootlist, std::string_view(buffer).substr(
-                                                start, end - start));
+                return parse_leading_name(
+                    std::string_view(buffer).substr(start, end - start));
             }
         }
 
@@ -535,8 +1875,8 @@ JsonArray JsonExpressionParser::parse_func_or_path() {
     }
 
     // something<end of string>
-    return parse_name(rootlist,
-                      std::string_view(buffer).substr(start, current - start));
+    return parse_leading_name(
+        std::string_view(buffer).substr(start, current - start));
 }
 
 // Returns error code:
@@ -566,16 +1906,92 @@ int apply_operator(double& result, double operand, Operator operation) {
     assert(0);
 }
 
+// Returns error code:
+// 0 - no error
+// 1 - division by zero
+// 2 - arrays of different lengths
+int apply_operator(std::vector<double>& result, double operand,
+                   Operator operation, BudgetTracker* budget) {
+    if (operation == Operator::DIV && operand == 0) {
+        return 1;
+    }
+    for_chunks(budget, result.size(), [&](size_t begin, size_t end) {
+        elementwise(result.data() + begin, end - begin, operation, operand);
+    });
+    return 0;
+}
+
+// Whether any of the numbers is zero, for divisions
+bool any_zero(const std::vector<double>& numbers, BudgetTracker* budget) {
+    bool zero = false;
+    for_chunks(budget, numbers.size(), [&](size_t begin, size_t end) {
+        zero = zero || any_zero(numbers.data() + begin, end - begin);
+    });
+    return zero;
+}
+
+// Stores `left <operation> operand` in operand
+int apply_operator(double left, std::vector<double>& operand,
+                   Operator operation, BudgetTracker* budget) {
+    if (operation == Operator::DIV && any_zero(operand, budget)) {
+        return 1;
+    }
+    for_chunks(budget, operand.size(), [&](size_t begin, size_t end) {
+        elementwise(left, operand.data() + begin, end - begin, operation);
+    });
+    return 0;
+}
+
+int apply_operator(std::vector<double>& result,
+                   const std::vector<double>& operand, Operator operation,
+                   BudgetTracker* budget) {
+    if (result.size() != operand.size()) {
+        return 2;
+    }
+    if (operation == Operator::DIV && any_zero(operand, budget)) {
+        return 1;
+    }
+    for_chunks(budget, result.size(), [&](size_t begin, size_t end) {
+        elementwise(result.data() + begin, operand.data() + begin,
+                    end - begin, operation);
+    });
+    return 0;
+}
+
+// Returns:
+// 0 - nodes is a single array of numbers, which are stored in numbers
+// 1 - nodes isn't a single array
+// 2 - nodes is an array with an element which isn't a number
+int numeric_array(const NodeList& nodes, std::vector<double>& numbers,
+                  BudgetTracker* budget) {
+    if (nodes.size() != 1 || nodes[0]->get_type() != JsonType::ARRAY) {
+        return 1;
+    }
+    const JsonArray& arr = nodes[0]->get_array_ref();
+    numbers.resize(arr.size());
+    BudgetMeter meter(budget);
+    for (size_t i = 0; i < arr.size(); ++i) {
+        meter.step();
+        if (arr[i].get_type() != JsonType::NUMBER) {
+            return 2;
+        }
+        numbers[i] = arr[i].get_number();
+    }
+    meter.flush();
+    return 0;
+}
+
 // Can be a subexpression
-JsonArray JsonExpressionParser::parse_inner() {
+NodeList JsonExpressionParser::parse_inner() {
     // The constructs we encounter here go to either
     // 1. match_number
     // 2. + - / * apply_operator
     // 3. parse_func_or_path
 
-    // The + - / * operators can only operate on numbers,
+    // The + - / * operators can only operate on numbers and arrays of
+    // numbers (elementwise, a number is broadcast over the array),
     // so we will keep an accumulative value for that case to save
-    // on overhead from putting / extracting numbers to JsonArray
+    // on overhead from putting / extracting numbers to nodelists
 
     // Whether the expression can end here
     // (in terms of the binary operators)
@@ -583,9 +1999,51 @@ JsonArray JsonExpressionParser::parse_inner() {
     // Only valid if (expecting == true)
     Operator last_op = Operator::NONE;
     double num_total = 0;
+    // Used instead of num_total once an array is an operand
+    bool is_array = false;
+    std::vector<double> array_total;
     // In case the expression doesn't use operators at all
-    JsonArray res;
-    bool first_is_non_numeric = false;
+    NodeList res;
+    bool first_kept = false;
+
+    auto check = [this](int err) {
+        if (err == 1) {
+            value_err("division by zero");
+        } else if (err == 2) {
+            value_err("binary operator on arrays of different lengths");
+        }
+    };
+    // The first operand is kept as is until an operator follows it, so
+    // that an expression without operators selects the nodes themselves
+    auto left_operand = [&]() {
+        if (!first_kept) {
+            return;
+        }
+        first_kept = false;
+        if (res.size() == 1 && res[0]->get_type() == JsonType::NUMBER) {
+            num_total = res[0]->get_number();
+            res = NodeList();
+            return;
+        }
+        int err = numeric_array(res, array_total, budget);
+        if (err == 1) {
+            value_err("expression to the left of binary operator doesn't "
+                      "resolve to [number]");
+        }
+        if (err == 2) {
+            value_err("array to the left of binary operator doesn't only "
+                      "contain numbers");
+        }
+        is_array = true;
+        res = NodeList();
+    };
+    auto apply_number = [&](double number, Operator operation) {
+        if (is_array) {
+            check(apply_operator(array_total, number, operation, budget));
+        } else {
+            check(apply_operator(num_total, number, operation));
+        }
+    };
 
     while (!reached_end()) {
         skip();
@@ -597,7 +2055,8 @@ JsonArray JsonExpressionParser::parse_inner() {
             if (!expecting) {
                 // x-y interpreted as x -y instead of x - y
                 if (number < 0) {
-                    num_total -= number;
+                    left_operand();
+                    apply_number(-number, Operator::MINUS);
                     continue;
                 }
 
@@ -606,10 +2065,7 @@ JsonArray JsonExpressionParser::parse_inner() {
                     "number");
             }
 
-            if (apply_operator(num_total, number, last_op) == 1) {
-                value_err("division by zero");
-            }
-
+            apply_number(number, last_op);
             expecting = false;
             continue;
         }
@@ -621,10 +2077,7 @@ JsonArray JsonExpressionParser::parse_inner() {
                 syntax_err("expected value, got operator");
             }
 
-            if (first_is_non_numeric) {
-                value_err("expression to the left of binary operator doesn't "
-                          "resolve to [number]");
-            }
+            left_operand();
 
             switch (c) {
             case '+':
@@ -649,7 +2102,7 @@ JsonArray JsonExpressionParser::parse_inner() {
             break;
         }
 
-        JsonArray cur;
+        NodeList cur;
         // Allowing arithmetic order of operations
         if (match('(')) {
             cur = parse_inner();
@@ -661,18 +2114,32 @@ JsonArray JsonExpressionParser::parse_inner() {
             cur = parse_func_or_path();
         }
 
-        if (cur.size() == 1 && cur[0].get_type() == JsonType::NUMBER) {
-            if (apply_operator(num_total, cur[0].get_number(), last_op) == 1) {
-                value_err("division by zero");
-            }
+        if (last_op == Operator::NONE) {
+            // Only copied into num_total or array_total if an operator
+            // follows
+            res = std::move(cur);
+            first_kept = true;
+        } else if (cur.size() == 1 &&
+                   cur[0]->get_type() == JsonType::NUMBER) {
+            apply_number(cur[0]->get_number(), last_op);
         } else {
-            if (last_op == Operator::NONE) {
-                res = std::move(cur);
-                first_is_non_numeric = true;
-            } else {
+            std::vector<double> operand;
+            int err = numeric_array(cur, operand, budget);
+            if (err == 1) {
                 value_err("expression to the right of binary operator doesn't "
                           "resolve to [number]");
             }
+            if (err == 2) {
+                value_err("array to the right of binary operator doesn't "
+                          "only contain numbers");
+            }
+            if (is_array) {
+                check(apply_operator(array_total, operand, last_op, budget));
+            } else {
+                check(apply_operator(num_total, operand, last_op, budget));
+                array_total = std::move(operand);
+                is_array = true;
+            }
         }
         expecting = false;
     }
@@ -681,16 +2148,29 @@ JsonArray JsonExpressionParser::parse_inner() {
         syntax_err("expected value");
     }
 
-    if (first_is_non_numeric) {
+    if (first_kept) {
+        return res;
+    }
+
+    if (is_array) {
+        JsonArray arr;
+        arr.reserve(array_total.size());
+        BudgetMeter meter(budget);
+        for (double number : array_total) {
+            meter.step();
+            arr.emplace_back(number);
+        }
+        meter.flush();
+        res.push_back(own(Json(arr)));
         return res;
     }
 
-    res.push_back(Json(num_total));
+    res.push_back(own(Json(num_total)));
     return res;
 }
 
 // The user supplied expression
-JsonArray JsonExpressionParser::parse() {
+NodeList JsonExpressionParser::parse() {
     current = 0;
     line = 1;
 
@@ -699,7 +2179,7 @@ JsonArray JsonExpressionParser::parse() {
         return rootlist;
     }
 
-    JsonArray res = parse_inner();
+    NodeList res = parse_inner();
 
     skip();
     if (!reached_end()) {
@@ -709,8 +2189,9 @@ JsonArray JsonExpressionParser::parse() {
     return res;
 }
 
-JsonArray parse(const Json& json, const std::string& expression) {
-    return JsonExpressionParser::parse(json, expression);
+JsonArray parse(const Json& json, const std::string& expression,
+               QueryProfile* profile, const QueryBudget* budget) {
+    return JsonExpressionParser::parse(json, expression, profile, budget);
 }
 
 } // namespace k4json
@@ -1,7 +1,14 @@
 #pragma once
 
+#include "budget.hpp"
+#include "column.hpp"
 #include "generic_parser.hpp"
 #include "json.hpp"
+#include "nodelist.hpp"
+#include "profile.hpp"
+
+#include <deque>
+#include <optional>
 
 namespace k4json {
 
@@ -19,7 +26,19 @@ enum class FuncType {
     MIN,
     MAX,
     SIZE,
-    NCHILDREN
+    NCHILDREN,
+    SUM,
+    AVG,
+    COUNT,
+    VARIANCE,
+    STDDEV,
+    COLUMN,
+    FIRST,
+    LOOKUP,
+    TOPK,
+    SORT,
+    DISTINCT,
+    COUNT_BY
 };
 
 enum class Operator {
@@ -30,42 +49,146 @@ enum class Operator {
     DIV
 };
 
+enum class Comparison {
+    NONE,
+    EQ,
+    NE,
+    LT,
+    LE,
+    GT,
+    GE
+};
+
+// One `@.name <op> number` comparison of a filter selector
+struct ColumnPredicate {
+    std::string_view name;
+    Comparison op;
+    double literal;
+};
+
 // Parses expressions which use JSONPath queries
 // https://www.rfc-editor.org/rfc/rfc9535
 // with slight differences
 class JsonExpressionParser : private Parser {
 public:
-    static JsonArray parse(const Json& json, const std::string& expression);
+    // If profile isn't null, what every step of the query did is
+    // recorded in it. If budget isn't null, the query throws ExprBudgetErr
+    // once it goes over it.
+    static JsonArray parse(const Json& json, const std::string& expression,
+                           QueryProfile* profile = nullptr,
+                           const QueryBudget* budget = nullptr);
+    // The nodes of json the expression selects, without copying them.
+    // Throws ExprValueErr if it computes values instead.
+    static std::vector<const Json*>
+    select(const Json& json, const std::string& expression,
+           QueryProfile* profile = nullptr,
+           const QueryBudget* budget = nullptr);
 
 private:
     JsonExpressionParser(const Json& json, const std::string& expression);
-    JsonArray parse();
-    JsonArray parse_inner();
+    NodeList parse();
+    NodeList parse_inner();
 
     [[noreturn]] void syntax_err(const std::string& msg) override;
     [[noreturn]] void value_err(const std::string& msg);
 
-    JsonArray parse_func_or_path();
-    JsonArray parse_func(FuncType func);
-    JsonArray parse_path(std::string_view obj_beginning);
+    JsonExpressionParser fork() const;
+    const Json* own(Json&& value);
+    void charge_nodes(size_t n);
+    NodeList own_number(double number);
+
+    NodeList parse_func_or_path();
+    NodeList parse_string_literal();
+    NodeList parse_func(FuncType func, int start);
+    NodeList parse_path(NodeList res, std::string_view obj_beginning,
+                        bool first_only = false);
+    NodeList parse_leading_name(std::string_view name);
+    bool at_last_selector();
 
-    JsonArray parse_name(const JsonArray& nodelist,
-                         std::string_view name) const;
-    JsonArray parse_name_selector_quoted(const JsonArray& nodelist, char quote);
-    JsonArray parse_name_selector_dotted(const JsonArray& nodelist);
-    JsonArray parse_expr_selector(const JsonArray& nodelist);
-    JsonArray parse_selector(const JsonArray& nodelist);
+    // limit: the caller only needs this many nodes of the result
+    NodeList parse_name(const NodeList& nodelist, std::string_view name,
+                        size_t limit = SIZE_MAX) const;
+    std::string_view parse_dot_name();
+    NodeList parse_name_selector_quoted(const NodeList& nodelist, char quote,
+                                        size_t limit);
+    NodeList parse_name_selector_dotted(const NodeList& nodelist,
+                                        size_t limit);
+    NodeList parse_descendant_segment(const NodeList& nodelist);
+    NodeList parse_expr_selector(const NodeList& nodelist, size_t limit);
+    NodeList parse_slice_selector(const NodeList& nodelist,
+                                  std::optional<long> start);
+    long slice_bound(const NodeList& value);
+    NodeList parse_selector(const NodeList& nodelist,
+                            size_t limit = SIZE_MAX);
+    NodeList dispatch_selector(const NodeList& nodelist, size_t limit);
+
+    NodeList parse_filter_selector(const NodeList& nodelist, size_t limit);
+    bool parse_filter_field(std::string_view& name);
+    bool parse_indexed_filter(const Json& array, NodeList& res);
+    bool parse_column_filter(std::vector<ColumnPredicate>& predicates);
+    NodeList
+    evaluate_column_filter(const std::vector<const Json*>& candidates,
+                           const std::vector<ColumnPredicate>& preds);
+    void skip_filter();
+    bool parse_logical_or();
+    bool parse_logical_and();
+    bool parse_logical_basic();
+    NodeList parse_comparable(bool& is_literal);
+    Comparison match_comparison();
+    bool match_keyword(std::string_view keyword);
 
     FuncType string_to_functype(std::string_view sv);
-    JsonArray evaluate_function(FuncType func, std::vector<Json>& arguments);
-    JsonArray evaluate_max(std::vector<Json>& arguments);
-    JsonArray evaluate_min(std::vector<Json>& arguments);
-    JsonArray evaluate_size(std::vector<Json>& arguments);
-    JsonArray evaluate_nchildren(std::vector<Json>& arguments);
+    NodeList evaluate_function(FuncType func, std::vector<NodeList>& arguments);
+    NodeList dispatch_function(FuncType func, std::vector<NodeList>& arguments);
+    NodeList evaluate_max(std::vector<NodeList>& arguments);
+    NodeList evaluate_min(std::vector<NodeList>& arguments);
+    NodeList evaluate_size(std::vector<NodeList>& arguments);
+    NodeList evaluate_nchildren(std::vector<NodeList>& arguments);
+    NodeList evaluate_aggregate(FuncType func,
+                                std::vector<NodeList>& arguments);
+    Column numeric_arguments(std::string_view func,
+                             std::vector<NodeList>& arguments);
+    NodeList evaluate_column(std::vector<NodeList>& arguments);
+    NodeList evaluate_first(std::vector<NodeList>& arguments);
+    NodeList evaluate_lookup(std::vector<NodeList>& arguments);
+    Column values_argument(std::string_view func,
+                           std::vector<NodeList>& arguments);
+    bool comparable_values(std::string_view func, const Column& values);
+    void check_groupable(std::string_view func, const Column& values);
+    NodeList evaluate_topk(std::vector<NodeList>& arguments);
+    NodeList evaluate_sort(std::vector<NodeList>& arguments);
+    NodeList evaluate_distinct(std::vector<NodeList>& arguments);
+    NodeList evaluate_count_by(std::vector<NodeList>& arguments);
 
-    JsonArray rootlist;
+    // Nodelists reference the nodes of the queried Json instead of
+    // copying them. Values computed during evaluation (numbers, literals,
+    // function results) are owned by the parser, see own().
+    NodeList rootlist;
+    // The node @ refers to, innermost filter selector last
+    std::vector<const Json*> filter_nodes;
+    // Where the argument of the innermost first() call starts. If it is a
+    // path, only the first node of its last selector is computed.
+    int first_argument = -1;
+    // Whether the expression being parsed has a selector (wildcard, slice,
+    // filter, descendant) or function which selects any number of nodes,
+    // as opposed to the name and index selectors of a singular query
+    bool nodelist_query = false;
+    // Whether the argument of the size() being evaluated is such a query
+    bool nodelist_argument = false;
+    QueryProfile* profile = nullptr;
+    // Shared with the forks evaluating chunks on other threads
+    BudgetTracker* budget = nullptr;
+    // Values created during evaluation. std::deque never relocates its
+    // elements, so the nodelists can point into it.
+    std::deque<Json> owned;
 };
 
-JsonArray parse(const Json& json, const std::string& expression);
+// The comparison of filter selectors, see expressions.cpp
+bool compare_nodes(const NodeList& left, const NodeList& right,
+                   Comparison op);
+
+JsonArray parse(const Json& json, const std::string& expression,
+               QueryProfile* profile = nullptr,
+               const QueryBudget* budget = nullptr);
 
 } // namespace k4json
@@ -0,0 +1,91 @@
+#include "groups.hpp"
+
+#include <bit>
+#include <functional>
+#include <string_view>
+
+namespace k4json {
+
+ValueGroups::ValueGroups(const Column& values) : values(values) {
+    size_t n = values.size();
+    // At most half full, so probe sequences stay short
+    size_t capacity = std::bit_ceil(2 * n + 1);
+    size_t mask = capacity - 1;
+    // Group index + 1, 0 for an empty slot
+    std::vector<uint32_t> slots(capacity, 0);
+
+    for (size_t row = 0; row < n; ++row) {
+        size_t slot = hash(row) & mask;
+        while (true) {
+            uint32_t group = slots[slot];
+            if (group == 0) {
+                slots[slot] = _rows.size() + 1;
+                _rows.push_back(row);
+                _counts.push_back(1);
+                break;
+            }
+            if (equal(_rows[group - 1], row)) {
+                _counts[group - 1] += 1;
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+}
+
+size_t ValueGroups::first_ungroupable(const Column& values) {
+    for (size_t row = 0; row < values.size(); ++row) {
+        const Json* node = values.node(row);
+        if (node == nullptr || node->get_type() == JsonType::ARRAY ||
+            node->get_type() == JsonType::OBJECT) {
+            return row;
+        }
+    }
+    return values.size();
+}
+
+const std::vector<size_t>& ValueGroups::rows() const {
+    return _rows;
+}
+
+const std::vector<size_t>& ValueGroups::counts() const {
+    return _counts;
+}
+
+uint64_t ValueGroups::hash(size_t row) const {
+    uint64_t h;
+    if (values.number_mask()[row]) {
+        double number = values.numbers()[row];
+        // -0 == 0
+        h = std::bit_cast<uint64_t>(number == 0 ? 0.0 : number);
+    } else if (values.string_mask()[row]) {
+        h = std::hash<std::string_view>()(values.strings()[row]);
+    } else {
+        const Json* node = values.node(row);
+        h = node->is_null() ? 0 : 1 + node->get_bool();
+    }
+    h += static_cast<uint64_t>(values.node(row)->get_type());
+    // Spreads the bits of numbers, which often differ only in the
+    // exponent or the high bits of the mantissa
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+bool ValueGroups::equal(size_t a, size_t b) const {
+    const Json* x = values.node(a);
+    const Json* y = values.node(b);
+    if (x->get_type() != y->get_type()) {
+        return false;
+    }
+    if (values.number_mask()[a]) {
+        return values.numbers()[a] == values.numbers()[b];
+    }
+    if (values.string_mask()[a]) {
+        return values.strings()[a] == values.strings()[b];
+    }
+    return x->is_null() || x->get_bool() == y->get_bool();
+}
+
+} // namespace k4json
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "column.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace k4json {
+
+// The rows of a column grouped by value, with an open addressing hash
+// table (linear probing) over the column's buffers, so no value is copied.
+// Values are compared by type and value: 1 and "1" are different groups.
+// Every row must be a number, string, boolean or null, see first_ungroupable().
+class ValueGroups {
+public:
+    explicit ValueGroups(const Column& values);
+
+    // Index of the first row which can't be grouped, values.size() if there
+    // is none
+    static size_t first_ungroupable(const Column& values);
+
+    // First row of every group, in order of appearance
+    const std::vector<size_t>& rows() const;
+    // Amount of rows in every group, in the same order
+    const std::vector<size_t>& counts() const;
+
+private:
+    uint64_t hash(size_t row) const;
+    bool equal(size_t a, size_t b) const;
+
+    const Column& values;
+    std::vector<size_t> _rows;
+    std::vector<size_t> _counts;
+};
+
+} // namespace k4json
@@ -0,0 +1,204 @@
+#include "index.hpp"
+#include "budget.hpp"
+#include "json.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+namespace k4json {
+
+KeyIndex::KeyIndex(const Json& root, BudgetTracker* budget) {
+    BudgetMeter meter(budget);
+    add(root, meter);
+    meter.flush();
+}
+
+// The children of an object are recorded before descending into them,
+// so every posting list ends up in the order of
+// https://www.rfc-editor.org/rfc/rfc9535#name-semantics-15
+void KeyIndex::add(const Json& node, BudgetMeter& meter) {
+    meter.step(1);
+    switch (node.get_type()) {
+    case JsonType::OBJECT:
+        for (auto& kv : node.get_obj_ref()) {
+            index[kv.first].push_back(&kv.second);
+        }
+        for (auto& kv : node.get_obj_ref()) {
+            add(kv.second, meter);
+        }
+        break;
+    case JsonType::ARRAY:
+        for (auto& elem : node.get_array_ref()) {
+            add(elem, meter);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+const std::vector<const Json*>&
+KeyIndex::postings(std::string_view key) const {
+    static const std::vector<const Json*> empty;
+    if (auto it = index.find(key); it != index.end()) {
+        return it->second;
+    }
+    return empty;
+}
+
+size_t KeyIndex::memory_usage() const {
+    // Red-black tree nodes carry three pointers and a color on top of
+    // the stored pair
+    size_t node_overhead = 4 * sizeof(void*);
+    size_t res = sizeof(KeyIndex);
+    for (auto& kv : index) {
+        res += node_overhead + sizeof(kv);
+        res += kv.second.capacity() * sizeof(const Json*);
+    }
+    return res;
+}
+
+FieldIndex::FieldIndex(const JsonArray& records, std::string_view field) {
+    for (uint32_t row = 0; row < records.size(); ++row) {
+        const Json& record = records[row];
+        if (record.get_type() != JsonType::OBJECT) {
+            continue;
+        }
+        const Json* value = record.obj_find(field);
+        if (value == nullptr) {
+            continue;
+        }
+
+        switch (value->get_type()) {
+        case JsonType::NUMBER:
+            numbers[value->get_number()].push_back(row);
+            sorted.emplace_back(value->get_number(), row);
+            break;
+        case JsonType::STRING:
+            strings[value->get_string_ref()].push_back(row);
+            break;
+        case JsonType::BOOL:
+            (value->get_bool() ? trues : falses).push_back(row);
+            break;
+        case JsonType::NULLVAL:
+            nulls.push_back(row);
+            break;
+        default:
+            break;
+        }
+    }
+    std::sort(sorted.begin(), sorted.end());
+}
+
+std::vector<uint32_t> FieldIndex::equal(const Json& value) const {
+    switch (value.get_type()) {
+    case JsonType::NUMBER:
+        if (auto it = numbers.find(value.get_number()); it != numbers.end()) {
+            return it->second;
+        }
+        break;
+    case JsonType::STRING:
+        if (auto it = strings.find(value.get_string_ref());
+            it != strings.end()) {
+            return it->second;
+        }
+        break;
+    case JsonType::BOOL:
+        return value.get_bool() ? trues : falses;
+    case JsonType::NULLVAL:
+        return nulls;
+    default:
+        break;
+    }
+    return {};
+}
+
+std::vector<uint32_t> FieldIndex::compare(Comparison op, double literal) const {
+    if (op == Comparison::EQ) {
+        return equal(Json(literal));
+    }
+
+    auto below = [](const std::pair<double, uint32_t>& entry, double value) {
+        return entry.first < value;
+    };
+    auto above = [](double value, const std::pair<double, uint32_t>& entry) {
+        return value < entry.first;
+    };
+    auto first = sorted.begin();
+    auto last = sorted.end();
+    switch (op) {
+    case Comparison::LT:
+        last = std::lower_bound(first, last, literal, below);
+        break;
+    case Comparison::LE:
+        last = std::upper_bound(first, last, literal, above);
+        break;
+    case Comparison::GT:
+        first = std::upper_bound(first, last, literal, above);
+        break;
+    case Comparison::GE:
+        first = std::lower_bound(first, last, literal, below);
+        break;
+    default:
+        assert(0);
+    }
+
+    // Back to document order
+    std::vector<uint32_t> rows;
+    rows.reserve(last - first);
+    for (auto it = first; it != last; ++it) {
+        rows.push_back(it->second);
+    }
+    std::sort(rows.begin(), rows.end());
+    return rows;
+}
+
+size_t FieldIndex::memory_usage() const {
+    // Hash nodes carry a next pointer and the cached hash
+    size_t node_overhead = 2 * sizeof(void*);
+    size_t res = sizeof(FieldIndex);
+    for (auto& kv : numbers) {
+        res += node_overhead + sizeof(kv) + kv.second.capacity() * 4;
+    }
+    for (auto& kv : strings) {
+        res += node_overhead + sizeof(kv) + kv.second.capacity() * 4;
+    }
+    res += (numbers.bucket_count() + strings.bucket_count()) * sizeof(void*);
+    res += (trues.capacity() + falses.capacity() + nulls.capacity()) * 4;
+    res += sorted.capacity() * sizeof(sorted[0]);
+    return res;
+}
+
+IndexCache::IndexCache(const IndexCache&) {}
+
+IndexCache& IndexCache::operator=(const IndexCache&) {
+    clear();
+    return *this;
+}
+
+IndexCache::~IndexCache() {
+    clear();
+}
+
+JsonIndexes& IndexCache::get() {
+    JsonIndexes* res = indexes.load();
+    if (res == nullptr) {
+        res = new JsonIndexes();
+        indexes.store(res);
+    }
+    return *res;
+}
+
+JsonIndexes* IndexCache::find() const {
+    return indexes.load();
+}
+
+bool IndexCache::empty() const {
+    return indexes.load() == nullptr;
+}
+
+void IndexCache::clear() {
+    delete indexes.exchange(nullptr);
+}
+
+} // namespace k4json
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "budget.hpp"
+#include "expressions.hpp"
+#include "json.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace k4json {
+
+// Maps every object key inside a Json to the values stored under that key,
+// in document order. Answers $..key without walking the whole tree.
+// Keys and values point into the indexed Json, so the index is only valid
+// as long as it isn't modified.
+class KeyIndex {
+public:
+    // Building visits every node of root, which is charged to budget
+    explicit KeyIndex(const Json& root, BudgetTracker* budget = nullptr);
+
+    // Empty if the key doesn't appear anywhere
+    const std::vector<const Json*>& postings(std::string_view key) const;
+    // Approximate number of bytes used by the index
+    size_t memory_usage() const;
+
+private:
+    void add(const Json& node, BudgetMeter& meter);
+
+    std::map<std::string_view, std::vector<const Json*>, std::less<>> index;
+};
+
+// Index of the records of an array by the value of one of their fields:
+// a hash index for equality and a sorted one for numeric ranges. Records
+// which aren't objects, don't have the field or have an array or object
+// there aren't in it. Rows are positions in the array.
+class FieldIndex {
+public:
+    FieldIndex(const JsonArray& records, std::string_view field);
+
+    // Rows whose field == value, ascending
+    std::vector<uint32_t> equal(const Json& value) const;
+    // Rows whose field is a number with `field op literal`, ascending.
+    // op can't be NE, records without a numeric field match that too.
+    std::vector<uint32_t> compare(Comparison op, double literal) const;
+    // Approximate number of bytes used by the index
+    size_t memory_usage() const;
+
+private:
+    std::unordered_map<double, std::vector<uint32_t>> numbers;
+    // Point into the indexed array
+    std::unordered_map<std::string_view, std::vector<uint32_t>> strings;
+    std::vector<uint32_t> trues;
+    std::vector<uint32_t> falses;
+    std::vector<uint32_t> nulls;
+    // (value, row) of the numeric fields, sorted
+    std::vector<std::pair<double, uint32_t>> sorted;
+};
+
+// All of the indexes built over a Json
+struct JsonIndexes {
+    std::unique_ptr<KeyIndex> keys;
+    // Set once keys is built, so that it can be read without a lock
+    std::atomic<const KeyIndex*> built_keys = nullptr;
+    // Only on arrays, see Json::build_index()
+    std::map<std::string, std::unique_ptr<FieldIndex>, std::less<>> fields;
+};
+
+} // namespace k4json
@@ -1,11 +1,14 @@
 #include "json.hpp"
 #include "expressions.hpp"
+#include "index.hpp"
 #include "loader.hpp"
 #include "utils.hpp"
+#include "writer.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
-#include <format>
+#include <mutex>
 #include <variant>
 
 namespace k4json {
@@ -13,31 +16,74 @@ namespace k4json {
 Json::Json() {
     _is_null = true;
     val = false; // set to null just in case
+    _nchildren = 1;
+    _depth = 0;
 }
 
 Json::Json(const bool v) {
     _is_null = false;
     val = v;
+    _nchildren = 1;
+    _depth = 0;
 }
 
 Json::Json(const double num) {
     _is_null = false;
     val = num;
+    _nchildren = 1;
+    _depth = 0;
 }
 
 Json::Json(const std::string& str) {
     _is_null = false;
     val = str;
+    _nchildren = 1;
+    _depth = 0;
 }
 
 Json::Json(const JsonObject& jobj) {
     _is_null = false;
     val = jobj;
+    recompute_stats();
 }
 
 Json::Json(const JsonArray& jarray) {
     _is_null = false;
     val = jarray;
+    recompute_stats();
+}
+
+Json::Json(JsonObject&& jobj) {
+    _is_null = false;
+    val = std::move(jobj);
+    recompute_stats();
+}
+
+Json::Json(JsonArray&& jarray) {
+    _is_null = false;
+    val = std::move(jarray);
+    recompute_stats();
+}
+
+// Accounts for a child added to this container
+void Json::add_stats(const Json& child) {
+    _nchildren += child._nchildren;
+    _depth = std::max(_depth, child._depth + 1);
+}
+
+// Only looks at the (already computed) statistics of direct children
+void Json::recompute_stats() {
+    _nchildren = 1;
+    _depth = 0;
+    if (std::holds_alternative<JsonArray>(val)) {
+        for (auto& x : std::get<JsonArray>(val)) {
+            add_stats(x);
+        }
+    } else if (std::holds_alternative<JsonObject>(val)) {
+        for (auto& x : std::get<JsonObject>(val)) {
+            add_stats(x.second);
+        }
+    }
 }
 
 Json Json::evaluate_expr(const std::string& expr) const {
@@ -47,7 +93,9 @@ Json Json::evaluate_expr(const std::string& expr) const {
 // valid only for JsonType::ARRAY
 void Json::array_add(const Json& elem) {
     if (std::holds_alternative<JsonArray>(val)) {
+        indexes.clear();
         std::get<JsonArray>(val).push_back(elem);
+        add_stats(elem);
     } else {
         throw JsonTypeErr("cannot array_add(), instance isnt JsonType::ARRAY");
     }
@@ -56,7 +104,22 @@ void Json::array_add(const Json& elem) {
 // valid only for JsonType::OBJECT
 void Json::obj_add(const KeyedJson& key_val) {
     if (std::holds_alternative<JsonObject>(val)) {
-        std::get<JsonObject>(val)[key_val.first] = key_val.second;
+        indexes.clear();
+        auto [it, inserted] =
+            std::get<JsonObject>(val).try_emplace(key_val.first);
+        int old_nchildren = it->second._nchildren;
+        int old_depth = it->second._depth;
+        it->second = key_val.second;
+
+        if (!inserted && old_depth + 1 == _depth) {
+            // The replaced value might have been the deepest one
+            recompute_stats();
+            return;
+        }
+        if (!inserted) {
+            _nchildren -= old_nchildren;
+        }
+        add_stats(it->second);
     } else {
         throw JsonTypeErr("cannot obj_add(), instance isnt JsonType::OBJECT");
     }
@@ -122,6 +185,33 @@ JsonObject Json::get_obj() const {
     throw JsonTypeErr("get_obj() called on Json which isnt JsonType::OBJECT");
 }
 
+// valid only for JsonType::STRING
+const std::string& Json::get_string_ref() const {
+    if (std::holds_alternative<std::string>(val)) {
+        return std::get<std::string>(val);
+    }
+    throw JsonTypeErr(
+        "get_string_ref() called on Json which isnt JsonType::STRING");
+}
+
+// valid only for JsonType::ARRAY
+const JsonArray& Json::get_array_ref() const {
+    if (std::holds_alternative<JsonArray>(val)) {
+        return std::get<JsonArray>(val);
+    }
+    throw JsonTypeErr(
+        "get_array_ref() called on Json which isnt JsonType::ARRAY");
+}
+
+// valid only for JsonType::OBJECT
+const JsonObject& Json::get_obj_ref() const {
+    if (std::holds_alternative<JsonObject>(val)) {
+        return std::get<JsonObject>(val);
+    }
+    throw JsonTypeErr(
+        "get_obj_ref() called on Json which isnt JsonType::OBJECT");
+}
+
 // valid only for JsonType::ARRAY
 Json Json::operator[](const int idx) const {
     if (std::holds_alternative<JsonArray>(val)) {
@@ -135,7 +225,7 @@ Json Json::operator[](const int idx) const {
 // valid only for JsonType::OBJECT, must contain key
 Json Json::operator[](std::string_view key) const {
     if (std::holds_alternative<JsonObject>(val)) {
-        auto obj = std::get<JsonObject>(val);
+        const JsonObject& obj = std::get<JsonObject>(val);
         if (auto kv = obj.find(key); kv != obj.end()) {
             return kv->second;
         } else {
@@ -157,6 +247,29 @@ bool Json::obj_contains(std::string_view key) const {
     }
 }
 
+// valid only for JsonType::OBJECT
+// Returns nullptr if the key isn't present
+const Json* Json::obj_find(std::string_view key) const {
+    if (std::holds_alternative<JsonObject>(val)) {
+        const JsonObject& obj = std::get<JsonObject>(val);
+        if (auto kv = obj.find(key); kv != obj.end()) {
+            return &kv->second;
+        }
+        return nullptr;
+    } else {
+        throw JsonTypeErr("obj_find called on Json which isnt JsonType::OBJECT");
+    }
+}
+
+bool Json::operator==(const Json& other) const {
+    if (_is_null || other._is_null) {
+        return _is_null == other._is_null;
+    }
+    // std::variant compares the held alternatives, which recurses
+    // into this operator for arrays and objects
+    return val == other.val;
+}
+
 // Returns the number of elements inside this one, shallowly
 int Json::size() const {
     switch (get_type()) {
@@ -178,18 +291,67 @@ int Json::size() const {
 
 // Returns the amount Jsons in this Json, recursively
 int Json::nchildren() const {
-    JsonType type = get_type();
-    int res = 1;
-    if (type == JsonType::ARRAY) {
-        for (auto& x : std::get<JsonArray>(val)) {
-            res += x.nchildren();
-        }
-    } else if (type == JsonType::OBJECT) {
-        for (auto& x : std::get<JsonObject>(val)) {
-            res += x.second.nchildren();
+    return _nchildren;
+}
+
+// Returns the length of the longest path to a node inside this Json,
+// 0 for scalars and empty containers
+int Json::depth() const {
+    return _depth;
+}
+
+const KeyIndex& Json::key_index(BudgetTracker* budget) const {
+    // Once built, queries read it without taking the lock
+    if (JsonIndexes* idx = indexes.find()) {
+        if (const KeyIndex* keys =
+                idx->built_keys.load(std::memory_order_acquire)) {
+            return *keys;
         }
     }
 
+    // Filters evaluated on the thread pool may ask for it concurrently.
+    // Builds are rare, so all documents share the lock.
+    static std::mutex build_lock;
+    std::lock_guard<std::mutex> lk(build_lock);
+    JsonIndexes& idx = indexes.get();
+    if (!idx.keys) {
+        idx.keys = std::make_unique<KeyIndex>(*this, budget);
+        idx.built_keys.store(idx.keys.get(), std::memory_order_release);
+    }
+    return *idx.keys;
+}
+
+void Json::build_index(const std::string& path,
+                       const std::string& field) const {
+    std::vector<const Json*> nodes = JsonExpressionParser::select(*this, path);
+    if (nodes.size() != 1 || nodes[0]->get_type() != JsonType::ARRAY) {
+        throw JsonTypeErr("build_index() path must select exactly one array");
+    }
+    const Json& array = *nodes[0];
+    array.indexes.get().fields[field] =
+        std::make_unique<FieldIndex>(array.get_array_ref(), field);
+}
+
+const FieldIndex* Json::field_index(std::string_view field) const {
+    if (indexes.empty()) {
+        return nullptr;
+    }
+    JsonIndexes& idx = indexes.get();
+    if (auto it = idx.fields.find(field); it != idx.fields.end()) {
+        return it->second.get();
+    }
+    return nullptr;
+}
+
+size_t Json::index_memory_usage() const {
+    if (indexes.empty()) {
+        return 0;
+    }
+    JsonIndexes& idx = indexes.get();
+    size_t res = idx.keys ? idx.keys->memory_usage() : 0;
+    for (auto& kv : idx.fields) {
+        res += kv.second->memory_usage();
+    }
     return res;
 }
 
@@ -207,7 +369,7 @@ std::vector<std::string> Json::get_obj_keys() const {
             "get_obj_keys() called on Json which isnt JsonType::OBJECT");
     }
 
-    JsonObject jobj = std::get<JsonObject>(val);
+    const JsonObject& jobj = std::get<JsonObject>(val);
     std::vector<std::string> keys;
     keys.reserve(jobj.size());
     for (auto& it : jobj) {
@@ -217,59 +379,13 @@ std::vector<std::string> Json::get_obj_keys() const {
 }
 
 std::string Json::to_string() const {
-    return to_string(1);
+    return to_string(FormatOptions());
 }
 
-std::string Json::to_string(int indent) const {
-    // using 2-space indentation
-    std::string s_indent_less((indent - 1) * 2, ' ');
-    std::string s_indent = s_indent_less + "  ";
-    std::string res;
-
-    switch (get_type()) {
-    case JsonType::OBJECT: {
-        if (size() == 0) {
-            return "{ }";
-        }
-        res = "{\n";
-        std::vector<std::string> keys = get_obj_keys();
-        int n = keys.size();
-        for (int i = 0; i < n - 1; ++i) {
-            res += s_indent + '"' + keys[i] +
-                   "\": " + (*this)[keys[i]].to_string(indent + 1) + ",\n";
-        }
-        res += s_indent + '"' + keys[n - 1] +
-               "\": " + (*this)[keys[n - 1]].to_string(indent + 1) + '\n';
-        res += s_indent_less + "}";
-        return res;
-    }
-    case JsonType::ARRAY: {
-        if (size() == 0) {
-            return "[ ]";
-        }
-        res = "[\n";
-        for (int i = 0; i < size() - 1; ++i) {
-            res += s_indent + (*this)[i].to_string(indent + 1) + ",\n";
-        }
-        res += s_indent + (*this)[size() - 1].to_string(indent + 1) + '\n';
-        res += s_indent_less + "]";
-        return res;
-    }
-    case JsonType::STRING:
-        return '"' + escape_string(get_string()) + '"';
-    case JsonType::NUMBER: {
-        // std::to_string doesn't work well on floating point
-        // https://www.open-std.org/jtc1/sc22/wg21/docs/papers/2022/p2587r3.html
-        return std::format("{}", get_number());
-    }
-    case JsonType::BOOL:
-        return get_bool() ? "true" : "false";
-    case JsonType::NULLVAL:
-        return "null";
-    case JsonType::INVALID:
-    default:
-        throw JsonTypeErr("Serialization failed, impossible json type.");
-    }
+std::string Json::to_string(const FormatOptions& options) const {
+    JsonWriter writer(options);
+    writer.write(*this);
+    return writer.take();
 }
 
 Json from_string(const std::string& str) {
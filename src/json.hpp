@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <map>
 #include <stdexcept>
 #include <string>
@@ -23,7 +24,11 @@ enum class JsonType {
     NULLVAL
 };
 
+class BudgetTracker;
 class Json;
+class KeyIndex;
+class FieldIndex;
+struct JsonIndexes;
 typedef std::pair<std::string, Json> KeyedJson;
 // The map is good for wide jsons. For deep jsons, vector would be better.
 // Could be optimized with trie
@@ -31,6 +36,37 @@ typedef std::pair<std::string, Json> KeyedJson;
 typedef std::map<std::string, Json, std::less<>> JsonObject;
 typedef std::vector<Json> JsonArray;
 
+// Owns the indexes built over a Json (see index.hpp).
+// The indexes point into the nodes they were built from, so a copy of
+// the Json starts without any.
+class IndexCache {
+public:
+    IndexCache() = default;
+    IndexCache(const IndexCache&);
+    IndexCache& operator=(const IndexCache&);
+    ~IndexCache();
+
+    JsonIndexes& get();
+    // Nullptr if nothing was built, without creating anything
+    JsonIndexes* find() const;
+    bool empty() const;
+    void clear();
+
+private:
+    std::atomic<JsonIndexes*> indexes = nullptr;
+};
+
+// How Json::to_string() and JsonWriter lay out the output. Object members
+// always come sorted by key, since that's how JsonObject stores them.
+struct FormatOptions {
+    // No whitespace at all
+    bool minified = false;
+    // Spaces per nesting level, unless minified
+    int indent = 2;
+    // Characters outside of ASCII are written as \uXXXX escapes
+    bool ascii_only = false;
+};
+
 // Class used to represent a JSON object in memory.
 class Json {
 public:
@@ -40,6 +76,8 @@ public:
     explicit Json(const std::string& str);  // string literal
     explicit Json(const JsonObject& jmap);  // object
     explicit Json(const JsonArray& jarray); // array
+    explicit Json(JsonObject&& jmap);
+    explicit Json(JsonArray&& jarray);
 
     static Json from_string(const std::string& str);
     static Json from_file(const std::string& file_name);
@@ -58,23 +96,52 @@ public:
     std::string get_string() const;
     JsonArray get_array() const;
     JsonObject get_obj() const;
+    // non-copying variants of the above
+    const std::string& get_string_ref() const;
+    const JsonArray& get_array_ref() const;
+    const JsonObject& get_obj_ref() const;
 
     Json operator[](const int idx) const;
     Json operator[](std::string_view key) const;
     bool obj_contains(std::string_view key) const;
+    const Json* obj_find(std::string_view key) const;
     std::vector<std::string> get_obj_keys() const;
 
     int size() const;
     int nchildren() const;
+    int depth() const;
+
+    // Index of every object key in this Json, built on first use (which
+    // is charged to budget, and throws ExprBudgetErr if it goes over it).
+    // Modifying this Json drops it.
+    const KeyIndex& key_index(BudgetTracker* budget = nullptr) const;
+    // Indexes the records of the array at path by their field, for
+    // filters like `[?@.field == 123]` and lookup() to use. The array's
+    // indexes are dropped when it is modified.
+    void build_index(const std::string& path, const std::string& field) const;
+    // Index of this array by field, nullptr unless built
+    const FieldIndex* field_index(std::string_view field) const;
+    // Bytes used by the indexes currently built over this Json
+    size_t index_memory_usage() const;
+
+    // deep equality, numbers are compared by value
+    bool operator==(const Json& other) const;
 
     // serialize the json object to a string
     std::string to_string() const;
+    std::string to_string(const FormatOptions& options) const;
 
 private:
-    std::string to_string(int indent) const;
+    void add_stats(const Json& child);
+    void recompute_stats();
 
     bool _is_null;
     std::variant<JsonObject, JsonArray, std::string, double, bool> val;
+    mutable IndexCache indexes;
+    // Subtree statistics, maintained on construction and modification
+    // so reading them is O(1)
+    int _nchildren;
+    int _depth;
 };
 
 Json from_string(const std::string& str);
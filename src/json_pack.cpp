@@ -0,0 +1,63 @@
+#include "json.hpp"
+#include "loader.hpp"
+#include "packed.hpp"
+
+#include <fstream>
+#include <iostream>
+
+const char* usage =
+    "usage: ./json_pack [--shared] <json file> <packed file or shared name>";
+
+// Converts a json file into the packed form (see packed.hpp), which
+// json_eval opens without parsing it. With --shared, it is published as a
+// shared memory object instead of written to a file.
+int main(int argc, char* argv[]) {
+    bool shared = argc == 4 && std::string(argv[1]) == "--shared";
+    if (argc != 3 && !shared) {
+        std::cout << usage << '\n';
+        return 1;
+    }
+    const char* input = argv[argc - 2];
+    const char* output = argv[argc - 1];
+
+    using namespace k4json;
+
+    Json json;
+    try {
+        json = from_file(input);
+    } catch (const JsonLoadErr& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << '\n';
+        return 2;
+    }
+
+    try {
+        if (shared) {
+            publish_shared(json, output);
+            return 0;
+        }
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << '\n';
+        return 2;
+    }
+
+    std::ofstream outfile(output, std::ios::binary);
+    if (!outfile.good()) {
+        std::cerr << "Failed opening file " << output << " for writing\n";
+        return 1;
+    }
+    try {
+        pack(json, outfile);
+    } catch (const PackErr& e) {
+        std::cerr << e.what() << '\n';
+        return 2;
+    }
+    outfile.close();
+    if (!outfile.good()) {
+        std::cerr << "Failed writing file " << output << '\n';
+        return 2;
+    }
+    return 0;
+}
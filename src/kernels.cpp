@@ -0,0 +1,269 @@
+#include "kernels.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <numeric>
+
+namespace k4json {
+
+void mask_compare(const double* values, const unsigned char* valid, size_t n,
+                  Comparison op, double literal, unsigned char* mask) {
+    // The switch is hoisted out of the loops so every loop body is a
+    // single branch-free expression
+    switch (op) {
+    case Comparison::EQ:
+        for (size_t i = 0; i < n; ++i) {
+            mask[i] &= valid[i] & (values[i] == literal);
+        }
+        return;
+    case Comparison::NE:
+        for (size_t i = 0; i < n; ++i) {
+            mask[i] &= !(valid[i] & (values[i] == literal));
+        }
+        return;
+    case Comparison::LT:
+        for (size_t i = 0; i < n; ++i) {
+            mask[i] &= valid[i] & (values[i] < literal);
+        }
+        return;
+    case Comparison::LE:
+        for (size_t i = 0; i < n; ++i) {
+            mask[i] &= valid[i] & (values[i] <= literal);
+        }
+        return;
+    case Comparison::GT:
+        for (size_t i = 0; i < n; ++i) {
+            mask[i] &= valid[i] & (values[i] > literal);
+        }
+        return;
+    case Comparison::GE:
+        for (size_t i = 0; i < n; ++i) {
+            mask[i] &= valid[i] & (values[i] >= literal);
+        }
+        return;
+    case Comparison::NONE:
+        break;
+    }
+    assert(0);
+}
+
+// Width of the accumulator arrays, enough to fill a 256 bit register
+constexpr size_t lanes = 4;
+
+double sum(const double* values, size_t n) {
+    double acc[lanes] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        for (size_t l = 0; l < lanes; ++l) {
+            acc[l] += values[i + l];
+        }
+    }
+    for (; i < n; ++i) {
+        acc[0] += values[i];
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+double min_value(const double* values, size_t n) {
+    double acc[lanes];
+    for (size_t l = 0; l < lanes; ++l) {
+        acc[l] = std::numeric_limits<double>::max();
+    }
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        for (size_t l = 0; l < lanes; ++l) {
+            acc[l] = values[i + l] < acc[l] ? values[i + l] : acc[l];
+        }
+    }
+    for (; i < n; ++i) {
+        acc[0] = values[i] < acc[0] ? values[i] : acc[0];
+    }
+    double res = acc[0];
+    for (size_t l = 1; l < lanes; ++l) {
+        res = acc[l] < res ? acc[l] : res;
+    }
+    return res;
+}
+
+double max_value(const double* values, size_t n) {
+    double acc[lanes];
+    for (size_t l = 0; l < lanes; ++l) {
+        acc[l] = std::numeric_limits<double>::lowest();
+    }
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        for (size_t l = 0; l < lanes; ++l) {
+            acc[l] = values[i + l] > acc[l] ? values[i + l] : acc[l];
+        }
+    }
+    for (; i < n; ++i) {
+        acc[0] = values[i] > acc[0] ? values[i] : acc[0];
+    }
+    double res = acc[0];
+    for (size_t l = 1; l < lanes; ++l) {
+        res = acc[l] > res ? acc[l] : res;
+    }
+    return res;
+}
+
+double sum_squared_deviations(const double* values, size_t n, double mean) {
+    double acc[lanes] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        for (size_t l = 0; l < lanes; ++l) {
+            double dev = values[i + l] - mean;
+            acc[l] += dev * dev;
+        }
+    }
+    for (; i < n; ++i) {
+        double dev = values[i] - mean;
+        acc[0] += dev * dev;
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+void elementwise(double* values, size_t n, Operator op, double operand) {
+    switch (op) {
+    case Operator::NONE:
+        for (size_t i = 0; i < n; ++i) {
+            values[i] = operand;
+        }
+        return;
+    case Operator::PLUS:
+        for (size_t i = 0; i < n; ++i) {
+            values[i] += operand;
+        }
+        return;
+    case Operator::MINUS:
+        for (size_t i = 0; i < n; ++i) {
+            values[i] -= operand;
+        }
+        return;
+    case Operator::MUL:
+        for (size_t i = 0; i < n; ++i) {
+            values[i] *= operand;
+        }
+        return;
+    case Operator::DIV:
+        for (size_t i = 0; i < n; ++i) {
+            values[i] /= operand;
+        }
+        return;
+    }
+    assert(0);
+}
+
+void elementwise(double operand, double* values, size_t n, Operator op) {
+    switch (op) {
+    case Operator::NONE:
+        return;
+    case Operator::PLUS:
+        for (size_t i = 0; i < n; ++i) {
+            values[i] = operand + values[i];
+        }
+        return;
+    case Operator::MINUS:
+        for (size_t i = 0; i < n; ++i) {
+            values[i] = operand - values[i];
+        }
+        return;
+    case Operator::MUL:
+        for (size_t i = 0; i < n; ++i) {
+            values[i] = operand * values[i];
+        }
+        return;
+    case Operator::DIV:
+        for (size_t i = 0; i < n; ++i) {
+            values[i] = operand / values[i];
+        }
+        return;
+    }
+    assert(0);
+}
+
+void elementwise(double* values, const double* operands, size_t n,
+                 Operator op) {
+    switch (op) {
+    case Operator::NONE:
+        for (size_t i = 0; i < n; ++i) {
+            values[i] = operands[i];
+        }
+        return;
+    case Operator::PLUS:
+        for (size_t i = 0; i < n; ++i) {
+            values[i] += operands[i];
+        }
+        return;
+    case Operator::MINUS:
+        for (size_t i = 0; i < n; ++i) {
+            values[i] -= operands[i];
+        }
+        return;
+    case Operator::MUL:
+        for (size_t i = 0; i < n; ++i) {
+            values[i] *= operands[i];
+        }
+        return;
+    case Operator::DIV:
+        for (size_t i = 0; i < n; ++i) {
+            values[i] /= operands[i];
+        }
+        return;
+    }
+    assert(0);
+}
+
+bool any_zero(const double* values, size_t n) {
+    // Counting instead of returning early keeps the loop vectorizable
+    size_t zeros = 0;
+    for (size_t i = 0; i < n; ++i) {
+        zeros += values[i] == 0;
+    }
+    return zeros != 0;
+}
+
+// Rows are sorted instead of the values so nothing but indices moves
+template <typename T>
+std::vector<size_t> top_k_impl(const T* values, size_t n, size_t k) {
+    std::vector<size_t> rows(n);
+    std::iota(rows.begin(), rows.end(), 0);
+    auto greater = [values](size_t a, size_t b) {
+        return values[b] < values[a] || (!(values[a] < values[b]) && a < b);
+    };
+    if (k < n) {
+        std::nth_element(rows.begin(), rows.begin() + k, rows.end(), greater);
+        rows.resize(k);
+    }
+    std::sort(rows.begin(), rows.end(), greater);
+    return rows;
+}
+
+template <typename T>
+std::vector<size_t> sorted_rows_impl(const T* values, size_t n) {
+    std::vector<size_t> rows(n);
+    std::iota(rows.begin(), rows.end(), 0);
+    std::sort(rows.begin(), rows.end(), [values](size_t a, size_t b) {
+        return values[a] < values[b] || (!(values[b] < values[a]) && a < b);
+    });
+    return rows;
+}
+
+std::vector<size_t> top_k(const double* values, size_t n, size_t k) {
+    return top_k_impl(values, n, k);
+}
+
+std::vector<size_t> top_k(const std::string_view* values, size_t n,
+                          size_t k) {
+    return top_k_impl(values, n, k);
+}
+
+std::vector<size_t> sorted_rows(const double* values, size_t n) {
+    return sorted_rows_impl(values, n);
+}
+
+std::vector<size_t> sorted_rows(const std::string_view* values, size_t n) {
+    return sorted_rows_impl(values, n);
+}
+
+} // namespace k4json
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "expressions.hpp"
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace k4json {
+
+// Kernels working on contiguous buffers. The loops are kept free of
+// branches so the compiler can vectorize them.
+
+// mask[i] &= valid[i] && (values[i] <op> literal)
+// except for !=, which is the negation of ==, so that invalid (missing or
+// non-numeric) values compare as unequal to the literal
+void mask_compare(const double* values, const unsigned char* valid, size_t n,
+                  Comparison op, double literal, unsigned char* mask);
+
+// Reductions, using several independent accumulators so consecutive
+// iterations don't wait on each other
+double sum(const double* values, size_t n);
+// numeric_limits<double>::max() if n == 0
+double min_value(const double* values, size_t n);
+// numeric_limits<double>::lowest() if n == 0
+double max_value(const double* values, size_t n);
+// sum of (values[i] - mean)^2
+double sum_squared_deviations(const double* values, size_t n, double mean);
+
+// Elementwise arithmetic, in place. Division by zero isn't checked,
+// use any_zero() first.
+// values[i] = values[i] <op> operand
+void elementwise(double* values, size_t n, Operator op, double operand);
+// values[i] = operand <op> values[i]
+void elementwise(double operand, double* values, size_t n, Operator op);
+// values[i] = values[i] <op> operands[i]
+void elementwise(double* values, const double* operands, size_t n,
+                 Operator op);
+bool any_zero(const double* values, size_t n);
+
+// Rows of the k largest values, largest first, equal values by row.
+// O(n + k log k)
+std::vector<size_t> top_k(const double* values, size_t n, size_t k);
+std::vector<size_t> top_k(const std::string_view* values, size_t n, size_t k);
+// All rows, by ascending value, equal values by row
+std::vector<size_t> sorted_rows(const double* values, size_t n);
+std::vector<size_t> sorted_rows(const std::string_view* values, size_t n);
+
+} // namespace k4json
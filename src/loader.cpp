@@ -1,11 +1,14 @@
+#include <algorithm>
 #include <cassert>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 
 #include "json.hpp"
 #include "loader.hpp"
+#include "packed.hpp"
 #include "utils.hpp"
 
 namespace k4json {
@@ -65,7 +68,7 @@ std::string JsonLoader::error_line() {
     throw JsonLoadErr(err_msg);
 }
 
-Json JsonLoader::from_file(const std::string& file_name) {
+std::string JsonLoader::read_file(const std::string& file_name) {
     std::ifstream infile(file_name);
 
     if (!infile.good()) {
@@ -84,8 +87,17 @@ Json JsonLoader::from_file(const std::string& file_name) {
     if (file_contents.empty()) {
         throw std::runtime_error("File " + file_name + " empty.");
     }
+    return file_contents;
+}
 
-    JsonLoader jl(file_contents);
+Json JsonLoader::from_file(const std::string& file_name) {
+    // Packed documents (see packed.hpp) are only copied, not parsed
+    if (is_packed_file(file_name)) {
+        PackedDocument doc(file_name);
+        doc.verify();
+        return doc.root().to_json();
+    }
+    JsonLoader jl(read_file(file_name));
     // Main parsing logic
     return jl.load();
 }
@@ -95,6 +107,22 @@ Json JsonLoader::from_string(const std::string& str) {
     return jl.load();
 }
 
+Json JsonLoader::value_from_string(const std::string& str) {
+    // Literals are only matched when something follows them
+    JsonLoader jl(str + ' ');
+    return jl.load(false);
+}
+
+SourceDocument JsonLoader::document_from_file(const std::string& file_name) {
+    JsonLoader jl(read_file(file_name));
+    return jl.load_document();
+}
+
+SourceDocument JsonLoader::document_from_string(const std::string& str) {
+    JsonLoader jl(str);
+    return jl.load_document();
+}
+
 JsonLoader::JsonLoader(const std::string& data) {
     buffer = data;
     line = 1;
@@ -466,4 +494,148 @@ Json JsonLoader::load(bool strict) {
     }
 }
 
+// Skips over a string which load() already validated
+void JsonLoader::skip_string() {
+    assert_match('"');
+    while (peek() != '"') {
+        if (peek() == '\\') {
+            next();
+        }
+        next();
+    }
+    next();
+}
+
+// Walks the value at current, which load() already validated, together
+// with the node it was loaded into, and records where the node and its
+// children are. node is null for values which didn't make it into the
+// Json. A key which appears more than once is walked for every
+// appearance, the last one overwrites the spans of the others, just like
+// it overwrote their values.
+void JsonLoader::record_spans(
+    const Json* node, std::vector<std::pair<const Json*, SourceSpan>>& spans) {
+    skip();
+    size_t start = current;
+
+    switch (peek()) {
+    case '{': {
+        next();
+        skip();
+        if (node != nullptr && node->get_type() != JsonType::OBJECT) {
+            node = nullptr;
+        }
+        while (!match('}')) {
+            skip();
+            size_t key_start = current;
+            const std::string key = load_string();
+            const Json* child = nullptr;
+            if (node != nullptr) {
+                // Only strings with escapes need decoding
+                std::string_view raw(buffer.data() + key_start + 1,
+                                     current - key_start - 2);
+                child = node->obj_find(raw.find('\\') == raw.npos ? raw : key);
+            }
+            skip();
+            assert_match(':');
+            record_spans(child, spans);
+            skip();
+            match(',');
+            skip();
+        }
+        break;
+    }
+    case '[': {
+        next();
+        skip();
+        if (node != nullptr && node->get_type() != JsonType::ARRAY) {
+            node = nullptr;
+        }
+        size_t idx = 0;
+        while (!match(']')) {
+            const Json* child = nullptr;
+            if (node != nullptr && idx < node->get_array_ref().size()) {
+                child = &node->get_array_ref()[idx];
+            }
+            record_spans(child, spans);
+            ++idx;
+            skip();
+            match(',');
+            skip();
+        }
+        break;
+    }
+    case '"':
+        skip_string();
+        break;
+    default:
+        // numbers and literals
+        while (!reached_end() && !is_end_control(peek()) &&
+               !is_whitespace(peek())) {
+            next();
+        }
+    }
+
+    if (node != nullptr) {
+        spans.emplace_back(node, SourceSpan{start, current - start});
+    }
+}
+
+SourceDocument JsonLoader::load_document() {
+    SourceDocument doc;
+    doc.root = std::make_unique<Json>(load());
+
+    current = 0;
+    line = 1;
+    record_spans(doc.root.get(), doc.spans);
+    // Stable, so the last span recorded for a node is the last of its run
+    std::stable_sort(doc.spans.begin(), doc.spans.end(),
+                     [](const auto& a, const auto& b) {
+                         return std::less<const Json*>()(a.first, b.first);
+                     });
+    auto last = std::unique(doc.spans.rbegin(), doc.spans.rend(),
+                            [](const auto& a, const auto& b) {
+                                return a.first == b.first;
+                            });
+    doc.spans.erase(doc.spans.begin(), last.base());
+    doc.source_text = std::move(buffer);
+    return doc;
+}
+
+SourceDocument SourceDocument::from_string(const std::string& str) {
+    return JsonLoader::document_from_string(str);
+}
+
+SourceDocument SourceDocument::from_file(const std::string& file_name) {
+    return JsonLoader::document_from_file(file_name);
+}
+
+const Json& SourceDocument::json() const {
+    return *root;
+}
+
+const std::string& SourceDocument::text() const {
+    return source_text;
+}
+
+std::optional<SourceSpan> SourceDocument::span(const Json& node) const {
+    auto it = std::lower_bound(spans.begin(), spans.end(), &node,
+                               [](const auto& entry, const Json* key) {
+                                   return std::less<const Json*>()(entry.first,
+                                                                   key);
+                               });
+    if (it == spans.end() || it->first != &node) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+std::optional<std::string_view>
+SourceDocument::source(const Json& node) const {
+    std::optional<SourceSpan> s = span(node);
+    if (!s) {
+        return std::nullopt;
+    }
+    return std::string_view(source_text).substr(s->offset, s->length);
+}
+
 } // namespace k4json
@@ -3,8 +3,12 @@
 #include "generic_parser.hpp"
 #include "json.hpp"
 
+#include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace k4json {
 
@@ -13,16 +17,59 @@ public:
     explicit JsonLoadErr(const std::string& msg) : std::runtime_error(msg) {}
 };
 
+// Where a value is in the text it was loaded from
+struct SourceSpan {
+    size_t offset;
+    size_t length;
+};
+
+// A Json loaded together with its text, remembering which bytes of the
+// text each node was loaded from, so they can be output as they are
+// instead of being serialized again.
+class SourceDocument {
+public:
+    static SourceDocument from_string(const std::string& str);
+    static SourceDocument from_file(const std::string& file_name);
+
+    const Json& json() const;
+    const std::string& text() const;
+    // nullopt for nodes which aren't part of json(), like computed values
+    std::optional<SourceSpan> span(const Json& node) const;
+    std::optional<std::string_view> source(const Json& node) const;
+
+private:
+    friend class JsonLoader;
+    SourceDocument() = default;
+
+    // Behind a pointer so the nodes keep their address when the
+    // document is moved
+    std::unique_ptr<Json> root;
+    std::string source_text;
+    // Sorted by node
+    std::vector<std::pair<const Json*, SourceSpan>> spans;
+};
+
 // Used for deserializing JSON
 // returns object of type Json
 class JsonLoader : private Parser {
 public:
     static Json from_string(const std::string& str);
     static Json from_file(const std::string& file_name);
+    // Any value, not only objects and arrays, e.g. a fragment of a document
+    static Json value_from_string(const std::string& str);
+    // Also records the source span of every node
+    static SourceDocument document_from_string(const std::string& str);
+    static SourceDocument document_from_file(const std::string& file_name);
 
 private:
     explicit JsonLoader(const std::string& data);
 
+    static std::string read_file(const std::string& file_name);
+    SourceDocument load_document();
+    void record_spans(const Json* node,
+                      std::vector<std::pair<const Json*, SourceSpan>>& spans);
+    void skip_string();
+
     [[noreturn]] void syntax_err(const std::string& msg) override;
     std::string error_line();
     Json load(bool strict = true);
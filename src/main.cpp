@@ -1,21 +1,323 @@
+#include "budget.hpp"
+#include "cache.hpp"
 #include "expressions.hpp"
 #include "json.hpp"
 #include "loader.hpp"
+#include "packed.hpp"
+#include "packed_query.hpp"
+#include "paths.hpp"
+#include "profile.hpp"
+#include "sidecar.hpp"
+#include "stream.hpp"
+#include "writer.hpp"
 
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <new>
+#include <optional>
+#include <vector>
+
+const char* usage =
+    "usage: ./json_eval [--stream] [--limit N] [--explain] [--profile] "
+    "[--timeout MS] [--max-nodes N] [--max-bytes N] [--compact] [--ascii] "
+    "[--raw] [--paths] [--cache DIR] [--shared] [--index] [--index-depth N] "
+    "<json file or shared name> <query>";
+
+// Lets --profile count allocations
+void* operator new(std::size_t size) {
+    k4json::count_allocation();
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+// Prints every match on its own line as soon as it is found,
+// without loading the whole file
+int run_streaming(const std::string& file_name, const std::string& query,
+                  size_t limit, const k4json::FormatOptions& format) {
+    using namespace k4json;
+
+    std::ifstream infile(file_name, std::ios::binary);
+    if (!infile.good()) {
+        std::cerr << "Failed opening file " + file_name + ". Does it exit?"
+                  << '\n';
+        return 1;
+    }
+
+    try {
+        JsonWriter out(std::cout, format);
+        stream_query(
+            infile, query,
+            [&out](Json&& match) {
+                out.write(match);
+                out.write_raw("\n");
+            },
+            limit);
+    } catch (const JsonLoadErr& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    } catch (const StreamQueryErr& e) {
+        std::cerr << e.what() << '\n';
+        return 4;
+    }
+    return 0;
+}
+
+// A single result is printed by itself, otherwise they are put in an array
+void write_result(const k4json::JsonArray& result,
+                  const k4json::FormatOptions& format) {
+    k4json::JsonWriter out(std::cout, format);
+    if (result.size() == 1) {
+        out.write(result[0]);
+    } else {
+        out.write_array(result);
+    }
+    out.write_raw("\n");
+}
+
+// Answers paths (without functions and arithmetic, see PackedQuery)
+// straight from a packed document, only the matches are copied out of it.
+// Returns false for the other queries, which need the document as a Json.
+bool query_packed(const k4json::PackedDocument& doc, const std::string& query,
+                  size_t limit, const k4json::FormatOptions& format) {
+    using namespace k4json;
+
+    std::optional<PackedQuery> packed_query;
+    try {
+        packed_query.emplace(query);
+    } catch (const StreamQueryErr&) {
+        return false;
+    }
+
+    std::vector<PackedNode> matches = packed_query->run(doc.root());
+    if (matches.size() > limit) {
+        matches.erase(matches.begin() + limit, matches.end());
+    }
+    // Copied before anything is printed, a damaged document fails
+    // without output
+    JsonArray result;
+    for (const PackedNode& match : matches) {
+        result.push_back(match.to_json());
+    }
+    write_result(result, format);
+    return true;
+}
+
+// Answers name, index and wildcard queries by loading only the parts of
+// the file they select, found through its sidecar index (built first if
+// needed). Returns false for the other queries.
+bool query_indexed(const std::string& file_name, const std::string& query,
+                   size_t index_depth, size_t limit,
+                   const k4json::FormatOptions& format) {
+    using namespace k4json;
+
+    std::optional<SimplePath> path;
+    try {
+        path.emplace(query);
+    } catch (const StreamQueryErr&) {
+        return false;
+    }
+
+    SidecarIndex index = SidecarIndex::open(file_name, index_depth);
+    JsonArray result = index.query(*path);
+    if (result.size() > limit) {
+        result.resize(limit);
+    }
+    write_result(result, format);
+    return true;
+}
+
+// Loads the file from its entry in the cache directory, parsing it (and
+// filling the entry) if there is no usable one. If direct, the query may
+// be answered straight from the entry, returns whether it was.
+bool load_cached(const std::string& cache_dir, const std::string& file_name,
+                 const std::string& query, bool direct, size_t limit,
+                 const k4json::FormatOptions& format, k4json::Json& json) {
+    using namespace k4json;
+
+    CacheEntry entry(cache_dir, file_name);
+    if (std::optional<PackedDocument> packed = entry.open()) {
+        try {
+            if (direct && query_packed(*packed, query, limit, format)) {
+                return true;
+            }
+            json = packed->root().to_json();
+            return false;
+        } catch (const PackErr&) {
+            // Damaged, the text is parsed instead
+            entry.remove();
+        }
+    }
+    json = from_file(file_name);
+    entry.store(json);
+    return false;
+}
+
+// Prints the text the nodes were loaded from, in an array unless there is
+// only one of them
+void write_sources(k4json::JsonWriter& out, const k4json::SourceDocument& doc,
+                   const std::vector<const k4json::Json*>& nodes) {
+    if (nodes.size() == 1) {
+        out.write_raw(*doc.source(*nodes[0]));
+        return;
+    }
+    if (nodes.empty()) {
+        out.write_raw("[ ]");
+        return;
+    }
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        out.write_raw(i == 0 ? "[\n" : ",\n");
+        out.write_raw(*doc.source(*nodes[i]));
+    }
+    out.write_raw("\n]");
+}
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        std::cout << "usage: ./json_eval <json file> <query>" << '\n';
+    bool stream = false;
+    k4json::FormatOptions format;
+    // Print the matches as they are in the file instead of serializing them
+    bool raw = false;
+    // Print where the matches are instead of what they are
+    bool paths = false;
+    // Where packed copies of the files loaded are kept, see cache.hpp
+    std::string cache_dir;
+    // The document is a shared memory object published by json_pack
+    bool shared = false;
+    // Use (or build) a sidecar index of the file, see sidecar.hpp
+    bool indexed = false;
+    size_t index_depth = 2;
+    // Print the steps of the query instead of its result
+    bool explain = false;
+    // Print what every step did to stderr, after the result
+    bool profile = false;
+    // Only the first limit results are printed
+    size_t limit = SIZE_MAX;
+    // Bounds on the evaluation, off when 0
+    size_t timeout_ms = 0;
+    size_t max_nodes = 0;
+    size_t max_bytes = 0;
+    // Options followed by a positive number
+    std::map<std::string, size_t*> numeric_options = {
+        {"--limit", &limit},
+        {"--timeout", &timeout_ms},
+        {"--max-nodes", &max_nodes},
+        {"--max-bytes", &max_bytes},
+        {"--index-depth", &index_depth}};
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--stream") {
+            stream = true;
+        } else if (arg == "--explain") {
+            explain = true;
+        } else if (arg == "--profile") {
+            profile = true;
+        } else if (arg == "--compact") {
+            format.minified = true;
+        } else if (arg == "--ascii") {
+            format.ascii_only = true;
+        } else if (arg == "--raw") {
+            raw = true;
+        } else if (arg == "--paths") {
+            paths = true;
+        } else if (arg == "--shared") {
+            shared = true;
+        } else if (arg == "--index") {
+            indexed = true;
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (numeric_options.contains(arg) && i + 1 < argc) {
+            char* end;
+            size_t value = std::strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || value == 0) {
+                std::cout << usage << '\n';
+                return 1;
+            }
+            *numeric_options[arg] = value;
+        } else if (arg.starts_with("--")) {
+            std::cout << usage << '\n';
+            return 1;
+        } else {
+            args.push_back(arg);
+        }
+    }
+    // The streaming evaluator has no steps to report, no budget and no
+    // paths, raw output has no formatting, and both need the text, which
+    // neither the cache nor shared documents have
+    bool bounded = timeout_ms != 0 || max_nodes != 0 || max_bytes != 0;
+    bool formatted = format.minified || format.ascii_only;
+    bool cached = !cache_dir.empty();
+    // The sidecar stores depths in 32 bits
+    if (args.size() != 2 || index_depth > UINT32_MAX ||
+        (stream && (explain || profile || bounded || paths || cached)) ||
+        (raw && (stream || formatted || paths || cached)) ||
+        (shared && (stream || raw || cached)) ||
+        (indexed && (stream || raw || cached || shared))) {
+        std::cout << usage << '\n';
         return 1;
     }
 
+    if (stream) {
+        return run_streaming(args[0], args[1], limit, format);
+    }
+
     using namespace k4json;
 
     Json json;
+    std::optional<SourceDocument> document;
+    // Whether packed documents may answer the query themselves
+    bool direct = !(explain || profile || bounded || paths);
     try {
         // Load and parse json from file
-        json = from_file((std::string(argv[1])));
+        if (raw) {
+            document = SourceDocument::from_file(args[0]);
+        } else if (shared) {
+            // Not verified, only the publisher can write the object
+            PackedDocument doc = PackedDocument::attach_shared(args[0]);
+            if (direct && query_packed(doc, args[1], limit, format)) {
+                return 0;
+            }
+            // The point of sharing is lost, so it isn't done silently
+            std::cerr << "warning: the query copies the shared document "
+                         "into the process, only paths without functions "
+                         "or arithmetic (and without --explain, --profile, "
+                         "--paths or bounds) run over it directly\n";
+            json = doc.root().to_json();
+        } else if (is_packed_file(args[0])) {
+            // Anyone can hand us a file
+            PackedDocument doc(args[0]);
+            doc.verify();
+            if (direct && query_packed(doc, args[1], limit, format)) {
+                return 0;
+            }
+            json = doc.root().to_json();
+        } else if (cached) {
+            if (load_cached(cache_dir, args[0], args[1], direct, limit, format,
+                            json)) {
+                return 0;
+            }
+        } else if (indexed) {
+            if (direct && query_indexed(args[0], args[1], index_depth, limit,
+                                        format)) {
+                return 0;
+            }
+            json = from_file(args[0]);
+        } else {
+            json = from_file(args[0]);
+        }
     } catch (const JsonLoadErr& e) {
         std::cerr << e.what() << '\n';
         return 1;
@@ -26,13 +328,65 @@ int main(int argc, char* argv[]) {
 
     try {
         // Parse the query
-        JsonArray result = parse(json, std::string(argv[2]));
-        // If the resulting JsonArray is only one element
-        // we will extract it
-        if (result.size() == 1) {
-            std::cout << result[0].to_string() << '\n';
+        QueryProfile steps;
+        QueryBudget budget;
+        if (timeout_ms != 0) {
+            budget.deadline = std::chrono::steady_clock::now() +
+                              std::chrono::milliseconds(timeout_ms);
+        }
+        if (max_nodes != 0) {
+            budget.max_nodes = max_nodes;
+        }
+        if (max_bytes != 0) {
+            budget.max_bytes = max_bytes;
+        }
+        QueryProfile* steps_ptr = explain || profile ? &steps : nullptr;
+        if (profile) {
+            start_counting_allocations();
+        }
+        QueryBudget* budget_ptr = bounded ? &budget : nullptr;
+        JsonArray result;
+        std::vector<const Json*> nodes;
+        if (raw) {
+            nodes = JsonExpressionParser::select(document->json(), args[1],
+                                                 steps_ptr, budget_ptr);
+        } else if (paths) {
+            nodes = JsonExpressionParser::select(json, args[1], steps_ptr,
+                                                 budget_ptr);
         } else {
-            std::cout << Json(result).to_string() << '\n';
+            result = parse(json, args[1], steps_ptr, budget_ptr);
+        }
+        if (explain) {
+            std::cout << steps.explain();
+            return 0;
+        }
+        if (result.size() > limit) {
+            result.resize(limit);
+        }
+        if (nodes.size() > limit) {
+            nodes.resize(limit);
+        }
+        if (paths) {
+            for (const JsonPath& path : locate(json, nodes)) {
+                result.push_back(Json(normalized_path(path)));
+            }
+        }
+        // If the resulting JsonArray is only one element
+        // we will extract it. The output goes to stdout as it is
+        // serialized.
+        {
+            JsonWriter out(std::cout, format);
+            if (raw) {
+                write_sources(out, *document, nodes);
+            } else if (result.size() == 1) {
+                out.write(result[0]);
+            } else {
+                out.write_array(result);
+            }
+            out.write_raw("\n");
+        }
+        if (profile) {
+            std::cerr << steps.report();
         }
     } catch (const JsonTypeErr& e) {
         std::cerr << e.what() << '\n';
@@ -43,6 +397,9 @@ int main(int argc, char* argv[]) {
     } catch (const ExprValueErr& e) {
         std::cerr << e.what() << '\n';
         return 5;
+    } catch (const ExprBudgetErr& e) {
+        std::cerr << e.what() << '\n';
+        return 6;
     }
 
     return 0;
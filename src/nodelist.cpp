@@ -0,0 +1,122 @@
+#include "nodelist.hpp"
+
+#include <cassert>
+#include <iterator>
+
+namespace k4json {
+
+void NodeList::push_segment(const Segment& segment) {
+    // Empty segments would need to be skipped during iteration
+    if (segment.count != 0) {
+        segments.push_back(segment);
+        total += segment.count;
+    }
+}
+
+void NodeList::push_back(const Json* node) {
+    // Consecutive single nodes share a segment
+    if (!segments.empty() && segments.back().kind == SegmentKind::OWNED &&
+        segments.back().offset + segments.back().count == owned.size()) {
+        segments.back().count += 1;
+    } else {
+        Segment s{};
+        s.kind = SegmentKind::OWNED;
+        s.count = 1;
+        s.offset = owned.size();
+        segments.push_back(s);
+    }
+    owned.push_back(node);
+    total += 1;
+}
+
+void NodeList::push_slice(const JsonArray& arr, long first, long step,
+                          size_t count) {
+    Segment s{};
+    s.kind = SegmentKind::SLICE;
+    s.count = count;
+    s.arr = &arr;
+    s.first = first;
+    s.step = step;
+    push_segment(s);
+}
+
+void NodeList::push_values(const JsonObject& obj) {
+    Segment s{};
+    s.kind = SegmentKind::VALUES;
+    s.count = obj.size();
+    s.obj = &obj;
+    push_segment(s);
+}
+
+void NodeList::push_nodes(const std::vector<const Json*>& nodes) {
+    Segment s{};
+    s.kind = SegmentKind::NODES;
+    s.count = nodes.size();
+    s.nodes = &nodes;
+    push_segment(s);
+}
+
+void NodeList::append(const NodeList& other) {
+    for (const Segment& s : other.segments) {
+        if (s.kind == SegmentKind::OWNED) {
+            for (size_t i = 0; i < s.count; ++i) {
+                push_back(other.owned[s.offset + i]);
+            }
+        } else {
+            push_segment(s);
+        }
+    }
+}
+
+size_t NodeList::size() const {
+    return total;
+}
+
+bool NodeList::empty() const {
+    // there are no empty segments
+    return segments.empty();
+}
+
+const Json* NodeList::operator[](size_t idx) const {
+    for (const Segment& s : segments) {
+        if (idx >= s.count) {
+            idx -= s.count;
+            continue;
+        }
+        switch (s.kind) {
+        case SegmentKind::OWNED:
+            return owned[s.offset + idx];
+        case SegmentKind::SLICE:
+            return &(*s.arr)[s.first + static_cast<long>(idx) * s.step];
+        case SegmentKind::VALUES:
+            return &std::next(s.obj->begin(), idx)->second;
+        case SegmentKind::NODES:
+            return (*s.nodes)[idx];
+        }
+    }
+    assert(0);
+    return nullptr;
+}
+
+NodeList::const_iterator NodeList::begin() const {
+    return const_iterator(this, 0);
+}
+
+NodeList::const_iterator NodeList::end() const {
+    return const_iterator(this, segments.size());
+}
+
+NodeList::const_iterator::const_iterator(const NodeList* list, size_t seg)
+    : list(list), seg(seg), pos(0) {
+    enter_segment();
+}
+
+void NodeList::const_iterator::enter_segment() {
+    pos = 0;
+    if (seg < list->segments.size() &&
+        list->segments[seg].kind == SegmentKind::VALUES) {
+        obj_it = list->segments[seg].obj->begin();
+    }
+}
+
+} // namespace k4json
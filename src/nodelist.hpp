@@ -0,0 +1,113 @@
+#pragma once
+
+#include "json.hpp"
+
+#include <cstddef>
+#include <vector>
+
+namespace k4json {
+
+// The result of a query: a list of references to the nodes of a Json.
+// Wildcard and slice selectors don't enumerate their result, they record
+// which part of the container they select (a segment) and the nodes are
+// only produced when the list is iterated.
+class NodeList {
+public:
+    class const_iterator;
+
+    NodeList() = default;
+
+    // A single node
+    void push_back(const Json* node);
+    // count elements of arr, starting at first and moving by step
+    void push_slice(const JsonArray& arr, long first, long step, size_t count);
+    // All values of obj, in key order
+    void push_values(const JsonObject& obj);
+    // Refers to nodes, which must outlive the NodeList, without copying it
+    void push_nodes(const std::vector<const Json*>& nodes);
+    void append(const NodeList& other);
+
+    // Constant time, the sizes of the segments are added up as they come
+    size_t size() const;
+    bool empty() const;
+    // Linear in the number of segments
+    const Json* operator[](size_t idx) const;
+
+    const_iterator begin() const;
+    const_iterator end() const;
+
+private:
+    enum class SegmentKind {
+        OWNED,
+        SLICE,
+        VALUES,
+        NODES
+    };
+
+    struct Segment {
+        SegmentKind kind;
+        size_t count;
+        // OWNED: offset into owned
+        size_t offset;
+        // SLICE
+        const JsonArray* arr;
+        long first;
+        long step;
+        // VALUES
+        const JsonObject* obj;
+        // NODES
+        const std::vector<const Json*>* nodes;
+    };
+
+    void push_segment(const Segment& segment);
+
+    std::vector<Segment> segments;
+    std::vector<const Json*> owned;
+    size_t total = 0;
+};
+
+class NodeList::const_iterator {
+public:
+    const_iterator(const NodeList* list, size_t seg);
+
+    const Json* operator*() const {
+        const Segment& s = list->segments[seg];
+        switch (s.kind) {
+        case SegmentKind::OWNED:
+            return list->owned[s.offset + pos];
+        case SegmentKind::SLICE:
+            return &(*s.arr)[s.first + static_cast<long>(pos) * s.step];
+        case SegmentKind::VALUES:
+            return &obj_it->second;
+        case SegmentKind::NODES:
+            return (*s.nodes)[pos];
+        }
+        return nullptr;
+    }
+
+    const_iterator& operator++() {
+        pos += 1;
+        if (list->segments[seg].kind == SegmentKind::VALUES) {
+            ++obj_it;
+        }
+        if (pos == list->segments[seg].count) {
+            seg += 1;
+            enter_segment();
+        }
+        return *this;
+    }
+
+    bool operator==(const const_iterator& other) const {
+        return seg == other.seg && pos == other.pos;
+    }
+
+private:
+    void enter_segment();
+
+    const NodeList* list;
+    size_t seg;
+    size_t pos;
+    JsonObject::const_iterator obj_it;
+};
+
+} // namespace k4json
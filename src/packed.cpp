@@ -0,0 +1,501 @@
+#include "packed.hpp"
+#include "utils.hpp"
+
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace k4json {
+
+static_assert(sizeof(PackedSlot) == 16);
+static_assert(sizeof(PackHeader) == 56);
+
+constexpr char pack_magic[8] = {'K', '4', 'J', 'P', 'A', 'C', 'K', '\0'};
+constexpr uint32_t pack_version = 2;
+constexpr uint32_t pack_byte_order = 0x01020304;
+
+namespace {
+
+uint64_t checksum(const char* data, size_t size) {
+    constexpr size_t start = offsetof(PackHeader, root);
+    return finish_hash(hash_words(hash_seed, data + start, size - start));
+}
+
+// Writes the slots depth first: a container's table is reserved before
+// its children are packed, so their tables come after it
+class Packer {
+public:
+    std::string pack(const Json& json) {
+        nodes.resize(sizeof(PackHeader));
+        PackHeader header{};
+        std::memcpy(header.magic, pack_magic, sizeof(pack_magic));
+        header.version = pack_version;
+        header.byte_order = pack_byte_order;
+        header.root = slot(json);
+        header.strings = nodes.size();
+        header.file_size = nodes.size() + strings.size();
+        std::memcpy(nodes.data(), &header, sizeof(header));
+        nodes += strings;
+        header.checksum = checksum(nodes.data(), nodes.size());
+        std::memcpy(nodes.data() + offsetof(PackHeader, checksum),
+                    &header.checksum, sizeof(header.checksum));
+        return std::move(nodes);
+    }
+
+private:
+    PackedSlot slot(const Json& json) {
+        PackedSlot res{};
+        res.type = static_cast<uint8_t>(json.get_type());
+
+        switch (json.get_type()) {
+        case JsonType::NUMBER: {
+            double number = json.get_number();
+            std::memcpy(&res.payload, &number, sizeof(number));
+            break;
+        }
+        case JsonType::BOOL:
+            res.payload = json.get_bool();
+            break;
+        case JsonType::STRING:
+            res = string_slot(json.get_string_ref());
+            break;
+        case JsonType::ARRAY: {
+            const JsonArray& arr = json.get_array_ref();
+            res.count = checked_count(arr.size());
+            res.payload = reserve(arr.size());
+            for (size_t i = 0; i < arr.size(); ++i) {
+                put(res.payload + i * sizeof(PackedSlot), slot(arr[i]));
+            }
+            break;
+        }
+        case JsonType::OBJECT: {
+            const JsonObject& obj = json.get_obj_ref();
+            res.count = checked_count(obj.size());
+            res.payload = reserve(2 * obj.size());
+            uint64_t at = res.payload;
+            for (const auto& [key, value] : obj) {
+                put(at, string_slot(key));
+                put(at + sizeof(PackedSlot), slot(value));
+                at += 2 * sizeof(PackedSlot);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        return res;
+    }
+
+    // Equal strings are stored once
+    PackedSlot string_slot(const std::string& str) {
+        PackedSlot res{};
+        res.type = static_cast<uint8_t>(JsonType::STRING);
+        res.count = checked_count(str.size());
+        auto [it, inserted] = interned.try_emplace(str, strings.size());
+        if (inserted) {
+            strings += str;
+        }
+        res.payload = it->second;
+        return res;
+    }
+
+    static uint32_t checked_count(size_t count) {
+        if (count > UINT32_MAX) {
+            throw PackErr("Pack Error: containers and strings can't have "
+                          "more than 2^32 - 1 children or bytes");
+        }
+        return static_cast<uint32_t>(count);
+    }
+
+    // Room for count slots, returns its offset
+    uint64_t reserve(size_t count) {
+        uint64_t offset = nodes.size();
+        nodes.resize(nodes.size() + count * sizeof(PackedSlot));
+        return offset;
+    }
+
+    void put(uint64_t offset, const PackedSlot& slot) {
+        std::memcpy(nodes.data() + offset, &slot, sizeof(slot));
+    }
+
+    std::string nodes;
+    std::string strings;
+    // Views into the packed Json, which outlives the Packer
+    std::unordered_map<std::string_view, uint64_t> interned;
+};
+
+} // namespace
+
+std::string pack(const Json& json) {
+    return Packer().pack(json);
+}
+
+void pack(const Json& json, std::ostream& out) {
+    std::string packed = pack(json);
+    out.write(packed.data(), packed.size());
+}
+
+// POSIX wants shared memory names to start with a slash
+std::string shared_name(const std::string& name) {
+    return name.starts_with('/') ? name : '/' + name;
+}
+
+void publish_shared(const Json& json, const std::string& name) {
+    std::string packed = pack(json);
+    std::string shm_name = shared_name(name);
+
+    // Processes still attached to a previous version keep it, the new one
+    // is a new object
+    ::shm_unlink(shm_name.c_str());
+    int fd = ::shm_open(shm_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Failed creating shared memory " + shm_name);
+    }
+    void* mapped = MAP_FAILED;
+    if (::ftruncate(fd, packed.size()) == 0) {
+        mapped = ::mmap(nullptr, packed.size(), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        ::shm_unlink(shm_name.c_str());
+        throw std::runtime_error("Failed sizing shared memory " + shm_name);
+    }
+
+    // The header goes in last, until then the segment doesn't look like a
+    // packed document to processes attaching to it
+    char* dest = static_cast<char*>(mapped);
+    std::memcpy(dest + sizeof(PackHeader), packed.data() + sizeof(PackHeader),
+                packed.size() - sizeof(PackHeader));
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(dest, packed.data(), sizeof(PackHeader));
+    ::munmap(mapped, packed.size());
+}
+
+void remove_shared(const std::string& name) {
+    ::shm_unlink(shared_name(name).c_str());
+}
+
+bool is_packed_file(const std::string& file_name) {
+    std::ifstream infile(file_name, std::ios::binary);
+    char magic[sizeof(pack_magic)];
+    return infile.read(magic, sizeof(magic)) &&
+           std::memcmp(magic, pack_magic, sizeof(magic)) == 0;
+}
+
+PackedNode::PackedNode(const char* base, size_t size, const PackedSlot* slot)
+    : base(base), file_size(size), slot(slot) {}
+
+JsonType PackedNode::get_type() const {
+    return static_cast<JsonType>(slot->type);
+}
+
+bool PackedNode::is_null() const {
+    return get_type() == JsonType::NULLVAL;
+}
+
+// valid only for JsonType::BOOL
+bool PackedNode::get_bool() const {
+    if (get_type() != JsonType::BOOL) {
+        throw JsonTypeErr(
+            "get_bool() called on PackedNode which isnt JsonType::BOOL");
+    }
+    return slot->payload != 0;
+}
+
+// valid only for JsonType::NUMBER
+double PackedNode::get_number() const {
+    if (get_type() != JsonType::NUMBER) {
+        throw JsonTypeErr(
+            "get_number() called on PackedNode which isnt JsonType::NUMBER");
+    }
+    double number;
+    std::memcpy(&number, &slot->payload, sizeof(number));
+    return number;
+}
+
+// valid only for JsonType::STRING
+std::string_view PackedNode::get_string() const {
+    if (get_type() != JsonType::STRING) {
+        throw JsonTypeErr(
+            "get_string() called on PackedNode which isnt JsonType::STRING");
+    }
+    return string_at(*slot);
+}
+
+int PackedNode::size() const {
+    switch (get_type()) {
+    case JsonType::STRING:
+    case JsonType::ARRAY:
+    case JsonType::OBJECT:
+        return slot->count;
+    default:
+        return 0;
+    }
+}
+
+PackedNode PackedNode::operator[](size_t idx) const {
+    return PackedNode(base, file_size, &child(idx));
+}
+
+// valid only for JsonType::OBJECT
+std::string_view PackedNode::key(size_t idx) const {
+    return string_at(member_key(idx));
+}
+
+std::optional<PackedNode> PackedNode::obj_find(std::string_view key) const {
+    if (get_type() != JsonType::OBJECT) {
+        return std::nullopt;
+    }
+    // Members are sorted by key, like in JsonObject
+    size_t lo = 0;
+    size_t hi = slot->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (this->key(mid) < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == slot->count || this->key(lo) != key) {
+        return std::nullopt;
+    }
+    return (*this)[lo];
+}
+
+Json PackedNode::to_json() const {
+    switch (get_type()) {
+    case JsonType::NULLVAL:
+        return Json();
+    case JsonType::BOOL:
+        return Json(get_bool());
+    case JsonType::NUMBER:
+        return Json(get_number());
+    case JsonType::STRING:
+        return Json(std::string(get_string()));
+    // Children are moved into their parent rather than copied, so every
+    // value is built once
+    case JsonType::ARRAY: {
+        JsonArray arr;
+        arr.reserve(slot->count);
+        for (size_t i = 0; i < slot->count; ++i) {
+            arr.push_back((*this)[i].to_json());
+        }
+        return Json(std::move(arr));
+    }
+    case JsonType::OBJECT: {
+        JsonObject obj;
+        for (size_t i = 0; i < slot->count; ++i) {
+            // Members are stored sorted by key
+            obj.emplace_hint(obj.end(), key(i), (*this)[i].to_json());
+        }
+        return Json(std::move(obj));
+    }
+    default:
+        throw PackErr("Pack Error: invalid value type " +
+                      std::to_string(slot->type));
+    }
+}
+
+const PackedSlot& PackedNode::child(size_t idx) const {
+    JsonType type = get_type();
+    if (type != JsonType::ARRAY && type != JsonType::OBJECT) {
+        throw JsonTypeErr("PackedNode isnt a container");
+    }
+    if (idx >= slot->count) {
+        throw std::out_of_range("PackedNode child index out of range");
+    }
+    size_t width = type == JsonType::OBJECT ? 2 : 1;
+    return table_slot(idx * width + width - 1);
+}
+
+const PackedSlot& PackedNode::member_key(size_t idx) const {
+    if (get_type() != JsonType::OBJECT) {
+        throw JsonTypeErr("key() called on PackedNode which isnt "
+                          "JsonType::OBJECT");
+    }
+    if (idx >= slot->count) {
+        throw std::out_of_range("PackedNode member index out of range");
+    }
+    return table_slot(idx * 2);
+}
+
+// The table of a container must lie between its own slot and the strings:
+// values are packed depth first, so every table comes after the slot
+// referring to it. Every access is checked, so a damaged file can't make
+// us read outside of it or loop back to an ancestor.
+const PackedSlot& PackedNode::table_slot(size_t idx) const {
+    const PackHeader* header = reinterpret_cast<const PackHeader*>(base);
+    uint64_t slot_offset = reinterpret_cast<const char*>(slot) - base;
+    uint64_t table = slot->payload;
+    uint64_t width = get_type() == JsonType::OBJECT ? 2 : 1;
+    if (table < slot_offset + sizeof(PackedSlot) || table > header->strings ||
+        slot->count * width * sizeof(PackedSlot) > header->strings - table) {
+        throw PackErr("Pack Error: container table out of place");
+    }
+    return *reinterpret_cast<const PackedSlot*>(base + table +
+                                                idx * sizeof(PackedSlot));
+}
+
+std::string_view PackedNode::string_at(const PackedSlot& str) const {
+    const PackHeader* header = reinterpret_cast<const PackHeader*>(base);
+    uint64_t offset = header->strings + str.payload;
+    if (offset > file_size || str.count > file_size - offset) {
+        throw PackErr("Pack Error: string outside of the file");
+    }
+    return std::string_view(base + offset, str.count);
+}
+
+PackedDocument::PackedDocument(const std::string& file_name) {
+    int fd = ::open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed opening file " + file_name +
+                                 ". Does it exit?");
+    }
+    map(fd, file_name);
+}
+
+PackedDocument PackedDocument::attach_shared(const std::string& name) {
+    std::string shm_name = shared_name(name);
+    int fd = ::shm_open(shm_name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Failed opening shared memory " + shm_name +
+                                 ". Was it published?");
+    }
+    PackedDocument doc;
+    doc.map(fd, shm_name);
+    return doc;
+}
+
+// Maps the document read-only and checks its header, closes fd
+void PackedDocument::map(int fd, const std::string& name) {
+    struct stat st;
+    if (::fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(PackHeader)) {
+        ::close(fd);
+        throw PackErr("Pack Error: " + name + " is too small");
+    }
+    size = st.st_size;
+    void* mapped = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid without the descriptor
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error("Failed mapping " + name);
+    }
+    data = static_cast<const char*>(mapped);
+
+    const PackHeader* header = reinterpret_cast<const PackHeader*>(data);
+    std::string problem;
+    if (std::memcmp(header->magic, pack_magic, sizeof(pack_magic)) != 0) {
+        problem = "not a packed document";
+    } else if (header->byte_order != pack_byte_order) {
+        problem = "packed with another byte order";
+    } else if (header->version != pack_version) {
+        problem = "unsupported version " + std::to_string(header->version);
+    } else if (header->file_size != size || header->strings > size) {
+        problem = "truncated";
+    }
+    if (!problem.empty()) {
+        unmap();
+        throw PackErr("Pack Error: " + name + ": " + problem);
+    }
+}
+
+PackedDocument::PackedDocument(PackedDocument&& other) noexcept
+    : data(std::exchange(other.data, nullptr)),
+      size(std::exchange(other.size, 0)) {}
+
+PackedDocument& PackedDocument::operator=(PackedDocument&& other) noexcept {
+    if (this != &other) {
+        unmap();
+        data = std::exchange(other.data, nullptr);
+        size = std::exchange(other.size, 0);
+    }
+    return *this;
+}
+
+PackedDocument::~PackedDocument() {
+    unmap();
+}
+
+void PackedDocument::unmap() {
+    if (data != nullptr) {
+        ::munmap(const_cast<char*>(data), size);
+        data = nullptr;
+    }
+}
+
+PackedNode PackedDocument::root() const {
+    const PackHeader* header = reinterpret_cast<const PackHeader*>(data);
+    return PackedNode(data, size, &header->root);
+}
+
+void PackedDocument::verify() const {
+    const PackHeader* header = reinterpret_cast<const PackHeader*>(data);
+    if (checksum(data, size) != header->checksum) {
+        throw PackErr("Pack Error: checksum mismatch, the document is "
+                      "damaged");
+    }
+    verify_tables();
+}
+
+// The checksum can be recomputed by anyone, so it doesn't stop a crafted
+// document from pointing two slots at one table, which makes a few KB
+// expand into 2^depth nodes. The tables have to be laid out the way the
+// Packer writes them: depth first, each starting where the previous one
+// ended, up to the strings. Then every table belongs to a single slot and
+// the document is a tree no bigger than its file.
+void PackedDocument::verify_tables() const {
+    const PackHeader* header = reinterpret_cast<const PackHeader*>(data);
+    uint64_t next_table = sizeof(PackHeader);
+    if (header->strings < next_table) {
+        throw PackErr("Pack Error: container tables overlap or are out of "
+                      "order");
+    }
+    // Containers being walked, with the index of their next child
+    std::vector<std::pair<const PackedSlot*, uint32_t>> stack;
+    auto enter = [&](const PackedSlot& slot) {
+        JsonType type = static_cast<JsonType>(slot.type);
+        if (type != JsonType::ARRAY && type != JsonType::OBJECT) {
+            return;
+        }
+        uint64_t width = type == JsonType::OBJECT ? 2 : 1;
+        if (slot.payload != next_table ||
+            slot.count * width * sizeof(PackedSlot) >
+                header->strings - next_table) {
+            throw PackErr("Pack Error: container tables overlap or are out "
+                          "of order");
+        }
+        next_table += slot.count * width * sizeof(PackedSlot);
+        stack.emplace_back(&slot, 0);
+    };
+
+    enter(header->root);
+    while (!stack.empty()) {
+        auto [slot, idx] = stack.back();
+        if (idx == slot->count) {
+            stack.pop_back();
+            continue;
+        }
+        ++stack.back().second;
+        uint64_t width =
+            static_cast<JsonType>(slot->type) == JsonType::OBJECT ? 2 : 1;
+        const PackedSlot* table =
+            reinterpret_cast<const PackedSlot*>(data + slot->payload);
+        enter(table[idx * width + width - 1]);
+    }
+    if (next_table != header->strings) {
+        throw PackErr("Pack Error: container tables overlap or are out of "
+                      "order");
+    }
+}
+
+} // namespace k4json
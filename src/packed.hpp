@@ -0,0 +1,138 @@
+#pragma once
+
+#include "json.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace k4json {
+
+// The file isn't a packed document, or is a damaged one
+class PackErr : public std::runtime_error {
+public:
+    explicit PackErr(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+// Binary form of a Json, which is navigated where it lies (in a mmapped
+// file) instead of being parsed.
+//
+// Every value is a 16 byte slot: its type, a count and a payload. Numbers
+// and booleans are stored in the payload. Strings point into the string
+// table at the end of the file, where equal strings (keys, mostly) are
+// stored once. Arrays point at a table of their element slots, objects at
+// a table of (key slot, value slot) members sorted by key, so elements are
+// found by offset and members by binary search. Values are written depth
+// first, so every table comes after the slot referring to it (which readers
+// rely on to reject cycles). All offsets are from the start of the file and
+// in the byte order of the machine which packed it.
+struct PackedSlot {
+    uint8_t type; // JsonType
+    uint8_t unused[3];
+    // Bytes of a string, children of a container
+    uint32_t count;
+    // The number's bits, the boolean, or the offset of the string or table
+    uint64_t payload;
+};
+
+struct PackHeader {
+    char magic[8];
+    uint32_t version;
+    // Tells apart files packed with the other byte order
+    uint32_t byte_order;
+    uint64_t file_size;
+    uint64_t strings;
+    // Of everything which follows it, see PackedDocument::verify()
+    uint64_t checksum;
+    PackedSlot root;
+};
+
+// Serializes json into the packed form
+void pack(const Json& json, std::ostream& out);
+std::string pack(const Json& json);
+// Whether the file starts like a packed document
+bool is_packed_file(const std::string& file_name);
+
+// Packs json into the POSIX shared memory object name ("/doc", the slash
+// is added if missing), for any number of processes on the host to
+// attach to with PackedDocument::attach_shared(). Replaces an object of
+// the same name, processes attached to it keep the old version.
+void publish_shared(const Json& json, const std::string& name);
+// The object lives until removed (or reboot)
+void remove_shared(const std::string& name);
+
+// A value of a packed document. A view: it doesn't own anything and is
+// only valid while its document is open.
+class PackedNode {
+public:
+    JsonType get_type() const;
+    bool is_null() const;
+    bool get_bool() const;
+    double get_number() const;
+    std::string_view get_string() const;
+
+    // Children of a container
+    int size() const;
+    // idx-th element of an array, or the value of the idx-th member of an
+    // object (in key order)
+    PackedNode operator[](size_t idx) const;
+    // Key of the idx-th member of an object
+    std::string_view key(size_t idx) const;
+    std::optional<PackedNode> obj_find(std::string_view key) const;
+
+    // Copies the value into a Json
+    Json to_json() const;
+
+private:
+    friend class PackedDocument;
+    PackedNode(const char* base, size_t size, const PackedSlot* slot);
+
+    const PackedSlot& member_key(size_t idx) const;
+    const PackedSlot& child(size_t idx) const;
+    const PackedSlot& table_slot(size_t idx) const;
+    std::string_view string_at(const PackedSlot& slot) const;
+
+    // The whole document
+    const char* base;
+    size_t file_size;
+    const PackedSlot* slot;
+};
+
+// A packed document mapped into memory. Opening it reads the header and
+// nothing else, the pages holding the values are read when first used.
+// The mapping is read-only and shared, so processes opening the same file
+// or shared memory object share its pages.
+class PackedDocument {
+public:
+    explicit PackedDocument(const std::string& file_name);
+    // See publish_shared()
+    static PackedDocument attach_shared(const std::string& name);
+    PackedDocument(const PackedDocument&) = delete;
+    PackedDocument& operator=(const PackedDocument&) = delete;
+    PackedDocument(PackedDocument&& other) noexcept;
+    PackedDocument& operator=(PackedDocument&& other) noexcept;
+    ~PackedDocument();
+
+    PackedNode root() const;
+    // Reads the whole document and throws PackErr if it doesn't match its
+    // checksum or its tables don't form a tree. Opening a document doesn't,
+    // so that only the pages a query uses are read: documents from
+    // untrusted sources need to be verified before they are queried.
+    void verify() const;
+
+private:
+    PackedDocument() = default;
+    void map(int fd, const std::string& name);
+    void unmap();
+    void verify_tables() const;
+
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+} // namespace k4json
@@ -0,0 +1,509 @@
+#include "packed_query.hpp"
+#include "nodelist.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace k4json {
+
+namespace {
+
+// Appends node and all of its descendants in document order, the same
+// order as collect_descendants() in expressions.cpp
+void collect_descendants(const PackedNode& node,
+                         std::vector<PackedNode>& out) {
+    out.push_back(node);
+    JsonType type = node.get_type();
+    if (type == JsonType::ARRAY || type == JsonType::OBJECT) {
+        for (int i = 0; i < node.size(); ++i) {
+            collect_descendants(node[i], out);
+        }
+    }
+}
+
+// https://www.rfc-editor.org/rfc/rfc9535#name-semantics-4, see
+// select_slice() in expressions.cpp
+void select_slice(const PackedNode& arr, std::optional<long> start,
+                  std::optional<long> end, long step,
+                  std::vector<PackedNode>& out) {
+    long len = arr.size();
+    if (step == 0) {
+        return;
+    }
+
+    auto normalize = [len](long idx) {
+        return idx >= 0 ? idx : len + idx;
+    };
+
+    if (step > 0) {
+        long lower = std::min(std::max(normalize(start.value_or(0)), 0L), len);
+        long upper = std::min(std::max(normalize(end.value_or(len)), 0L), len);
+        for (long i = lower; i < upper; i += step) {
+            out.push_back(arr[i]);
+        }
+    } else {
+        long upper = std::min(std::max(normalize(start.value_or(len - 1)), -1L),
+                              len - 1);
+        long lower = std::min(std::max(normalize(end.value_or(-len - 1)), -1L),
+                              len - 1);
+        for (long i = upper; lower < i; i += step) {
+            out.push_back(arr[i]);
+        }
+    }
+}
+
+} // namespace
+
+PackedQuery::PackedQuery(const std::string& query) {
+    buffer = query;
+    current = 0;
+    line = 1;
+
+    skip();
+    // The root identifier can be omitted, "a.b" is "$.a.b"
+    if (!match('$') && peek() != '[') {
+        Selector selector;
+        selector.name = parse_dot_name();
+        selectors.push_back(std::move(selector));
+        skip();
+        if (peek() == '(') {
+            syntax_err("functions need the whole document");
+        }
+    }
+
+    parse_segments(selectors);
+    skip();
+    if (!reached_end()) {
+        syntax_err("only paths can run over packed documents");
+    }
+}
+
+std::vector<PackedNode> PackedQuery::run(const PackedNode& root) const {
+    return select(selectors, {root}, root);
+}
+
+[[noreturn]] void PackedQuery::syntax_err(const std::string& msg) {
+    std::string res = "Packed Query Error: " + msg + '\n';
+    res += "position: " + std::to_string(current) + '\n';
+    res += buffer + '\n';
+    res += pretty_error_pointer(current);
+    throw StreamQueryErr(res);
+}
+
+void PackedQuery::parse_segments(std::vector<Selector>& selectors) {
+    while (true) {
+        skip();
+        char c = peek();
+        if (c != '.' && c != '[') {
+            return;
+        }
+        parse_segment(selectors);
+    }
+}
+
+// .name, .*, ..name, ..* or a bracketed selector, optionally after ..
+void PackedQuery::parse_segment(std::vector<Selector>& selectors) {
+    if (peek() == '[') {
+        parse_bracketed(selectors, false);
+        return;
+    }
+
+    assert_match('.');
+    bool descendant = match('.');
+    if (descendant && peek() == '[') {
+        parse_bracketed(selectors, true);
+        return;
+    }
+
+    Selector selector;
+    selector.descendant = descendant;
+    if (match('*')) {
+        selector.type = SelectorType::WILDCARD;
+    } else {
+        selector.name = parse_dot_name();
+    }
+    selectors.push_back(std::move(selector));
+}
+
+// ['name'], ["name"], [*], [index], [start:end:step] or [?filter], where
+// indices and slice bounds are integer literals
+void PackedQuery::parse_bracketed(std::vector<Selector>& selectors,
+                                  bool descendant) {
+    assert_match('[');
+
+    Selector selector;
+    selector.descendant = descendant;
+    if (match('?')) {
+        selector.type = SelectorType::FILTER;
+        selector.filter.push_back(parse_logical_or());
+    } else {
+        int open = current;
+        skip();
+        char c = peek();
+        if (c == '\'' || c == '"') {
+            next();
+            int start = current;
+            while (!reached_end() && peek() != c) {
+                next();
+            }
+            if (reached_end()) {
+                syntax_err("query ended early: unterminated name selector");
+            }
+            selector.name = buffer.substr(start, current - start);
+            next();
+            // Right after the [ it is a name selector, which the engine
+            // closes right after the quote
+            if (start == open + 1 && peek() != ']') {
+                syntax_err("unterminated name selector, expected ]");
+            }
+        } else if (match('*')) {
+            selector.type = SelectorType::WILDCARD;
+        } else {
+            std::optional<long> start;
+            if (c != ':') {
+                start = parse_integer();
+                skip();
+            }
+            if (match(':')) {
+                selector.type = SelectorType::SLICE;
+                selector.start = start;
+                skip();
+                if (peek() != ':' && peek() != ']') {
+                    selector.end = parse_integer();
+                    skip();
+                }
+                if (match(':')) {
+                    skip();
+                    if (peek() != ']') {
+                        selector.step = parse_integer();
+                    }
+                }
+            } else {
+                selector.type = SelectorType::INDEX;
+                selector.index = *start;
+            }
+        }
+    }
+
+    skip();
+    if (!match(']')) {
+        syntax_err("only literals can be used in selectors over packed "
+                   "documents");
+    }
+    selectors.push_back(std::move(selector));
+}
+
+std::string PackedQuery::parse_dot_name() {
+    if (!valid_dot_name_first(peek())) {
+        syntax_err("invalid first character in dot-notation name selector");
+    }
+    int start = current;
+    while (!reached_end() && valid_dot_name_char(peek())) {
+        next();
+    }
+    return buffer.substr(start, current - start);
+}
+
+long PackedQuery::parse_integer() {
+    double number;
+    if (!match_number(number) || std::floor(number) != number) {
+        syntax_err("only integer literals can be used as indices over "
+                   "packed documents");
+    }
+    return static_cast<long>(number);
+}
+
+// logical-or-expr     = logical-and-expr *(S "||" S logical-and-expr)
+PackedQuery::Logical PackedQuery::parse_logical_or() {
+    Logical res = parse_logical_and();
+    skip();
+    while (peek() == '|' && peekNext() == '|') {
+        next();
+        next();
+        if (res.type != LogicalType::OR) {
+            Logical either;
+            either.type = LogicalType::OR;
+            either.operands.push_back(std::move(res));
+            res = std::move(either);
+        }
+        res.operands.push_back(parse_logical_and());
+        skip();
+    }
+    return res;
+}
+
+// logical-and-expr    = basic-expr *(S "&&" S basic-expr)
+PackedQuery::Logical PackedQuery::parse_logical_and() {
+    Logical res = parse_logical_basic();
+    skip();
+    while (peek() == '&' && peekNext() == '&') {
+        next();
+        next();
+        if (res.type != LogicalType::AND) {
+            Logical both;
+            both.type = LogicalType::AND;
+            both.operands.push_back(std::move(res));
+            res = std::move(both);
+        }
+        res.operands.push_back(parse_logical_basic());
+        skip();
+    }
+    return res;
+}
+
+// basic-expr          = paren-expr / comparison-expr / test-expr
+// with the same restrictions as JsonExpressionParser::parse_logical_basic()
+PackedQuery::Logical PackedQuery::parse_logical_basic() {
+    skip();
+
+    bool negate = false;
+    if (peek() == '!' && peekNext() != '=') {
+        next();
+        skip();
+        negate = true;
+    }
+
+    Logical res;
+    if (match('(')) {
+        res = parse_logical_or();
+        skip();
+        if (!match(')')) {
+            syntax_err("expected )");
+        }
+    } else {
+        res.left = parse_comparable();
+        skip();
+        res.op = match_comparison();
+        if (res.op == Comparison::NONE) {
+            if (res.left.literal) {
+                syntax_err("a literal cannot be used as an existence test");
+            }
+            res.type = LogicalType::EXISTS;
+        } else {
+            if (negate) {
+                syntax_err("! can only be applied to an existence test or "
+                           "to a parenthesized expression");
+            }
+            res.right = parse_comparable();
+            res.type = LogicalType::COMPARE;
+            // Names and indices select at most one node, which is what
+            // the operands need to evaluate to
+            for (const Comparable* operand : {&res.left, &res.right}) {
+                for (const Selector& selector : operand->path.selectors) {
+                    if (selector.descendant ||
+                        (selector.type != SelectorType::NAME &&
+                         selector.type != SelectorType::INDEX)) {
+                        syntax_err("only singular queries can be compared "
+                                   "over packed documents");
+                    }
+                }
+            }
+        }
+    }
+
+    if (!negate) {
+        return res;
+    }
+    Logical inverse;
+    inverse.type = LogicalType::NOT;
+    inverse.operands.push_back(std::move(res));
+    return inverse;
+}
+
+// A literal, or a query from @ or $
+PackedQuery::Comparable PackedQuery::parse_comparable() {
+    skip();
+    Comparable res;
+
+    char c = peek();
+    if (c == '\'' || c == '"') {
+        next();
+        int start = current;
+        while (!reached_end() && peek() != c) {
+            next();
+        }
+        if (reached_end()) {
+            syntax_err("query ended early: unterminated string literal");
+        }
+        res.literal = Json(buffer.substr(start, current - start));
+        next();
+    } else if (match_keyword("true")) {
+        res.literal = Json(true);
+    } else if (match_keyword("false")) {
+        res.literal = Json(false);
+    } else if (match_keyword("null")) {
+        res.literal = Json();
+    } else if (c == '@' || c == '$') {
+        next();
+        res.path.relative = c == '@';
+        parse_segments(res.path.selectors);
+    } else {
+        double number;
+        if (!match_number(number)) {
+            syntax_err("only literals and queries can be used in filters "
+                       "over packed documents");
+        }
+        res.literal = Json(number);
+    }
+
+    return res;
+}
+
+Comparison PackedQuery::match_comparison() {
+    char c = peek();
+    char cn = peekNext();
+    if (c == '=' && cn == '=') {
+        next();
+        next();
+        return Comparison::EQ;
+    }
+    if (c == '!' && cn == '=') {
+        next();
+        next();
+        return Comparison::NE;
+    }
+    if (c == '<') {
+        next();
+        return match('=') ? Comparison::LE : Comparison::LT;
+    }
+    if (c == '>') {
+        next();
+        return match('=') ? Comparison::GE : Comparison::GT;
+    }
+    return Comparison::NONE;
+}
+
+// Matches true / false / null, but not e.g. "trueish"
+bool PackedQuery::match_keyword(std::string_view keyword) {
+    if (std::string_view(buffer).substr(current, keyword.size()) != keyword) {
+        return false;
+    }
+    if (current + keyword.size() < buffer.size() &&
+        valid_dot_name_char(buffer[current + keyword.size()])) {
+        return false;
+    }
+    current += keyword.size();
+    return true;
+}
+
+std::vector<PackedNode>
+PackedQuery::select(const std::vector<Selector>& selectors,
+                    std::vector<PackedNode> nodes,
+                    const PackedNode& root) const {
+    for (const Selector& selector : selectors) {
+        std::vector<PackedNode> next;
+        for (const PackedNode& node : nodes) {
+            if (!selector.descendant) {
+                apply(selector, node, root, next);
+                continue;
+            }
+            std::vector<PackedNode> descendants;
+            collect_descendants(node, descendants);
+            for (const PackedNode& descendant : descendants) {
+                apply(selector, descendant, root, next);
+            }
+        }
+        nodes = std::move(next);
+    }
+    return nodes;
+}
+
+// Nothing is selected by indices on objects or names on arrays, see
+// https://www.rfc-editor.org/rfc/rfc9535#name-semantics-3
+void PackedQuery::apply(const Selector& selector, const PackedNode& node,
+                        const PackedNode& root,
+                        std::vector<PackedNode>& out) const {
+    JsonType type = node.get_type();
+    bool container = type == JsonType::ARRAY || type == JsonType::OBJECT;
+    switch (selector.type) {
+    case SelectorType::NAME:
+        if (type == JsonType::OBJECT) {
+            if (std::optional<PackedNode> child = node.obj_find(selector.name)) {
+                out.push_back(*child);
+            }
+        }
+        break;
+    case SelectorType::INDEX:
+        if (type == JsonType::ARRAY) {
+            long idx = selector.index < 0 ? node.size() + selector.index
+                                          : selector.index;
+            if (0 <= idx && idx < node.size()) {
+                out.push_back(node[idx]);
+            }
+        }
+        break;
+    case SelectorType::WILDCARD:
+        if (container) {
+            for (int i = 0; i < node.size(); ++i) {
+                out.push_back(node[i]);
+            }
+        }
+        break;
+    case SelectorType::SLICE:
+        if (type == JsonType::ARRAY) {
+            select_slice(node, selector.start, selector.end, selector.step,
+                         out);
+        }
+        break;
+    case SelectorType::FILTER:
+        if (container) {
+            for (int i = 0; i < node.size(); ++i) {
+                PackedNode child = node[i];
+                if (holds(selector.filter[0], child, root)) {
+                    out.push_back(child);
+                }
+            }
+        }
+        break;
+    }
+}
+
+// Whether the filter expression holds for node
+bool PackedQuery::holds(const Logical& logical, const PackedNode& node,
+                        const PackedNode& root) const {
+    switch (logical.type) {
+    case LogicalType::OR:
+        return std::any_of(logical.operands.begin(), logical.operands.end(),
+                           [&](const Logical& operand) {
+                               return holds(operand, node, root);
+                           });
+    case LogicalType::AND:
+        return std::all_of(logical.operands.begin(), logical.operands.end(),
+                           [&](const Logical& operand) {
+                               return holds(operand, node, root);
+                           });
+    case LogicalType::NOT:
+        return !holds(logical.operands[0], node, root);
+    case LogicalType::EXISTS:
+        return !evaluate(logical.left.path, node, root).empty();
+    case LogicalType::COMPARE:
+        break;
+    }
+
+    // Only the compared values are copied out of the document
+    Json values[2];
+    NodeList operands[2];
+    const Comparable* comparables[2] = {&logical.left, &logical.right};
+    for (int i = 0; i < 2; ++i) {
+        if (comparables[i]->literal) {
+            operands[i].push_back(&*comparables[i]->literal);
+            continue;
+        }
+        std::vector<PackedNode> selected =
+            evaluate(comparables[i]->path, node, root);
+        if (!selected.empty()) {
+            values[i] = selected[0].to_json();
+            operands[i].push_back(&values[i]);
+        }
+    }
+    return compare_nodes(operands[0], operands[1], logical.op);
+}
+
+std::vector<PackedNode> PackedQuery::evaluate(const Path& path,
+                                              const PackedNode& node,
+                                              const PackedNode& root) const {
+    return select(path.selectors, {path.relative ? node : root}, root);
+}
+
+} // namespace k4json
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "expressions.hpp"
+#include "generic_parser.hpp"
+#include "json.hpp"
+#include "packed.hpp"
+#include "stream.hpp"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace k4json {
+
+// A query which runs over a packed document where it lies, without
+// converting the document into a Json. The subset is the JSONPath of
+// RFC 9535 without functions and arithmetic: name, index, wildcard and
+// slice selectors, descendant segments, and filters made of existence
+// tests and of comparisons between literals and singular queries (names
+// and indices only), e.g. "$..items[?@.price < 10 && !@.sold].name" or
+// "store[1:5]['name']". Only the values compared by filters are copied.
+class PackedQuery : private Parser {
+public:
+    // Throws StreamQueryErr for anything outside of the subset, which
+    // needs the expression engine (and so the whole document as a Json)
+    explicit PackedQuery(const std::string& query);
+
+    // The nodes the query selects in the document, in the order the
+    // expression engine would give them
+    std::vector<PackedNode> run(const PackedNode& root) const;
+
+private:
+    enum class SelectorType { NAME, INDEX, WILDCARD, SLICE, FILTER };
+    enum class LogicalType { OR, AND, NOT, EXISTS, COMPARE };
+
+    struct Logical;
+
+    struct Selector {
+        SelectorType type = SelectorType::NAME;
+        // Applied to every descendant (..) instead of to the node
+        bool descendant = false;
+        std::string name;
+        long index = 0;
+        std::optional<long> start;
+        std::optional<long> end;
+        long step = 1;
+        // The expression of a filter, one element
+        std::vector<Logical> filter;
+    };
+
+    // Relative to the root ($) or to the node being filtered (@)
+    struct Path {
+        bool relative = false;
+        std::vector<Selector> selectors;
+    };
+
+    // A literal, or else a singular query
+    struct Comparable {
+        std::optional<Json> literal;
+        Path path;
+    };
+
+    struct Logical {
+        LogicalType type = LogicalType::EXISTS;
+        // Of OR, AND and NOT
+        std::vector<Logical> operands;
+        Comparison op = Comparison::NONE;
+        // EXISTS tests left.path
+        Comparable left;
+        Comparable right;
+    };
+
+    [[noreturn]] void syntax_err(const std::string& msg) override;
+    void parse_segments(std::vector<Selector>& selectors);
+    void parse_segment(std::vector<Selector>& selectors);
+    void parse_bracketed(std::vector<Selector>& selectors, bool descendant);
+    std::string parse_dot_name();
+    long parse_integer();
+    Logical parse_logical_or();
+    Logical parse_logical_and();
+    Logical parse_logical_basic();
+    Comparable parse_comparable();
+    Comparison match_comparison();
+    bool match_keyword(std::string_view keyword);
+
+    std::vector<PackedNode> select(const std::vector<Selector>& selectors,
+                                   std::vector<PackedNode> nodes,
+                                   const PackedNode& root) const;
+    void apply(const Selector& selector, const PackedNode& node,
+               const PackedNode& root, std::vector<PackedNode>& out) const;
+    bool holds(const Logical& logical, const PackedNode& node,
+               const PackedNode& root) const;
+    std::vector<PackedNode> evaluate(const Path& path, const PackedNode& node,
+                                     const PackedNode& root) const;
+
+    std::vector<Selector> selectors;
+};
+
+} // namespace k4json
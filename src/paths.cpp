@@ -0,0 +1,116 @@
+#include "paths.hpp"
+#include "utils.hpp"
+
+#include <unordered_map>
+
+namespace k4json {
+
+namespace {
+
+// The nodes being looked for, with the indexes of nodes they were at
+typedef std::unordered_map<const Json*, std::vector<size_t>> Wanted;
+
+// Returns the number of wanted nodes found in json's subtree
+size_t walk(const Json& json, JsonPath& path, const Wanted& wanted,
+            size_t remaining, std::vector<JsonPath>& res) {
+    size_t found = 0;
+    auto it = wanted.find(&json);
+    if (it != wanted.end()) {
+        for (size_t idx : it->second) {
+            res[idx] = path;
+        }
+        ++found;
+    }
+
+    switch (json.get_type()) {
+    case JsonType::OBJECT:
+        for (const auto& [key, value] : json.get_obj_ref()) {
+            if (found == remaining) {
+                break;
+            }
+            path.emplace_back(std::string_view(key));
+            found += walk(value, path, wanted, remaining - found, res);
+            path.pop_back();
+        }
+        break;
+    case JsonType::ARRAY: {
+        const JsonArray& arr = json.get_array_ref();
+        for (size_t i = 0; i < arr.size() && found < remaining; ++i) {
+            path.emplace_back(i);
+            found += walk(arr[i], path, wanted, remaining - found, res);
+            path.pop_back();
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    return found;
+}
+
+// https://www.rfc-editor.org/rfc/rfc9535#section-2.7
+void append_normalized_name(std::string_view name, std::string& res) {
+    res += "['";
+    for (char c : name) {
+        switch (c) {
+        case '\b':
+            res += "\\b";
+            break;
+        case '\f':
+            res += "\\f";
+            break;
+        case '\n':
+            res += "\\n";
+            break;
+        case '\r':
+            res += "\\r";
+            break;
+        case '\t':
+            res += "\\t";
+            break;
+        case '\'':
+            res += "\\'";
+            break;
+        case '\\':
+            res += "\\\\";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                append_unicode_escape(static_cast<unsigned char>(c), res);
+            } else {
+                res += c;
+            }
+        }
+    }
+    res += "']";
+}
+
+} // namespace
+
+std::vector<JsonPath> locate(const Json& root,
+                             const std::vector<const Json*>& nodes) {
+    Wanted wanted;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        wanted[nodes[i]].push_back(i);
+    }
+
+    std::vector<JsonPath> res(nodes.size());
+    JsonPath path;
+    // The walk stops as soon as every node is found
+    walk(root, path, wanted, wanted.size(), res);
+    return res;
+}
+
+std::string normalized_path(const JsonPath& path) {
+    std::string res = "$";
+    for (const PathSegment& segment : path) {
+        if (const size_t* idx = std::get_if<size_t>(&segment)) {
+            res += '[' + std::to_string(*idx) + ']';
+        } else {
+            append_normalized_name(std::get<std::string_view>(segment), res);
+        }
+    }
+    return res;
+}
+
+} // namespace k4json
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "json.hpp"
+
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+namespace k4json {
+
+// A step from a node to one of its children: the member name in an
+// object or the index in an array
+typedef std::variant<std::string_view, size_t> PathSegment;
+// The steps from the root to a node. Names point into the keys of the Json.
+typedef std::vector<PathSegment> JsonPath;
+
+// Where each of nodes, which must be nodes of root, is in root. Found by
+// a walk over root once the query is done, so evaluation never has to
+// keep track of paths.
+std::vector<JsonPath> locate(const Json& root,
+                             const std::vector<const Json*>& nodes);
+
+// The path as an RFC 9535 normalized path, like $['store'][0]
+// https://www.rfc-editor.org/rfc/rfc9535#section-2.7
+std::string normalized_path(const JsonPath& path);
+
+} // namespace k4json
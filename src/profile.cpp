@@ -0,0 +1,192 @@
+#include "profile.hpp"
+
+#include <atomic>
+#include <cstdio>
+
+namespace k4json {
+
+namespace {
+// Off unless profiling, so other runs don't pay for a shared counter
+std::atomic<bool> counting = false;
+std::atomic<size_t> allocations = 0;
+} // namespace
+
+void start_counting_allocations() {
+    counting.store(true, std::memory_order_relaxed);
+}
+
+void count_allocation() {
+    if (counting.load(std::memory_order_relaxed)) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+size_t allocation_count() {
+    return allocations.load(std::memory_order_relaxed);
+}
+
+size_t json_bytes(const Json& json) {
+    size_t res = sizeof(Json);
+    switch (json.get_type()) {
+    case JsonType::STRING:
+        res += json.get_string_ref().size();
+        break;
+    case JsonType::ARRAY:
+        for (const Json& child : json.get_array_ref()) {
+            res += json_bytes(child);
+        }
+        break;
+    case JsonType::OBJECT:
+        for (auto& [key, value] : json.get_obj_ref()) {
+            // plus the map node
+            res += key.size() + sizeof(std::string) + 4 * sizeof(void*) +
+                   json_bytes(value);
+        }
+        break;
+    default:
+        break;
+    }
+    return res;
+}
+
+const std::vector<QueryStep>& QueryProfile::steps() const {
+    return _steps;
+}
+
+size_t QueryProfile::result_nodes() const {
+    return _result_nodes;
+}
+
+size_t QueryProfile::result_bytes() const {
+    return _result_bytes;
+}
+
+size_t QueryProfile::enter(const char* kind, int start) {
+    auto [it, inserted] =
+        by_start.try_emplace({start, kind}, _steps.size());
+    if (inserted) {
+        size_t parent = active.empty() ? SIZE_MAX : active.back().step;
+        _steps.push_back(QueryStep{kind, "", parent});
+    }
+    active.push_back(
+        {it->second, std::chrono::steady_clock::now(), allocation_count()});
+    return it->second;
+}
+
+void QueryProfile::leave(size_t step, std::string_view text, size_t nodes_in,
+                         size_t nodes_out) {
+    Active& a = active.back();
+    QueryStep& s = _steps[step];
+    if (s.text.empty()) {
+        s.text = text;
+    }
+    s.calls += 1;
+    s.nodes_in += nodes_in;
+    s.nodes_out += nodes_out;
+    s.time += std::chrono::steady_clock::now() - a.begin;
+    s.allocations += allocation_count() - a.allocations;
+    active.pop_back();
+}
+
+void QueryProfile::abandon() {
+    active.pop_back();
+}
+
+void QueryProfile::add_copied(size_t bytes) {
+    if (!active.empty()) {
+        _steps[active.back().step].bytes_copied += bytes;
+    }
+}
+
+void QueryProfile::set_result(size_t nodes, size_t bytes) {
+    _result_nodes = nodes;
+    _result_bytes = bytes;
+}
+
+// Children follow their parent in _steps, so one pass with a depth per
+// step is enough to print the tree
+std::vector<int> step_depths(const std::vector<QueryStep>& steps) {
+    std::vector<int> depths(steps.size(), 0);
+    for (size_t i = 0; i < steps.size(); ++i) {
+        if (steps[i].parent != SIZE_MAX) {
+            depths[i] = depths[steps[i].parent] + 1;
+        }
+    }
+    return depths;
+}
+
+std::string step_title(const QueryStep& step) {
+    if (step.text.empty()) {
+        return step.kind;
+    }
+    return step.kind + ' ' + step.text;
+}
+
+// The children of a step, in evaluation order
+void print_tree(const std::vector<QueryStep>& steps, size_t parent,
+                const std::vector<std::string>& rows, std::string& res) {
+    for (size_t i = 0; i < steps.size(); ++i) {
+        if (steps[i].parent == parent) {
+            res += rows[i];
+            print_tree(steps, i, rows, res);
+        }
+    }
+}
+
+std::string QueryProfile::explain() const {
+    std::vector<int> depths = step_depths(_steps);
+    std::vector<std::string> rows;
+    for (size_t i = 0; i < _steps.size(); ++i) {
+        rows.push_back(std::string(2 * depths[i], ' ') +
+                       step_title(_steps[i]) + '\n');
+    }
+
+    std::string res;
+    print_tree(_steps, SIZE_MAX, rows, res);
+    return res;
+}
+
+std::string QueryProfile::report() const {
+    std::vector<int> depths = step_depths(_steps);
+    std::vector<std::string> rows;
+    char line[128];
+    for (size_t i = 0; i < _steps.size(); ++i) {
+        const QueryStep& s = _steps[i];
+        std::snprintf(line, sizeof(line), "%8zu %10zu %10zu %10.3f %10zu %8zu  ",
+                      s.calls, s.nodes_in, s.nodes_out, s.time.count() / 1e6,
+                      s.bytes_copied, s.allocations);
+        rows.push_back(line + std::string(2 * depths[i], ' ') +
+                       step_title(s) + '\n');
+    }
+
+    std::string res =
+        "   calls   nodes in  nodes out    time ms   copied B   allocs  step\n";
+    print_tree(_steps, SIZE_MAX, rows, res);
+    std::snprintf(line, sizeof(line), "result: %zu nodes, %zu bytes copied\n",
+                  _result_nodes, _result_bytes);
+    res += line;
+    return res;
+}
+
+ProfileScope::ProfileScope(QueryProfile* profile, const char* kind, int start)
+    : profile(profile), step(0) {
+    if (profile != nullptr) {
+        step = profile->enter(kind, start);
+    }
+}
+
+void ProfileScope::finish(std::string_view text, size_t nodes_in,
+                          size_t nodes_out) {
+    if (profile != nullptr) {
+        profile->leave(step, text, nodes_in, nodes_out);
+        profile = nullptr;
+    }
+}
+
+ProfileScope::~ProfileScope() {
+    if (profile != nullptr) {
+        profile->abandon();
+    }
+}
+
+} // namespace k4json
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "json.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace k4json {
+
+// Heap allocations made by every thread (the thread pool's included) since
+// start_counting_allocations(). Only counts when the program replaces
+// operator new with one calling count_allocation(), json_eval does.
+void start_counting_allocations();
+void count_allocation();
+size_t allocation_count();
+
+// Approximate number of bytes a copy of json takes
+size_t json_bytes(const Json& json);
+
+// What the evaluator did for one selector or function call of a query,
+// summed over all of its evaluations (a selector inside a filter runs once
+// per candidate). Times and allocations include the nested steps.
+struct QueryStep {
+    std::string kind;
+    std::string text;
+    // Index of the enclosing step, SIZE_MAX at the top level
+    size_t parent;
+    size_t calls = 0;
+    size_t nodes_in = 0;
+    size_t nodes_out = 0;
+    size_t bytes_copied = 0;
+    size_t allocations = 0;
+    std::chrono::nanoseconds time{0};
+};
+
+// Filled in by JsonExpressionParser while it evaluates a query. Since
+// parsing and evaluation are one pass, the steps are only known once the
+// query has run.
+class QueryProfile {
+public:
+    // Steps in the order they were first evaluated, parents before children
+    const std::vector<QueryStep>& steps() const;
+    // Nodes and bytes copied into the final result
+    size_t result_nodes() const;
+    size_t result_bytes() const;
+
+    // The step tree
+    std::string explain() const;
+    // The step tree with the numbers of every step
+    std::string report() const;
+
+private:
+    friend class ProfileScope;
+    friend class JsonExpressionParser;
+
+    struct Active {
+        size_t step;
+        std::chrono::steady_clock::time_point begin;
+        size_t allocations;
+    };
+
+    size_t enter(const char* kind, int start);
+    void leave(size_t step, std::string_view text, size_t nodes_in,
+               size_t nodes_out);
+    void abandon();
+    void add_copied(size_t bytes);
+    void set_result(size_t nodes, size_t bytes);
+
+    std::vector<QueryStep> _steps;
+    // A step is identified by where it starts in the query and its kind
+    std::map<std::pair<int, std::string>, size_t> by_start;
+    // Steps being evaluated, innermost last
+    std::vector<Active> active;
+    size_t _result_nodes = 0;
+    size_t _result_bytes = 0;
+};
+
+// Records one evaluation of a step while alive. Does nothing without a
+// profile. If finish() isn't called (the evaluation threw) the evaluation
+// isn't counted.
+class ProfileScope {
+public:
+    ProfileScope(QueryProfile* profile, const char* kind, int start);
+    ~ProfileScope();
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+    void finish(std::string_view text, size_t nodes_in, size_t nodes_out);
+
+    // Sizes are only taken when profiling
+    template <typename In, typename Out>
+    void finish(std::string_view text, const In& in, const Out& out) {
+        if (profile != nullptr) {
+            finish(text, in.size(), out.size());
+        }
+    }
+
+private:
+    QueryProfile* profile;
+    size_t step;
+};
+
+} // namespace k4json
@@ -0,0 +1,206 @@
+#pragma once
+
+#include "json.hpp"
+#include "utils.hpp"
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+#include <utility>
+
+namespace k4json {
+
+// A string literal usable as a template argument: query<"a.b[0]">
+template <size_t N>
+struct fixed_string {
+    char data[N];
+
+    constexpr fixed_string(const char (&str)[N]) {
+        for (size_t i = 0; i < N; ++i) {
+            data[i] = str[i];
+        }
+    }
+
+    constexpr std::string_view view() const {
+        return std::string_view(data, N - 1);
+    }
+};
+
+namespace detail {
+
+// Not constexpr, so reaching it while compiling a query stops compilation
+// with the message in the diagnostic
+void query_syntax_error(const char* msg);
+
+struct CompiledStep {
+    bool is_name;
+    // Where the name is in the query
+    size_t name_start;
+    size_t name_size;
+    long index;
+};
+
+struct CompiledQuery {
+    static constexpr size_t max_steps = 64;
+    std::array<CompiledStep, max_steps> steps{};
+    size_t size = 0;
+
+    consteval void push(CompiledStep step) {
+        if (size == max_steps) {
+            query_syntax_error("query has too many selectors");
+        }
+        steps[size++] = step;
+    }
+};
+
+consteval size_t skip_whitespace(std::string_view q, size_t i) {
+    while (i < q.size() && is_whitespace(q[i])) {
+        ++i;
+    }
+    return i;
+}
+
+consteval size_t compile_dot_name(std::string_view q, size_t i,
+                                  CompiledQuery& res) {
+    if (i >= q.size() || !valid_dot_name_first(q[i])) {
+        query_syntax_error("invalid first character in dot-notation name "
+                           "selector");
+    }
+    size_t start = i;
+    while (i < q.size() && valid_dot_name_char(q[i])) {
+        ++i;
+    }
+    res.push({true, start, i - start, 0});
+    return i;
+}
+
+// ['name'], ["name"] or [index], i is just past the [
+consteval size_t compile_bracketed(std::string_view q, size_t i,
+                                   CompiledQuery& res) {
+    size_t open = i;
+    i = skip_whitespace(q, i);
+    if (i >= q.size()) {
+        query_syntax_error("query ended early: unterminated selector");
+    }
+
+    char c = q[i];
+    if (c == '\'' || c == '"') {
+        size_t start = ++i;
+        while (i < q.size() && q[i] != c) {
+            ++i;
+        }
+        if (i >= q.size()) {
+            query_syntax_error("query ended early: unterminated name "
+                               "selector");
+        }
+        res.push({true, start, i - start, 0});
+        ++i;
+        // Like parse(): a quote right after the [ is a name selector,
+        // closed right after the quote. After whitespace it is a string
+        // expression, which may be followed by whitespace.
+        if (start == open + 1 && (i >= q.size() || q[i] != ']')) {
+            query_syntax_error("unterminated name selector, expected ]");
+        }
+    } else {
+        bool negative = c == '-';
+        if (negative) {
+            ++i;
+        }
+        if (i >= q.size() || q[i] < '0' || q[i] > '9') {
+            query_syntax_error("only names and integer indices can be "
+                               "compiled, use parse() for the rest");
+        }
+        long index = 0;
+        while (i < q.size() && '0' <= q[i] && q[i] <= '9') {
+            index = index * 10 + (q[i] - '0');
+            ++i;
+        }
+        res.push({false, 0, 0, negative ? -index : index});
+    }
+
+    i = skip_whitespace(q, i);
+    if (i >= q.size() || q[i] != ']') {
+        query_syntax_error("only names and integer indices can be compiled, "
+                           "use parse() for the rest");
+    }
+    return i + 1;
+}
+
+// The singular subset of the JsonExpressionParser grammar: the root
+// identifier (which can be omitted), dot-notation and quoted names and
+// integer indices
+consteval CompiledQuery compile(std::string_view q) {
+    CompiledQuery res;
+    size_t i = skip_whitespace(q, 0);
+    if (i < q.size() && q[i] == '$') {
+        ++i;
+    } else if (i < q.size() && q[i] != '[') {
+        i = compile_dot_name(q, i, res);
+    }
+
+    while (true) {
+        i = skip_whitespace(q, i);
+        if (i >= q.size()) {
+            return res;
+        }
+        if (q[i] == '[') {
+            i = compile_bracketed(q, i + 1, res);
+        } else if (q[i] == '.') {
+            if (i + 1 < q.size() && (q[i + 1] == '.' || q[i + 1] == '*')) {
+                query_syntax_error("only singular queries (names and "
+                                   "indices) can be compiled");
+            }
+            i = compile_dot_name(q, i + 1, res);
+        } else {
+            query_syntax_error("only names and integer indices can be "
+                               "compiled, use parse() for the rest");
+        }
+    }
+}
+
+template <fixed_string Q, CompiledStep step>
+const Json* apply_step(const Json* node) {
+    if constexpr (step.is_name) {
+        if (node->get_type() != JsonType::OBJECT) {
+            return nullptr;
+        }
+        return node->obj_find(Q.view().substr(step.name_start, step.name_size));
+    } else {
+        if (node->get_type() != JsonType::ARRAY) {
+            return nullptr;
+        }
+        const JsonArray& arr = node->get_array_ref();
+        long idx = step.index;
+        // Same as the runtime index selector
+        if constexpr (step.index < 0) {
+            idx += static_cast<long>(arr.size());
+        }
+        if (idx < 0 || idx >= static_cast<long>(arr.size())) {
+            return nullptr;
+        }
+        return &arr[idx];
+    }
+}
+
+} // namespace detail
+
+// The node query Q selects in json, or nullptr if it selects nothing.
+// Q is parsed at compile time (a query outside of the supported subset
+// doesn't compile) into a chain of lookups, so nothing is parsed or
+// allocated at runtime:
+//     const Json* price = query<"store[0].price">(json);
+template <fixed_string Q>
+const Json* query(const Json& json) {
+    static constexpr detail::CompiledQuery compiled = detail::compile(Q.view());
+
+    const Json* node = &json;
+    [&]<size_t... I>(std::index_sequence<I...>) {
+        ((node = node == nullptr
+                     ? nullptr
+                     : detail::apply_step<Q, compiled.steps[I]>(node)),
+         ...);
+    }(std::make_index_sequence<compiled.size>{});
+    return node;
+}
+
+} // namespace k4json
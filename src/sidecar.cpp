@@ -0,0 +1,544 @@
+#include "sidecar.hpp"
+#include "loader.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace k4json {
+
+namespace fs = std::filesystem;
+
+static_assert(sizeof(SidecarHeader) == 56);
+static_assert(sizeof(SidecarEntry) == 48);
+
+constexpr char sidecar_magic[8] = {'K', '4', 'J', 'I', 'D', 'X', '\0', '\0'};
+constexpr uint32_t sidecar_version = 1;
+
+namespace {
+
+// The json file mapped read-only while it is scanned
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& file_name) {
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed opening file " + file_name +
+                                     ". Does it exit?");
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            throw std::runtime_error("File " + file_name + " empty.");
+        }
+        size = st.st_size;
+        void* mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            throw std::runtime_error("Failed mapping file " + file_name);
+        }
+        // Read front to back, once
+        ::madvise(mapped, size, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(mapped);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+        ::munmap(const_cast<char*>(data), size);
+    }
+
+    const char* data;
+    size_t size;
+};
+
+// Like JsonStreamer, the scanner only tracks strings and brackets, values
+// are validated when a query loads them
+class SidecarBuilder {
+public:
+    SidecarBuilder(const char* text, size_t size, uint32_t max_depth)
+        : text(text), size(size), max_depth(max_depth) {}
+
+    void build() {
+        size_t pos = skip_whitespace(0);
+        if (pos == size || (text[pos] != '{' && text[pos] != '[')) {
+            error("json must be object or array", pos);
+        }
+        scan(pos, 0, 0, 0);
+    }
+
+    std::vector<SidecarEntry> entries;
+    std::vector<uint64_t> child_table;
+    std::string keys;
+
+private:
+    // Scans the value at pos, moving pos past it. Returns its entry.
+    uint64_t scan(size_t& pos, uint32_t depth, uint64_t key_offset,
+                  uint32_t key_length) {
+        uint64_t idx = entries.size();
+        entries.emplace_back();
+        SidecarEntry node{};
+        node.offset = pos;
+        node.key_offset = key_offset;
+        node.key_length = key_length;
+
+        switch (text[pos]) {
+        case '{':
+        case '[':
+            node.type = static_cast<uint8_t>(text[pos] == '{'
+                                                 ? JsonType::OBJECT
+                                                 : JsonType::ARRAY);
+            if (depth < max_depth) {
+                scan_children(pos, depth, node);
+            } else {
+                pos = container_end(pos);
+            }
+            break;
+        case '"':
+            node.type = static_cast<uint8_t>(JsonType::STRING);
+            pos = string_end(pos);
+            break;
+        case 't':
+        case 'f':
+            node.type = static_cast<uint8_t>(JsonType::BOOL);
+            pos = scalar_end(pos);
+            break;
+        case 'n':
+            node.type = static_cast<uint8_t>(JsonType::NULLVAL);
+            pos = scalar_end(pos);
+            break;
+        default:
+            node.type = static_cast<uint8_t>(JsonType::NUMBER);
+            pos = scalar_end(pos);
+            if (pos == node.offset) {
+                error("unexpected symbol for value", pos);
+            }
+        }
+
+        node.length = pos - node.offset;
+        entries[idx] = node;
+        return idx;
+    }
+
+    void scan_children(size_t& pos, uint32_t depth, SidecarEntry& node) {
+        bool object = text[pos] == '{';
+        char close = object ? '}' : ']';
+        std::vector<uint64_t> children;
+        pos = skip_whitespace(pos + 1);
+        if (pos < size && text[pos] == close) {
+            ++pos;
+        } else {
+            while (true) {
+                uint64_t key_offset = keys.size();
+                if (object) {
+                    add_key(pos);
+                    pos = skip_whitespace(pos);
+                    if (pos == size || text[pos] != ':') {
+                        error("key string must be followed by a semicolon",
+                              pos);
+                    }
+                    pos = skip_whitespace(pos + 1);
+                }
+                if (pos == size) {
+                    error("unexpected end of file", pos);
+                }
+                uint32_t key_length = keys.size() - key_offset;
+                children.push_back(
+                    scan(pos, depth + 1, key_offset, key_length));
+
+                pos = skip_whitespace(pos);
+                if (pos < size && text[pos] == ',') {
+                    pos = skip_whitespace(pos + 1);
+                    continue;
+                }
+                if (pos < size && text[pos] == close) {
+                    ++pos;
+                    break;
+                }
+                error(object ? "unexpected symbol, wanted , or }"
+                             : "unexpected symbol, wanted , or ]",
+                      pos);
+            }
+        }
+
+        if (children.size() > UINT32_MAX) {
+            error("too many children to index", node.offset);
+        }
+        if (object) {
+            // Stable, so among duplicate keys the last one stays last
+            std::stable_sort(children.begin(), children.end(),
+                             [this](uint64_t a, uint64_t b) {
+                                 return key(a) < key(b);
+                             });
+        }
+        node.indexed = 1;
+        node.first_child = child_table.size();
+        node.nchildren = children.size();
+        child_table.insert(child_table.end(), children.begin(),
+                           children.end());
+    }
+
+    // Appends the unescaped key at pos to keys, moves pos past it
+    void add_key(size_t& pos) {
+        if (pos == size || text[pos] != '"') {
+            error("unexpected symbol, wanted key-value pair", pos);
+        }
+        size_t end = string_end(pos);
+        std::string_view raw(text + pos + 1, end - pos - 2);
+        if (raw.find('\\') == std::string_view::npos) {
+            keys += raw;
+        } else {
+            keys += JsonLoader::value_from_string(
+                        std::string(text + pos, end - pos))
+                        .get_string_ref();
+        }
+        pos = end;
+    }
+
+    std::string_view key(uint64_t idx) const {
+        const SidecarEntry& node = entries[idx];
+        return std::string_view(keys).substr(node.key_offset,
+                                             node.key_length);
+    }
+
+    size_t skip_whitespace(size_t pos) const {
+        while (pos < size && is_whitespace(text[pos])) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    // pos is at the opening quote, returns the position after the closing
+    size_t string_end(size_t pos) const {
+        for (size_t i = pos + 1; i < size; ++i) {
+            if (text[i] == '\\') {
+                ++i;
+            } else if (text[i] == '"') {
+                return i + 1;
+            }
+        }
+        error("unterminated string", pos);
+    }
+
+    size_t container_end(size_t pos) const {
+        int depth = 0;
+        for (size_t i = pos; i < size; ++i) {
+            switch (text[i]) {
+            case '"':
+                i = string_end(i) - 1;
+                break;
+            case '{':
+            case '[':
+                ++depth;
+                break;
+            case '}':
+            case ']':
+                if (--depth == 0) {
+                    return i + 1;
+                }
+                break;
+            }
+        }
+        error("unexpected end of input inside an object or array", pos);
+    }
+
+    size_t scalar_end(size_t pos) const {
+        while (pos < size && text[pos] != ',' && text[pos] != '}' &&
+               text[pos] != ']' && !is_whitespace(text[pos])) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    [[noreturn]] void error(const std::string& msg, size_t pos) const {
+        throw JsonLoadErr("Load Error: " + msg + '\n' +
+                          "position: " + std::to_string(pos) + '\n');
+    }
+
+    const char* text;
+    size_t size;
+    uint32_t max_depth;
+};
+
+int64_t modification_time(const std::string& file_name) {
+    return fs::last_write_time(file_name).time_since_epoch().count();
+}
+
+// Applies the steps of path which are left to a loaded fragment
+void select_json(const Json& json, const SimplePath& path, size_t step,
+                 JsonArray& res) {
+    if (step == path.steps().size()) {
+        res.push_back(json);
+        return;
+    }
+    const SimplePath::Step& selector = path.steps()[step];
+    switch (selector.type) {
+    case SimplePath::StepType::NAME:
+        if (json.get_type() == JsonType::OBJECT) {
+            if (const Json* child = json.obj_find(selector.name)) {
+                select_json(*child, path, step + 1, res);
+            }
+        }
+        break;
+    case SimplePath::StepType::INDEX:
+        if (json.get_type() == JsonType::ARRAY &&
+            selector.index < json.get_array_ref().size()) {
+            select_json(json.get_array_ref()[selector.index], path, step + 1,
+                        res);
+        }
+        break;
+    case SimplePath::StepType::WILDCARD:
+        if (json.get_type() == JsonType::OBJECT) {
+            for (const auto& [key, value] : json.get_obj_ref()) {
+                select_json(value, path, step + 1, res);
+            }
+        } else if (json.get_type() == JsonType::ARRAY) {
+            for (const Json& value : json.get_array_ref()) {
+                select_json(value, path, step + 1, res);
+            }
+        }
+        break;
+    }
+}
+
+} // namespace
+
+std::string sidecar_name(const std::string& file_name) {
+    return file_name + ".k4idx";
+}
+
+SidecarIndex SidecarIndex::open(const std::string& file_name,
+                                uint32_t max_depth) {
+    std::error_code ec;
+    uint64_t file_size = fs::file_size(file_name, ec);
+    if (ec) {
+        throw std::runtime_error("Failed opening file " + file_name +
+                                 ". Does it exit?");
+    }
+
+    SidecarIndex index;
+    index.file_name = file_name;
+    if (index.read(sidecar_name(file_name), file_size,
+                   modification_time(file_name), max_depth)) {
+        return index;
+    }
+    index = build(file_name, max_depth);
+    index.write(sidecar_name(file_name));
+    return index;
+}
+
+SidecarIndex SidecarIndex::build(const std::string& file_name,
+                                 uint32_t max_depth) {
+    int64_t mtime = modification_time(file_name);
+    MappedFile file(file_name);
+    SidecarBuilder builder(file.data, file.size, max_depth);
+    builder.build();
+
+    SidecarHeader header{};
+    std::memcpy(header.magic, sidecar_magic, sizeof(sidecar_magic));
+    header.version = sidecar_version;
+    header.max_depth = max_depth;
+    header.file_size = file.size;
+    header.mtime = mtime;
+    header.nentries = builder.entries.size();
+    header.nchildren = builder.child_table.size();
+    header.keys_size = builder.keys.size();
+
+    SidecarIndex index;
+    index.file_name = file_name;
+    std::string& data = index.data;
+    data.reserve(sizeof(header) +
+                 builder.entries.size() * sizeof(SidecarEntry) +
+                 builder.child_table.size() * sizeof(uint64_t) +
+                 builder.keys.size());
+    data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    data.append(reinterpret_cast<const char*>(builder.entries.data()),
+                builder.entries.size() * sizeof(SidecarEntry));
+    data.append(reinterpret_cast<const char*>(builder.child_table.data()),
+                builder.child_table.size() * sizeof(uint64_t));
+    data += builder.keys;
+    return index;
+}
+
+// Returns false if the sidecar is missing, out of date or damaged
+bool SidecarIndex::read(const std::string& sidecar_name, uint64_t file_size,
+                        int64_t mtime, uint32_t max_depth) {
+    std::ifstream infile(sidecar_name, std::ios::binary);
+    if (!infile.good()) {
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(infile),
+                std::istreambuf_iterator<char>());
+
+    if (data.size() < sizeof(SidecarHeader)) {
+        return false;
+    }
+    const SidecarHeader& head = header();
+    if (std::memcmp(head.magic, sidecar_magic, sizeof(sidecar_magic)) != 0 ||
+        head.version != sidecar_version || head.max_depth != max_depth ||
+        head.file_size != file_size || head.mtime != mtime) {
+        return false;
+    }
+    size_t rest = data.size() - sizeof(SidecarHeader);
+    if (head.nentries == 0 || head.nentries > rest / sizeof(SidecarEntry) ||
+        head.nchildren > rest / sizeof(uint64_t) ||
+        head.nentries * sizeof(SidecarEntry) +
+                head.nchildren * sizeof(uint64_t) + head.keys_size !=
+            rest) {
+        return false;
+    }
+
+    // Every offset has to stay inside of the files
+    const uint64_t* child_table = reinterpret_cast<const uint64_t*>(
+        data.data() + sizeof(SidecarHeader) +
+        head.nentries * sizeof(SidecarEntry));
+    for (size_t i = 0; i < head.nchildren; ++i) {
+        if (child_table[i] >= head.nentries) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < head.nentries; ++i) {
+        const SidecarEntry& node = entry(i);
+        if (node.offset > file_size || node.length > file_size - node.offset ||
+            node.first_child > head.nchildren ||
+            node.nchildren > head.nchildren - node.first_child ||
+            node.key_offset > head.keys_size ||
+            node.key_length > head.keys_size - node.key_offset) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Failing to write is fine, the index is built again next time
+void SidecarIndex::write(const std::string& sidecar_name) const {
+    std::error_code ec;
+    std::string tmp = sidecar_name + ".tmp" + std::to_string(::getpid());
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        out.write(data.data(), data.size());
+        out.close();
+        if (!out.good()) {
+            fs::remove(tmp, ec);
+            return;
+        }
+    }
+    fs::rename(tmp, sidecar_name, ec);
+    if (ec) {
+        fs::remove(tmp, ec);
+    }
+}
+
+JsonArray SidecarIndex::query(const SimplePath& path) const {
+    std::ifstream in(file_name, std::ios::binary);
+    if (!in.good()) {
+        throw std::runtime_error("Failed opening file " + file_name +
+                                 ". Does it exit?");
+    }
+    JsonArray res;
+    // The root comes first
+    select(entry(0), path, 0, in, res);
+    return res;
+}
+
+size_t SidecarIndex::size() const {
+    return header().nentries;
+}
+
+const SidecarHeader& SidecarIndex::header() const {
+    return *reinterpret_cast<const SidecarHeader*>(data.data());
+}
+
+const SidecarEntry& SidecarIndex::entry(size_t idx) const {
+    return reinterpret_cast<const SidecarEntry*>(
+        data.data() + sizeof(SidecarHeader))[idx];
+}
+
+const SidecarEntry& SidecarIndex::child(const SidecarEntry& parent,
+                                        size_t idx) const {
+    const uint64_t* child_table = reinterpret_cast<const uint64_t*>(
+        data.data() + sizeof(SidecarHeader) +
+        header().nentries * sizeof(SidecarEntry));
+    return entry(child_table[parent.first_child + idx]);
+}
+
+std::string_view SidecarIndex::key(const SidecarEntry& member) const {
+    const char* keys = data.data() + data.size() - header().keys_size;
+    return std::string_view(keys + member.key_offset, member.key_length);
+}
+
+// Follows the index while the node's children have entries, loads the
+// node's fragment of the file once they don't
+void SidecarIndex::select(const SidecarEntry& node, const SimplePath& path,
+                          size_t step, std::ifstream& in,
+                          JsonArray& res) const {
+    if (step == path.steps().size()) {
+        res.push_back(load(node, in));
+        return;
+    }
+    if (!node.indexed) {
+        select_json(load(node, in), path, step, res);
+        return;
+    }
+
+    const SimplePath::Step& selector = path.steps()[step];
+    JsonType type = static_cast<JsonType>(node.type);
+    switch (selector.type) {
+    case SimplePath::StepType::NAME: {
+        if (type != JsonType::OBJECT) {
+            break;
+        }
+        // The last of the members with the name, like the loader keeps
+        size_t lo = 0;
+        size_t hi = node.nchildren;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (key(child(node, mid)) <= selector.name) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo > 0 && key(child(node, lo - 1)) == selector.name) {
+            select(child(node, lo - 1), path, step + 1, in, res);
+        }
+        break;
+    }
+    case SimplePath::StepType::INDEX:
+        if (type == JsonType::ARRAY && selector.index < node.nchildren) {
+            select(child(node, selector.index), path, step + 1, in, res);
+        }
+        break;
+    case SimplePath::StepType::WILDCARD:
+        for (size_t i = 0; i < node.nchildren; ++i) {
+            if (type == JsonType::OBJECT && i + 1 < node.nchildren &&
+                key(child(node, i)) == key(child(node, i + 1))) {
+                // Replaced by a later duplicate
+                continue;
+            }
+            select(child(node, i), path, step + 1, in, res);
+        }
+        break;
+    }
+}
+
+Json SidecarIndex::load(const SidecarEntry& node, std::ifstream& in) const {
+    std::string fragment(node.length, '\0');
+    in.clear();
+    in.seekg(node.offset);
+    if (!in.read(fragment.data(), fragment.size())) {
+        throw std::runtime_error("Failed reading file " + file_name);
+    }
+    return JsonLoader::value_from_string(fragment);
+}
+
+} // namespace k4json
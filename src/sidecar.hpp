@@ -0,0 +1,91 @@
+#pragma once
+
+#include "json.hpp"
+#include "stream.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <string_view>
+
+namespace k4json {
+
+// Layout of a sidecar index file: the header, the entries, the child
+// table and the keys
+struct SidecarHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t max_depth;
+    // Of the indexed json file, a sidecar which doesn't match them is
+    // rebuilt
+    uint64_t file_size;
+    int64_t mtime;
+    uint64_t nentries;
+    uint64_t nchildren;
+    uint64_t keys_size;
+};
+
+// A value of the json file
+struct SidecarEntry {
+    // Bytes of the value in the json file
+    uint64_t offset;
+    uint64_t length;
+    // The entries of its children are child_table[first_child,
+    // first_child + nchildren), object members sorted by key
+    uint64_t first_child;
+    // The (unescaped) key of an object member, in the keys
+    uint64_t key_offset;
+    uint32_t key_length;
+    uint32_t nchildren;
+    uint8_t type; // JsonType
+    // Whether its children have entries
+    uint8_t indexed;
+    uint8_t unused[6];
+};
+
+// Byte offsets of the values of a json file, down to max_depth levels
+// below the root (so with the default of 2, every element of an array
+// which is a member of the root object), built by one pass of a scanner
+// which only tracks strings and brackets. Queries made of name, index and
+// wildcard selectors follow the index as deep as it goes, then read and
+// load only the fragments of the file they end up in.
+// The index is kept next to the file (file_name + ".k4idx") and rebuilt
+// when the file's size or modification time changes.
+class SidecarIndex {
+public:
+    // Reads the sidecar if it is up to date, otherwise builds the index
+    // and writes it (an index which can't be written is still used)
+    static SidecarIndex open(const std::string& file_name,
+                             uint32_t max_depth = 2);
+    // Doesn't read or write the sidecar
+    static SidecarIndex build(const std::string& file_name,
+                              uint32_t max_depth = 2);
+
+    // The matches of path, in the order the expression engine gives them
+    JsonArray query(const SimplePath& path) const;
+    // Number of values indexed
+    size_t size() const;
+
+private:
+    SidecarIndex() = default;
+    bool read(const std::string& sidecar_name, uint64_t file_size,
+              int64_t mtime, uint32_t max_depth);
+    void write(const std::string& sidecar_name) const;
+
+    const SidecarHeader& header() const;
+    const SidecarEntry& entry(size_t idx) const;
+    const SidecarEntry& child(const SidecarEntry& parent, size_t idx) const;
+    std::string_view key(const SidecarEntry& member) const;
+    void select(const SidecarEntry& node, const SimplePath& path, size_t step,
+                std::ifstream& in, JsonArray& res) const;
+    Json load(const SidecarEntry& node, std::ifstream& in) const;
+
+    std::string file_name;
+    // The sidecar file's contents
+    std::string data;
+};
+
+std::string sidecar_name(const std::string& file_name);
+
+} // namespace k4json
@@ -0,0 +1,420 @@
+#include "stream.hpp"
+#include "loader.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+
+namespace k4json {
+
+// Same rules as JsonExpressionParser, except that everything outside of
+// the name, index and wildcard selectors is refused
+SimplePath::SimplePath(const std::string& query) {
+    buffer = query;
+    current = 0;
+    line = 1;
+
+    skip();
+    // The root identifier can be omitted, "a.b" is "$.a.b"
+    if (!match('$') && peek() != '[') {
+        parse_dot_name();
+    }
+
+    while (true) {
+        skip();
+        if (reached_end()) {
+            return;
+        }
+        if (peek() == '[') {
+            parse_bracketed();
+            continue;
+        }
+        if (!match('.')) {
+            syntax_err("only name, index and wildcard selectors can be "
+                       "streamed");
+        }
+        if (peek() == '.') {
+            syntax_err("the descendant segment needs the whole document");
+        }
+        if (match('*')) {
+            _steps.push_back({StepType::WILDCARD, "", 0});
+            continue;
+        }
+        parse_dot_name();
+    }
+}
+
+const std::vector<SimplePath::Step>& SimplePath::steps() const {
+    return _steps;
+}
+
+bool SimplePath::singular() const {
+    for (const Step& step : _steps) {
+        if (step.type == StepType::WILDCARD) {
+            return false;
+        }
+    }
+    return true;
+}
+
+[[noreturn]] void SimplePath::syntax_err(const std::string& msg) {
+    std::string res = "Stream Query Error: " + msg + '\n';
+    res += "position: " + std::to_string(current) + '\n';
+    res += buffer + '\n';
+    res += pretty_error_pointer(current);
+    throw StreamQueryErr(res);
+}
+
+void SimplePath::parse_dot_name() {
+    if (!valid_dot_name_first(peek())) {
+        SimplePath::syntax_err(
+            "only name, index and wildcard selectors can be streamed");
+    }
+    int start = current;
+    while (!reached_end() && valid_dot_name_char(peek())) {
+        next();
+    }
+    _steps.push_back(
+        {StepType::NAME, buffer.substr(start, current - start), 0});
+}
+
+// ['name'], ["name"], [*] or [index]
+void SimplePath::parse_bracketed() {
+    assert_match('[');
+    skip();
+
+    char c = peek();
+    if (c == '\'' || c == '"') {
+        next();
+        int start = current;
+        while (!reached_end() && peek() != c) {
+            next();
+        }
+        if (reached_end()) {
+            syntax_err("query ended early: unterminated name selector");
+        }
+        _steps.push_back(
+            {StepType::NAME, buffer.substr(start, current - start), 0});
+        next();
+    } else if (c == '*') {
+        next();
+        _steps.push_back({StepType::WILDCARD, "", 0});
+    } else if (c == '-') {
+        syntax_err("negative indices need the length of the array, which "
+                   "needs the whole array");
+    } else if ('0' <= c && c <= '9') {
+        size_t index = 0;
+        while (!reached_end() && '0' <= peek() && peek() <= '9') {
+            size_t digit = peek() - '0';
+            // Past any array there can be, so it stays out of range
+            // instead of wrapping around
+            index = index > (SIZE_MAX - digit) / 10 ? SIZE_MAX
+                                                      : index * 10 + digit;
+            next();
+        }
+        _steps.push_back({StepType::INDEX, "", index});
+    } else {
+        syntax_err("only name, index and wildcard selectors can be streamed");
+    }
+
+    skip();
+    if (!match(']')) {
+        syntax_err("only name, index and wildcard selectors can be streamed");
+    }
+}
+
+JsonStreamer::JsonStreamer(std::istream& in, const SimplePath& path)
+    : in(in), path(path), emit(nullptr), matches(0), limit(SIZE_MAX),
+      chunk(1 << 16), pos(0),
+      len(0), offset(0), capture(nullptr), capture_from(0) {}
+
+size_t JsonStreamer::run(const std::function<void(Json&&)>& emit,
+                         size_t limit) {
+    this->emit = &emit;
+    this->limit = path.singular() ? std::min<size_t>(limit, 1) : limit;
+    matches = 0;
+
+    // Same as the loader, the document must be an object or an array
+    skip_whitespace();
+    if (peek() != '{' && peek() != '[') {
+        error("json must be object or array");
+    }
+    walk(0);
+    if (done()) {
+        // The rest of the input isn't even read
+        return matches;
+    }
+    skip_whitespace();
+    if (peek() != EOF) {
+        error("unexpected data after the end of the document");
+    }
+    return matches;
+}
+
+// Refills the chunk once it has been consumed, false at the end of input
+bool JsonStreamer::fill() {
+    if (pos < len) {
+        return true;
+    }
+    if (capture != nullptr) {
+        capture->append(chunk.data() + capture_from, len - capture_from);
+        capture_from = 0;
+    }
+    offset += len;
+    pos = 0;
+    in.read(chunk.data(), chunk.size());
+    len = in.gcount();
+    return len > 0;
+}
+
+int JsonStreamer::peek() {
+    if (!fill()) {
+        return EOF;
+    }
+    return static_cast<unsigned char>(chunk[pos]);
+}
+
+void JsonStreamer::advance() {
+    pos++;
+}
+
+void JsonStreamer::skip_whitespace() {
+    while (peek() != EOF && is_whitespace(chunk[pos])) {
+        advance();
+    }
+}
+
+void JsonStreamer::expect(char c) {
+    skip_whitespace();
+    if (peek() != c) {
+        error(std::string("expected ") + c);
+    }
+    advance();
+}
+
+[[noreturn]] void JsonStreamer::error(const std::string& msg) {
+    throw JsonLoadErr("Load Error: " + msg + '\n' +
+                      "position: " + std::to_string(offset + pos) + '\n');
+}
+
+bool JsonStreamer::done() const {
+    return matches >= limit;
+}
+
+// Positioned at a value which has matched the first step selectors
+void JsonStreamer::walk(size_t step) {
+    skip_whitespace();
+    if (step == path.steps().size()) {
+        (*emit)(load_match());
+        matches++;
+        return;
+    }
+
+    SimplePath::StepType type = path.steps()[step].type;
+    if (peek() == '{' && type != SimplePath::StepType::INDEX) {
+        walk_object(step);
+    } else if (peek() == '[' && type != SimplePath::StepType::NAME) {
+        walk_array(step);
+    } else {
+        // Selects nothing
+        skip_value();
+    }
+}
+
+void JsonStreamer::walk_object(size_t step) {
+    const SimplePath::Step& selector = path.steps()[step];
+    advance();
+    skip_whitespace();
+    if (peek() == '}') {
+        advance();
+        return;
+    }
+
+    while (true) {
+        skip_whitespace();
+        if (peek() != '"') {
+            error("unexpected symbol, wanted key-value pair");
+        }
+        bool selected = true;
+        if (selector.type == SimplePath::StepType::WILDCARD) {
+            skip_string();
+        } else {
+            selected = read_key() == selector.name;
+        }
+        expect(':');
+        if (selected) {
+            walk(step + 1);
+            if (done()) {
+                return;
+            }
+        } else {
+            skip_value();
+        }
+
+        skip_whitespace();
+        if (peek() == '}') {
+            advance();
+            return;
+        }
+        if (peek() != ',') {
+            error("unexpected symbol, wanted , or }");
+        }
+        advance();
+    }
+}
+
+void JsonStreamer::walk_array(size_t step) {
+    const SimplePath::Step& selector = path.steps()[step];
+    advance();
+    skip_whitespace();
+    if (peek() == ']') {
+        advance();
+        return;
+    }
+
+    for (size_t idx = 0;; ++idx) {
+        if (selector.type == SimplePath::StepType::WILDCARD ||
+            idx == selector.index) {
+            walk(step + 1);
+            if (done()) {
+                return;
+            }
+        } else {
+            skip_value();
+        }
+
+        skip_whitespace();
+        if (peek() == ']') {
+            advance();
+            return;
+        }
+        if (peek() != ',') {
+            error("unexpected symbol, wanted , or ]");
+        }
+        advance();
+    }
+}
+
+// Reads an object key, escapes are decoded by the loader
+std::string JsonStreamer::read_key() {
+    std::string key;
+    capture = &key;
+    capture_from = pos;
+    skip_string();
+    key.append(chunk.data() + capture_from, pos - capture_from);
+    capture = nullptr;
+
+    if (key.find('\\') == std::string::npos) {
+        return key.substr(1, key.size() - 2);
+    }
+    return JsonLoader::from_string('[' + key + ']')[0].get_string();
+}
+
+// Copies the text of the value and loads it, wrapped in an array so the
+// loader checks that the value is complete
+Json JsonStreamer::load_match() {
+    std::string text = "[";
+    capture = &text;
+    capture_from = pos;
+    skip_value();
+    text.append(chunk.data() + capture_from, pos - capture_from);
+    capture = nullptr;
+    text += ']';
+
+    Json wrapped = JsonLoader::from_string(text);
+    return wrapped.get_array_ref()[0];
+}
+
+void JsonStreamer::skip_value() {
+    skip_whitespace();
+    switch (peek()) {
+    case '{':
+    case '[':
+        skip_container();
+        return;
+    case '"':
+        skip_string();
+        return;
+    case EOF:
+        error("unexpected end of input, wanted a value");
+    default:
+        // Numbers and literals end at the next delimiter
+        while (peek() != EOF) {
+            char c = chunk[pos];
+            if (c == ',' || c == '}' || c == ']' || is_whitespace(c)) {
+                return;
+            }
+            advance();
+        }
+    }
+}
+
+// Skips a whole object or array by only tracking strings and nesting depth
+void JsonStreamer::skip_container() {
+    int depth = 0;
+    bool in_string = false;
+    bool escaped = false;
+    while (fill()) {
+        const char* data = chunk.data();
+        for (size_t i = pos; i < len; ++i) {
+            char c = data[i];
+            if (in_string) {
+                if (escaped) {
+                    escaped = false;
+                } else if (c == '\\') {
+                    escaped = true;
+                } else if (c == '"') {
+                    in_string = false;
+                }
+                continue;
+            }
+            switch (c) {
+            case '"':
+                in_string = true;
+                break;
+            case '{':
+            case '[':
+                depth++;
+                break;
+            case '}':
+            case ']':
+                if (--depth == 0) {
+                    pos = i + 1;
+                    return;
+                }
+                break;
+            }
+        }
+        pos = len;
+    }
+    error("unexpected end of input inside an object or array");
+}
+
+void JsonStreamer::skip_string() {
+    advance();
+    bool escaped = false;
+    while (fill()) {
+        const char* data = chunk.data();
+        for (size_t i = pos; i < len; ++i) {
+            if (escaped) {
+                escaped = false;
+            } else if (data[i] == '\\') {
+                escaped = true;
+            } else if (data[i] == '"') {
+                pos = i + 1;
+                return;
+            }
+        }
+        pos = len;
+    }
+    error("unterminated string");
+}
+
+size_t stream_query(std::istream& in, const std::string& query,
+                    const std::function<void(Json&&)>& emit,
+                    size_t limit) {
+    SimplePath path(query);
+    JsonStreamer streamer(in, path);
+    return streamer.run(emit, limit);
+}
+
+} // namespace k4json
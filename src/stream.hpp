@@ -0,0 +1,104 @@
+#pragma once
+
+#include "generic_parser.hpp"
+#include "json.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace k4json {
+
+// The query can't be answered without loading the whole document
+class StreamQueryErr : public std::runtime_error {
+public:
+    explicit StreamQueryErr(const std::string& msg)
+        : std::runtime_error(msg) {}
+};
+
+// A query made only of name, index and wildcard selectors, e.g.
+// "$.store[*].name" or "mm['key'][0]". Each selector applies to exactly one
+// depth of the document, which is what makes it streamable.
+class SimplePath : private Parser {
+public:
+    enum class StepType { NAME, INDEX, WILDCARD };
+
+    struct Step {
+        StepType type;
+        std::string name;
+        size_t index;
+    };
+
+    // Throws StreamQueryErr for anything outside of the subset
+    explicit SimplePath(const std::string& query);
+
+    const std::vector<Step>& steps() const;
+    // Without wildcards there is at most one match
+    bool singular() const;
+
+private:
+    [[noreturn]] void syntax_err(const std::string& msg) override;
+    void parse_dot_name();
+    void parse_bracketed();
+
+    std::vector<Step> _steps;
+};
+
+// Runs a SimplePath over JSON text as it is read, without building the
+// document. Subtrees the path doesn't go into are fast-forwarded by a
+// bracket and quote aware scanner (and are not validated), only the
+// matched values are loaded. Memory is O(depth) plus the largest match.
+class JsonStreamer {
+public:
+    JsonStreamer(std::istream& in, const SimplePath& path);
+
+    // Calls emit with every match as soon as it is complete, in document
+    // order. Returns the number of matches.
+    // Reading stops as soon as limit matches were found, or after the
+    // first one if the path is singular.
+    size_t run(const std::function<void(Json&&)>& emit,
+               size_t limit = SIZE_MAX);
+
+private:
+    int peek();
+    void advance();
+    bool fill();
+    void skip_whitespace();
+    void expect(char c);
+    [[noreturn]] void error(const std::string& msg);
+
+    bool done() const;
+    void walk(size_t step);
+    void walk_object(size_t step);
+    void walk_array(size_t step);
+    std::string read_key();
+    void skip_value();
+    void skip_container();
+    void skip_string();
+    Json load_match();
+
+    std::istream& in;
+    const SimplePath& path;
+    const std::function<void(Json&&)>* emit;
+    size_t matches;
+    size_t limit;
+
+    std::vector<char> chunk;
+    size_t pos;
+    size_t len;
+    // Bytes of the input before the current chunk
+    size_t offset;
+    // While loading a match, the consumed bytes are copied here
+    std::string* capture;
+    size_t capture_from;
+};
+
+// Convenience wrapper: streams query over in
+size_t stream_query(std::istream& in, const std::string& query,
+                    const std::function<void(Json&&)>& emit,
+                    size_t limit = SIZE_MAX);
+
+} // namespace k4json
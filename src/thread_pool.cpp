@@ -0,0 +1,191 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+
+namespace k4json {
+
+namespace {
+std::atomic<size_t> threshold = 1 << 16;
+} // namespace
+
+void set_parallel_threshold(size_t nodes) {
+    threshold = nodes;
+}
+
+size_t parallel_threshold() {
+    return threshold;
+}
+
+namespace {
+// K4JSON_THREADS overrides the number of hardware threads
+size_t thread_count() {
+    if (const char* env = std::getenv("K4JSON_THREADS")) {
+        long n = std::strtol(env, nullptr, 10);
+        if (n > 0) {
+            return n;
+        }
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+} // namespace
+
+ThreadPool& ThreadPool::instance() {
+    // The calling thread takes part as well
+    static ThreadPool pool(thread_count() - 1);
+    return pool;
+}
+
+ThreadPool::ThreadPool(size_t nworkers)
+    : next_queue(0), queued(0), stopping(false) {
+    for (size_t i = 0; i < nworkers; ++i) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i < nworkers; ++i) {
+        workers.emplace_back(&ThreadPool::worker_loop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lk(sleep_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::size() const {
+    return workers.size() + 1;
+}
+
+// Own queue first (newest task, most likely still in cache), then steal
+// the oldest task of another queue. Threads outside the pool have no
+// queue and only steal.
+bool ThreadPool::take(size_t self, Task& task) {
+    size_t n = queues.size();
+    if (self < n) {
+        Queue& own = *queues[self];
+        std::lock_guard<std::mutex> lk(own.lock);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queued -= 1;
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i <= n; ++i) {
+        Queue& victim = *queues[(self + i) % n];
+        std::lock_guard<std::mutex> lk(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued -= 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::worker_loop(size_t self) {
+    while (true) {
+        Task task;
+        if (take(self, task)) {
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lk(sleep_lock);
+        wake.wait(lk, [this] {
+            return stopping || queued > 0;
+        });
+        if (stopping) {
+            return;
+        }
+    }
+}
+
+void ThreadPool::parallel_for(size_t nchunks,
+                              const std::function<void(size_t)>& body) {
+    if (queues.empty() || nchunks <= 1) {
+        // Nobody to share the work with
+        for (size_t i = 0; i < nchunks; ++i) {
+            body(i);
+        }
+        return;
+    }
+
+    // State shared by the chunks of this call
+    struct Batch {
+        std::atomic<size_t> remaining;
+        std::mutex lock;
+        std::condition_variable done;
+        std::vector<std::exception_ptr> errors;
+    };
+    Batch batch;
+    batch.remaining = nchunks;
+    batch.errors.resize(nchunks);
+
+    {
+        // Counted before the tasks show up, so the counter never drops
+        // below zero. Under the lock, so a worker can't miss the wakeup
+        // between checking the queues and going to sleep.
+        std::lock_guard<std::mutex> lk(sleep_lock);
+        queued += nchunks;
+    }
+    for (size_t i = 0; i < nchunks; ++i) {
+        Task task = [&batch, &body, i] {
+            try {
+                body(i);
+            } catch (...) {
+                batch.errors[i] = std::current_exception();
+            }
+            // Under the lock, so the batch can't go away before the
+            // last chunk is done touching it
+            std::lock_guard<std::mutex> lk(batch.lock);
+            if (--batch.remaining == 0) {
+                batch.done.notify_all();
+            }
+        };
+        Queue& q = *queues[next_queue++ % queues.size()];
+        std::lock_guard<std::mutex> lk(q.lock);
+        q.tasks.push_back(std::move(task));
+    }
+    wake.notify_all();
+
+    // Help out instead of just waiting
+    while (batch.remaining > 0) {
+        Task task;
+        if (take(queues.size(), task)) {
+            task();
+            continue;
+        }
+        std::unique_lock<std::mutex> lk(batch.lock);
+        batch.done.wait(lk, [&batch] {
+            return batch.remaining == 0;
+        });
+    }
+
+    // Wait for the last chunk to let go of the lock
+    std::lock_guard<std::mutex> lk(batch.lock);
+    for (std::exception_ptr& err : batch.errors) {
+        if (err) {
+            std::rethrow_exception(err);
+        }
+    }
+}
+
+size_t parallel_ranges(size_t n, size_t nchunks,
+                       const std::function<void(size_t, size_t, size_t)>& body) {
+    nchunks = std::max<size_t>(1, std::min(nchunks, n));
+    ThreadPool::instance().parallel_for(nchunks, [&](size_t chunk) {
+        body(chunk, chunk * n / nchunks, (chunk + 1) * n / nchunks);
+    });
+    return nchunks;
+}
+
+} // namespace k4json
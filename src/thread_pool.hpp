@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace k4json {
+
+// Process-wide pool of worker threads. Every worker owns a queue of tasks,
+// takes work from its back and, once it runs dry, steals from the front
+// of the other queues.
+class ThreadPool {
+public:
+    static ThreadPool& instance();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Runs body(0), ..., body(nchunks - 1) on the pool and returns once all
+    // of them are done. The calling thread helps while it waits, so it is
+    // fine to call this from inside a task.
+    // If chunks throw, the exception of the lowest chunk is rethrown.
+    void parallel_for(size_t nchunks, const std::function<void(size_t)>& body);
+
+    // Number of threads working on a parallel_for, including the caller
+    size_t size() const;
+
+private:
+    typedef std::function<void()> Task;
+
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    explicit ThreadPool(size_t nworkers);
+    ~ThreadPool();
+
+    bool take(size_t self, Task& task);
+    void worker_loop(size_t self);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    // Distributes submitted tasks over the queues
+    std::atomic<size_t> next_queue;
+
+    // Idle workers sleep until something gets queued
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    std::atomic<size_t> queued;
+    bool stopping;
+};
+
+// Nodelists smaller than this are evaluated on the calling thread only
+void set_parallel_threshold(size_t nodes);
+size_t parallel_threshold();
+
+// Splits [0, n) into contiguous chunks, runs body(begin, end) for each of
+// them on the pool and returns the number of chunks. Chunk i always covers
+// the range before chunk i + 1, so results can be merged in order.
+size_t parallel_ranges(size_t n, size_t nchunks,
+                       const std::function<void(size_t, size_t, size_t)>& body);
+
+} // namespace k4json
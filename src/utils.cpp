@@ -1,48 +1,174 @@
 #include "utils.hpp"
 
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <string>
 
 namespace k4json {
 
-bool is_whitespace(char c) {
-    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
-}
-
 std::string escape_string(const std::string& str) {
     std::string res = "";
-    for (char c : str) {
-        switch (c) {
-        case '"':
-            res += "\\\"";
-            break;
-        case '\\':
-            res += "\\\\";
-            break;
-        case '/':
-            res += "\\/";
-            break;
-        case '\b':
-            res += "\\b";
-            break;
-        case '\f':
-            res += "\\f";
-            break;
-        case '\n':
-            res += "\\n";
-            break;
-        case '\r':
-            res += "\\r";
-            break;
-        case '\t':
-            res += "\\t";
-            break;
-        // we don't need to make UTF16 surrogate pairs since
-        // we encoded them to UTF8
-        default:
+    escape_string(str, res);
+    return res;
+}
+
+// \uXXXX, lowercase hex like the rest of the escapes we produce
+void append_unicode_escape(uint32_t code_unit, std::string& res) {
+    const char* hex = "0123456789abcdef";
+    res += "\\u";
+    for (int shift = 12; shift >= 0; shift -= 4) {
+        res += hex[(code_unit >> shift) & 0xF];
+    }
+}
+
+// SWAR (SIMD within a register) tests on 8 bytes at once, exact for
+// telling whether some byte matches
+constexpr uint64_t ones = 0x0101010101010101ULL;
+constexpr uint64_t highs = 0x8080808080808080ULL;
+
+constexpr uint64_t has_zero_byte(uint64_t word) {
+    return (word - ones) & ~word & highs;
+}
+
+// Whether any byte of word is '"', '\\' or a control character
+constexpr bool needs_escape(uint64_t word) {
+    return has_zero_byte(word ^ (ones * '"')) ||
+           has_zero_byte(word ^ (ones * '\\')) ||
+           ((word - ones * 0x20) & ~word & highs);
+}
+
+void escape_char(char c, std::string& res) {
+    switch (c) {
+    case '"':
+        res += "\\\"";
+        break;
+    case '\\':
+        res += "\\\\";
+        break;
+    case '\b':
+        res += "\\b";
+        break;
+    case '\f':
+        res += "\\f";
+        break;
+    case '\n':
+        res += "\\n";
+        break;
+    case '\r':
+        res += "\\r";
+        break;
+    case '\t':
+        res += "\\t";
+        break;
+    // we don't need to make UTF16 surrogate pairs since
+    // we encoded them to UTF8
+    default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+            append_unicode_escape(static_cast<unsigned char>(c), res);
+        } else {
             res += c;
         }
     }
-    return res;
+}
+
+void escape_string(std::string_view str, std::string& res) {
+    // Runs of bytes which don't need escaping are found 8 bytes at a time
+    // and copied in bulk
+    const char* data = str.data();
+    size_t n = str.size();
+    size_t clean = 0;
+    size_t i = 0;
+    while (i < n) {
+        if (i + 8 <= n) {
+            uint64_t word;
+            std::memcpy(&word, data + i, 8);
+            if (!needs_escape(word)) {
+                i += 8;
+                continue;
+            }
+        }
+        unsigned char c = data[i];
+        if (c == '"' || c == '\\' || c < 0x20) {
+            res.append(data + clean, i - clean);
+            escape_char(c, res);
+            clean = i + 1;
+        }
+        ++i;
+    }
+    res.append(data + clean, n - clean);
+}
+
+void escape_string_ascii(std::string_view str, std::string& res) {
+    size_t i = 0;
+    while (i < str.size()) {
+        // The ASCII run up to the next multi-byte sequence
+        size_t run = i;
+        while (run < str.size() &&
+               static_cast<unsigned char>(str[run]) < 0x80) {
+            ++run;
+        }
+        escape_string(str.substr(i, run - i), res);
+        i = run;
+        if (i == str.size()) {
+            break;
+        }
+
+        unsigned char c = str[i];
+        size_t len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        uint32_t code_point = c & (0x7F >> len);
+        bool valid = len != 1 && i + len <= str.size();
+        for (size_t k = 1; valid && k < len; ++k) {
+            unsigned char cont = str[i + k];
+            valid = (cont & 0xC0) == 0x80;
+            code_point = (code_point << 6) | (cont & 0x3F);
+        }
+        // Strings are loaded as valid UTF-8, but can be built by hand
+        if (!valid) {
+            code_point = 0xFFFD;
+            len = 1;
+        }
+
+        if (code_point > 0xFFFF) {
+            code_point -= 0x10000;
+            append_unicode_escape(0xD800 + (code_point >> 10), res);
+            append_unicode_escape(0xDC00 + (code_point & 0x3FF), res);
+        } else {
+            append_unicode_escape(code_point, res);
+        }
+        i += len;
+    }
+}
+
+void append_number(double number, std::string& res) {
+    char digits[32];
+    // Integers are printed as such, unless scientific notation is shorter
+    // (1e+20), which is what the general case would pick. -0 keeps its
+    // sign through the general case.
+    if (number == std::trunc(number) && std::fabs(number) < 0x1p53 &&
+        !(number == 0 && std::signbit(number))) {
+        char* end = std::to_chars(digits, digits + sizeof(digits),
+                                  static_cast<long long>(number))
+                        .ptr;
+        const char* start = digits + (digits[0] == '-');
+        size_t len = end - start;
+        size_t zeros = 0;
+        while (zeros + 1 < len && start[len - 1 - zeros] == '0') {
+            ++zeros;
+        }
+        // d[.ddd]e+XX
+        size_t mantissa = len - zeros;
+        size_t scientific =
+            (mantissa > 1 ? mantissa + 1 : 1) + (len - 1 >= 100 ? 5 : 4);
+        if (len <= scientific) {
+            res.append(digits, end);
+            return;
+        }
+    }
+    // Shortest representation which reads back as the same double
+    char* end = std::to_chars(digits, digits + sizeof(digits), number).ptr;
+    res.append(digits, end);
 }
 
 std::string pretty_error_pointer(int padding) {
@@ -58,4 +184,25 @@ std::string pretty_error_pointer(int padding) {
     return res;
 }
 
+uint64_t hash_words(uint64_t hash, const char* data, size_t size) {
+    constexpr uint64_t prime = 0x100000001b3;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * prime;
+    }
+    return hash;
+}
+
+uint64_t finish_hash(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccd;
+    hash ^= hash >> 33;
+    return hash;
+}
+
 } // namespace k4json
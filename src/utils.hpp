@@ -1,11 +1,61 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <string_view>
 
 namespace k4json {
 
-bool is_whitespace(char c);
+// The grammar helpers are constexpr so compile-time queries (query.hpp)
+// share them with the parsers
+
+constexpr bool is_whitespace(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+// https://www.rfc-editor.org/rfc/rfc9535#section-2.5.1.1
+constexpr bool valid_dot_name_first(unsigned char c) {
+    // name-first          = ALPHA /
+    //                       "_"   /
+    //                       %x80-D7FF /
+    //                          ; skip surrogate code points
+    //                       %xE000-10FFFF
+    // ALPHA               = %x41-5A / %x61-7A    ; A-Z / a-z
+
+    // Since we are assuming our input is in UTF-8 we don't
+    // need to check for surrogates.
+    // We allow all UTF-8 bytes with the (c > 127) check.
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_' ||
+           c > 127;
+}
+
+constexpr bool valid_dot_name_char(unsigned char c) {
+    // name-char           = name-first / DIGIT
+    // DIGIT               = %x30-39              ; 0-9
+
+    return valid_dot_name_first(c) || ('0' <= c && c <= '9');
+}
+
+// The contents of a json string literal with the value str
 std::string escape_string(const std::string& str);
+// Appends the escaped str to res
+void escape_string(std::string_view str, std::string& res);
+// Like escape_string, but characters outside of ASCII become \uXXXX
+// escapes (surrogate pairs above U+FFFF)
+void escape_string_ascii(std::string_view str, std::string& res);
+// Appends \uXXXX for a UTF-16 code unit
+void append_unicode_escape(uint32_t code_unit, std::string& res);
+// Appends the shortest text which reads back as number
+void append_number(double number, std::string& res);
 std::string pretty_error_pointer(int padding);
 
+// 64 bit FNV-1a over 8 byte words instead of bytes, for cache keys and
+// checksums (it isn't cryptographic). Start from hash_seed, chain the
+// calls through hash and mix the result with finish_hash().
+constexpr uint64_t hash_seed = 0xcbf29ce484222325;
+uint64_t hash_words(uint64_t hash, const char* data, size_t size);
+// Makes the high bits depend on every word
+uint64_t finish_hash(uint64_t hash);
+
 } // namespace k4json
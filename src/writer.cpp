@@ -0,0 +1,344 @@
+#include "writer.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+
+#include <utility>
+#include <vector>
+
+namespace k4json {
+
+// Output is handed to the sink in blocks of about this size
+constexpr size_t flush_size = 1 << 16;
+// Children of containers written in parallel are split into chunks of
+// about this many nodes
+constexpr size_t chunk_nodes = 1 << 14;
+
+JsonWriter::JsonWriter(const FormatOptions& options) : options(options) {}
+
+JsonWriter::JsonWriter(std::ostream& sink, const FormatOptions& options)
+    : options(options), sink(&sink) {
+    buffer.reserve(flush_size + flush_size / 4);
+}
+
+JsonWriter::~JsonWriter() {
+    flush();
+}
+
+void JsonWriter::write(const Json& json) {
+    if (options.minified) {
+        write_minified(json);
+    } else {
+        write_pretty(json, 0);
+    }
+    maybe_flush();
+}
+
+void JsonWriter::write_array(const JsonArray& elements) {
+    if (elements.empty()) {
+        buffer += options.minified ? "[]" : "[ ]";
+        return;
+    }
+    buffer += '[';
+    size_t nodes = 0;
+    for (const Json& element : elements) {
+        nodes += element.nchildren();
+    }
+    if (parallel && elements.size() > 1 && nodes >= parallel_threshold()) {
+        write_chunked(
+            elements.size(),
+            [&](size_t i) {
+                return elements[i].nchildren();
+            },
+            [&](JsonWriter& writer, size_t i) {
+                writer.write_member(nullptr, elements[i], i == 0, 0);
+            });
+    } else {
+        for (size_t i = 0; i < elements.size(); ++i) {
+            write_member(nullptr, elements[i], i == 0, 0);
+            maybe_flush();
+        }
+    }
+    close(']', 0);
+}
+
+void JsonWriter::write_raw(std::string_view text) {
+    if (sink != nullptr && text.size() >= flush_size) {
+        // Not worth copying into the buffer first
+        flush();
+        sink->write(text.data(), text.size());
+        return;
+    }
+    buffer += text;
+    maybe_flush();
+}
+
+void JsonWriter::flush() {
+    if (sink != nullptr && !buffer.empty()) {
+        sink->write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+}
+
+std::string JsonWriter::take() {
+    std::string res = std::move(buffer);
+    buffer.clear();
+    return res;
+}
+
+// depth: the nesting level of json, its children are one deeper
+void JsonWriter::write_pretty(const Json& json, int depth) {
+    if (write_parallel(json, depth)) {
+        return;
+    }
+    switch (json.get_type()) {
+    case JsonType::OBJECT: {
+        const JsonObject& obj = json.get_obj_ref();
+        if (obj.empty()) {
+            buffer += "{ }";
+            return;
+        }
+        buffer += '{';
+        bool first = true;
+        for (auto& [key, value] : obj) {
+            if (!first) {
+                buffer += ',';
+            }
+            first = false;
+            newline(depth + 1);
+            write_string(key);
+            buffer += ": ";
+            write_pretty(value, depth + 1);
+            maybe_flush();
+        }
+        newline(depth);
+        buffer += '}';
+        return;
+    }
+    case JsonType::ARRAY: {
+        const JsonArray& arr = json.get_array_ref();
+        if (arr.empty()) {
+            buffer += "[ ]";
+            return;
+        }
+        buffer += '[';
+        for (size_t i = 0; i < arr.size(); ++i) {
+            if (i != 0) {
+                buffer += ',';
+            }
+            newline(depth + 1);
+            write_pretty(arr[i], depth + 1);
+            maybe_flush();
+        }
+        newline(depth);
+        buffer += ']';
+        return;
+    }
+    default:
+        write_scalar(json);
+    }
+}
+
+// No whitespace to lay out, so nothing but the separators between values
+void JsonWriter::write_minified(const Json& json) {
+    if (write_parallel(json, 0)) {
+        return;
+    }
+    switch (json.get_type()) {
+    case JsonType::OBJECT: {
+        buffer += '{';
+        bool first = true;
+        for (auto& [key, value] : json.get_obj_ref()) {
+            if (!first) {
+                buffer += ',';
+            }
+            first = false;
+            write_string(key);
+            buffer += ':';
+            write_minified(value);
+            maybe_flush();
+        }
+        buffer += '}';
+        return;
+    }
+    case JsonType::ARRAY: {
+        buffer += '[';
+        bool first = true;
+        for (const Json& child : json.get_array_ref()) {
+            if (!first) {
+                buffer += ',';
+            }
+            first = false;
+            write_minified(child);
+            maybe_flush();
+        }
+        buffer += ']';
+        return;
+    }
+    default:
+        write_scalar(json);
+    }
+}
+
+// Containers with enough children and at least parallel_threshold() nodes
+// are written by chunks of children, returns whether json was
+bool JsonWriter::write_parallel(const Json& json, int depth) {
+    if (!parallel || json.size() < 2 ||
+        static_cast<size_t>(json.nchildren()) < parallel_threshold()) {
+        return false;
+    }
+
+    if (json.get_type() == JsonType::ARRAY) {
+        const JsonArray& arr = json.get_array_ref();
+        buffer += '[';
+        write_chunked(
+            arr.size(),
+            [&](size_t i) {
+                return arr[i].nchildren();
+            },
+            [&](JsonWriter& writer, size_t i) {
+                writer.write_member(nullptr, arr[i], i == 0, depth);
+            });
+        close(']', depth);
+        return true;
+    }
+
+    // Members can't be indexed, so they are gathered first
+    std::vector<const JsonObject::value_type*> members;
+    members.reserve(json.size());
+    for (auto& member : json.get_obj_ref()) {
+        members.push_back(&member);
+    }
+    buffer += '{';
+    write_chunked(
+        members.size(),
+        [&](size_t i) {
+            return members[i]->second.nchildren();
+        },
+        [&](JsonWriter& writer, size_t i) {
+            writer.write_member(&members[i]->first, members[i]->second, i == 0,
+                                depth);
+        });
+    close('}', depth);
+    return true;
+}
+
+// Writes items [0, n) of a container, item(writer, i) writes item i into
+// writer. Chunks of items go to writers of their own on the pool, a batch
+// of chunks at a time so that only a part of the output is held in memory,
+// and are then appended in order.
+template <typename Weight, typename Item>
+void JsonWriter::write_chunked(size_t n, Weight weight, Item item) {
+    ThreadPool& pool = ThreadPool::instance();
+    size_t batch = 4 * pool.size();
+    // The buffers are reused by the next batches
+    std::vector<std::string> chunks(batch);
+    std::vector<size_t> bounds;
+
+    size_t i = 0;
+    while (i < n) {
+        bounds.assign(1, i);
+        while (i < n && bounds.size() <= batch) {
+            size_t nodes = 0;
+            while (i < n && nodes < chunk_nodes) {
+                nodes += weight(i++);
+            }
+            bounds.push_back(i);
+        }
+
+        size_t nchunks = bounds.size() - 1;
+        pool.parallel_for(nchunks, [&](size_t chunk) {
+            JsonWriter writer(options);
+            writer.parallel = false;
+            writer.buffer = std::move(chunks[chunk]);
+            writer.buffer.clear();
+            for (size_t k = bounds[chunk]; k < bounds[chunk + 1]; ++k) {
+                item(writer, k);
+            }
+            chunks[chunk] = std::move(writer.buffer);
+        });
+
+        for (size_t chunk = 0; chunk < nchunks; ++chunk) {
+            if (sink != nullptr) {
+                flush();
+                sink->write(chunks[chunk].data(), chunks[chunk].size());
+            } else {
+                buffer += chunks[chunk];
+            }
+        }
+    }
+}
+
+// One element (key == nullptr) or member of a container at depth
+void JsonWriter::write_member(const std::string* key, const Json& value,
+                              bool first, int depth) {
+    if (!first) {
+        buffer += ',';
+    }
+    if (options.minified) {
+        if (key != nullptr) {
+            write_string(*key);
+            buffer += ':';
+        }
+        write_minified(value);
+        return;
+    }
+    newline(depth + 1);
+    if (key != nullptr) {
+        write_string(*key);
+        buffer += ": ";
+    }
+    write_pretty(value, depth + 1);
+}
+
+// The end of a non-empty container at depth
+void JsonWriter::close(char bracket, int depth) {
+    if (!options.minified) {
+        newline(depth);
+    }
+    buffer += bracket;
+}
+
+void JsonWriter::write_scalar(const Json& json) {
+    switch (json.get_type()) {
+    case JsonType::STRING:
+        write_string(json.get_string_ref());
+        return;
+    case JsonType::NUMBER:
+        append_number(json.get_number(), buffer);
+        return;
+    case JsonType::BOOL:
+        buffer += json.get_bool() ? "true" : "false";
+        return;
+    case JsonType::NULLVAL:
+        buffer += "null";
+        return;
+    case JsonType::OBJECT:
+    case JsonType::ARRAY:
+    case JsonType::INVALID:
+    default:
+        throw JsonTypeErr("Serialization failed, impossible json type.");
+    }
+}
+
+void JsonWriter::write_string(std::string_view str) {
+    buffer += '"';
+    if (options.ascii_only) {
+        escape_string_ascii(str, buffer);
+    } else {
+        escape_string(str, buffer);
+    }
+    buffer += '"';
+}
+
+void JsonWriter::newline(int depth) {
+    buffer += '\n';
+    buffer.append(static_cast<size_t>(depth) * options.indent, ' ');
+}
+
+void JsonWriter::maybe_flush() {
+    if (buffer.size() >= flush_size) {
+        flush();
+    }
+}
+
+} // namespace k4json
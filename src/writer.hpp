@@ -0,0 +1,59 @@
+#pragma once
+
+#include "json.hpp"
+
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace k4json {
+
+// Serializes Jsons in a single pass over their nodes, appending to a
+// buffer which is reused across writes. With a sink, the buffer is
+// flushed to it whenever it fills up, so the output is never held in
+// memory as a whole.
+// The children of big containers are serialized by chunks on the thread
+// pool, the output is the same as a sequential one.
+class JsonWriter {
+public:
+    // Keeps the output, see take()
+    explicit JsonWriter(const FormatOptions& options = FormatOptions());
+    explicit JsonWriter(std::ostream& sink,
+                        const FormatOptions& options = FormatOptions());
+    JsonWriter(const JsonWriter&) = delete;
+    JsonWriter& operator=(const JsonWriter&) = delete;
+    // Flushes to the sink
+    ~JsonWriter();
+
+    void write(const Json& json);
+    // Writes the elements as a json array, without copying them into one
+    void write_array(const JsonArray& elements);
+    // Big texts go straight to the sink
+    void write_raw(std::string_view text);
+    void flush();
+
+    // The output so far, for writers without a sink
+    std::string take();
+
+private:
+    void write_pretty(const Json& json, int depth);
+    void write_minified(const Json& json);
+    bool write_parallel(const Json& json, int depth);
+    template <typename Weight, typename Item>
+    void write_chunked(size_t n, Weight weight, Item item);
+    void write_member(const std::string* key, const Json& value, bool first,
+                      int depth);
+    void close(char bracket, int depth);
+    void write_scalar(const Json& json);
+    void write_string(std::string_view str);
+    void newline(int depth);
+    void maybe_flush();
+
+    FormatOptions options;
+    std::string buffer;
+    std::ostream* sink = nullptr;
+    // Off for the writers of chunks, which are already on the pool
+    bool parallel = true;
+};
+
+} // namespace k4json
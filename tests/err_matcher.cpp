@@ -43,6 +43,17 @@ bool JsonErrorMatcher::match(const k4json::ExprValueErr& err) const {
     return gotten.find(expected) == 0;
 }
 
+bool JsonErrorMatcher::match(const k4json::StreamQueryErr& err) const {
+    std::string expected = std::format("Stream Query Error: {}\nposition: {}",
+                                       err_msg, position);
+    std::string gotten = err.what();
+    return gotten.find(expected) == 0;
+}
+
+bool JsonErrorMatcher::match(const k4json::ExprBudgetErr& err) const {
+    return std::string(err.what()) == "Json Expression Budget Error: " + err_msg;
+}
+
 bool JsonErrorMatcher::match(const k4json::JsonTypeErr& err) const {
     return std::string(err.what()).find(err_msg) == 0;
 }
@@ -3,6 +3,7 @@
 #include "catch_amalgamated.hpp"
 #include "expressions.hpp"
 #include "loader.hpp"
+#include "stream.hpp"
 
 class JsonErrorMatcher : Catch::Matchers::MatcherGenericBase {
 public:
@@ -13,6 +14,8 @@ public:
     bool match(const k4json::JsonTypeErr& err) const;
     bool match(const k4json::ExprSyntaxErr& err) const;
     bool match(const k4json::ExprValueErr& err) const;
+    bool match(const k4json::StreamQueryErr& err) const;
+    bool match(const k4json::ExprBudgetErr& err) const;
     std::string describe() const override;
     // docs don't say this is needed but doesn't work without it?
     std::string toString() const;
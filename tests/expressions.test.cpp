@@ -1,9 +1,13 @@
 #include "expressions.hpp"
 #include "err_matcher.hpp"
 #include "json.hpp"
+#include "paths.hpp"
+#include "thread_pool.hpp"
 
 #include "catch_amalgamated.hpp"
 
+#include <cmath>
+
 using namespace k4json;
 
 Json json = from_file("tests/data/a.json");
@@ -260,6 +264,34 @@ TEST_CASE("size function", "[expression]") {
         REQUIRE(result[0].get_number() == 3);
     }());
 
+    // Queries which can select any number of nodes are counted, whatever
+    // the number
+    REQUIRE_NOTHROW([] {
+        Json nested = from_string(R"({"a": [[1, 2, 3], [4, 5, 6]], "e": []})");
+        JsonArray result = parse(nested, "size(a[0:1])");
+        REQUIRE(result.size() == 1);
+        REQUIRE(result[0].get_number() == 1);
+
+        result = parse(nested, "size(a[0:2])");
+        REQUIRE(result[0].get_number() == 2);
+
+        result = parse(nested, "size(e[*])");
+        REQUIRE(result[0].get_number() == 0);
+
+        result = parse(nested, "size(a[?size(@) > 5])");
+        REQUIRE(result[0].get_number() == 0);
+
+        // Singular queries are sized, even with a nodelist inside a bracket
+        result = parse(nested, "size(a[0])");
+        REQUIRE(result[0].get_number() == 3);
+
+        result = parse(nested, "size(a[size(e[*])])");
+        REQUIRE(result[0].get_number() == 3);
+
+        result = parse(nested, "size(first(a[*]))");
+        REQUIRE(result[0].get_number() == 3);
+    }());
+
     REQUIRE_THROWS_MATCHES(
         [] {
             parse(json, "size(4)");
@@ -371,3 +403,838 @@ TEST_CASE("binary operators", "[expression]") {
         EqualsJError(3, "expression to the left of binary operator doesn't "
                         "resolve to [number]"));
 }
+
+Json records = from_file("tests/data/records.json");
+
+std::vector<std::string> names_of(const JsonArray& result) {
+    std::vector<std::string> names;
+    for (auto& record : result) {
+        names.push_back(record["name"].get_string());
+    }
+    return names;
+}
+
+TEST_CASE("filter selector comparisons", "[expression]") {
+    REQUIRE_NOTHROW([] {
+        JsonArray result = parse(records, "store[?@.price > 10 && @.qty < 5]");
+        REQUIRE(names_of(result) ==
+                std::vector<std::string>{"apple", "cheese"});
+
+        result = parse(records, "store[?@['price'] >= 11 && @.price <= 12]");
+        REQUIRE(names_of(result) == std::vector<std::string>{"apple", "dates"});
+
+        // missing and non-numeric fields are unequal to any number
+        result = parse(records, "store[?@.price != 12]");
+        REQUIRE(result.size() == 6);
+
+        result = parse(records, "store[?@.price == 4.5]");
+        REQUIRE(names_of(result) == std::vector<std::string>{"bread"});
+
+        result = parse(records, "store[?@.name == favourite]");
+        REQUIRE(names_of(result) == std::vector<std::string>{"dates"});
+
+        result = parse(records, "store[?@.price < 'zzz']");
+        REQUIRE(names_of(result) == std::vector<std::string>{"eggs"});
+
+        result = parse(records, "store[?@.price > $.limit * 2]");
+        REQUIRE(names_of(result) == std::vector<std::string>{"cheese"});
+
+        result = parse(records, "$[?@ == size(favourite) * 2]");
+        REQUIRE(result.size() == 1);
+        REQUIRE(result[0].get_number() == 10);
+
+        result = parse(records, "store[?@.price == null]");
+        REQUIRE(result.empty());
+
+        result = parse(records, "store[?@.nothing == @.nowhere]");
+        REQUIRE(result.size() == 7);
+
+        result = parse(records, "store[?@.price > 10].name");
+        REQUIRE(result.size() == 3);
+        REQUIRE(result[2].get_string() == "dates");
+
+        result = parse(records, "store[?@ == 'record'][0]");
+        REQUIRE(result.empty());
+
+        result = parse(records, "store[6][?@ == 'record']");
+        REQUIRE(result.size() == 1);
+        REQUIRE(result[0].get_string() == "record");
+    }());
+}
+
+TEST_CASE("filter selector logic", "[expression]") {
+    REQUIRE_NOTHROW([] {
+        JsonArray result = parse(records, "store[?@.tags]");
+        REQUIRE(names_of(result) ==
+                std::vector<std::string>{"apple", "cheese", "dates"});
+
+        result = parse(records, "store[?!@.tags && @.name]");
+        REQUIRE(names_of(result) ==
+                std::vector<std::string>{"bread", "eggs", "flour"});
+
+        result = parse(records, "store[?@.qty < 2 || @.qty > 9]");
+        REQUIRE(names_of(result) ==
+                std::vector<std::string>{"bread", "cheese"});
+
+        result = parse(records,
+                       "store[?(@.qty < 2 || @.qty > 9) && !(@.price > 20)]");
+        REQUIRE(names_of(result) == std::vector<std::string>{"bread"});
+
+        result = parse(records, "store[?@.tags[?@ == 'dry']]");
+        REQUIRE(names_of(result) == std::vector<std::string>{"dates"});
+
+        // filtering an object goes over its values
+        result = parse(records, "$[?@ == 10]");
+        REQUIRE(result.size() == 1);
+
+        // nothing to filter, expression isn't evaluated
+        result = parse(records, "store[2].tags[?size(@) > 1]");
+        REQUIRE(result.empty());
+    }());
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "store[?@.price > 10");
+        }(),
+        ExprSyntaxErr,
+        EqualsJError(19, "expected ] after filter expression"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "store[?!@.price == 10]");
+        }(),
+        ExprSyntaxErr,
+        EqualsJError(8, "! can only be applied to an existence test or to a "
+                        "parenthesized expression"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "store[?true]");
+        }(),
+        ExprSyntaxErr,
+        EqualsJError(7, "a literal cannot be used as an existence test"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "@.store");
+        }(),
+        ExprSyntaxErr,
+        EqualsJError(0, "@ can only be used inside a filter selector"));
+}
+
+TEST_CASE("descendant segment", "[expression]") {
+    REQUIRE_NOTHROW([] {
+        JsonArray result = parse(records, "$..name");
+        REQUIRE(result.size() == 6);
+        REQUIRE(result[0].get_string() == "apple");
+        REQUIRE(result[5].get_string() == "flour");
+
+        // doesn't go through the key index
+        REQUIRE(parse(records, "store..name") == result);
+        REQUIRE(parse(records, "$..['name']") == result);
+
+        result = parse(records, "$..[0]");
+        REQUIRE(result.size() == 4);
+        REQUIRE(result[0]["name"].get_string() == "apple");
+        REQUIRE(result[1].get_string() == "fruit");
+        REQUIRE(result[2].get_string() == "fruit");
+        REQUIRE(result[3].get_string() == "not");
+
+        result = parse(records, "$..tags[?@ == 'dry']");
+        REQUIRE(result.size() == 1);
+
+        result = parse(records, "$..nothing");
+        REQUIRE(result.empty());
+
+        result = parse(json, "$..a");
+        REQUIRE(result.size() == 2);
+        REQUIRE(result[0].get_obj().empty());
+        REQUIRE(result[1].get_bool() == true);
+    }());
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "$...name");
+        }(),
+        ExprSyntaxErr,
+        EqualsJError(3, "invalid first character for dot-notation name "
+                        "selector"));
+}
+
+TEST_CASE("wildcard selector", "[expression]") {
+    REQUIRE_NOTHROW([] {
+        JsonArray result = parse(records, "store[*].name");
+        REQUIRE(result.size() == 6);
+        REQUIRE(result[3].get_string() == "dates");
+        REQUIRE(parse(records, "store.*.name") == result);
+
+        // object values, in key order
+        result = parse(records, "$.*");
+        REQUIRE(result.size() == 3);
+        REQUIRE(result[0].get_string() == "dates");
+        REQUIRE(result[1].get_number() == 10);
+
+        result = parse(records, "limit[*]");
+        REQUIRE(result.empty());
+
+        result = parse(records, "size($..*)");
+        REQUIRE(result[0].get_number() ==
+                parse(records, "nchildren($) - 1")[0].get_number());
+
+        result = parse(records, "max(store[*].qty)");
+        REQUIRE(result.size() == 1);
+        REQUIRE(result[0].get_number() == 10);
+
+        // size of a multi-node argument is the amount of nodes
+        result = parse(records, "size(store[*].price)");
+        REQUIRE(result[0].get_number() == 5);
+
+        result = parse(records, "nchildren(store[*].tags)");
+        REQUIRE(result[0].get_number() == 6);
+    }());
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "max(store[*].name)");
+        }(),
+        ExprValueErr,
+        EqualsJError(17, "function max() only accepts numerical arguments but "
+                         "argument 0 is:\n\"apple\""));
+}
+
+TEST_CASE("slice selector", "[expression]") {
+    REQUIRE_NOTHROW([] {
+        JsonArray result = parse(records, "store[1:5:2].name");
+        REQUIRE(result.size() == 2);
+        REQUIRE(result[0].get_string() == "bread");
+        REQUIRE(result[1].get_string() == "dates");
+
+        result = parse(records, "store[:2].name");
+        REQUIRE(result.size() == 2);
+        REQUIRE(result[1].get_string() == "bread");
+
+        result = parse(records, "store[::-1].name");
+        REQUIRE(result.size() == 6);
+        REQUIRE(result[0].get_string() == "flour");
+        REQUIRE(result[5].get_string() == "apple");
+
+        result = parse(records, "store[-2:]");
+        REQUIRE(result.size() == 2);
+        REQUIRE(result[1][0].get_string() == "not");
+
+        result = parse(records, "store[5:1:-2].name");
+        REQUIRE(result.size() == 2);
+        REQUIRE(result[0].get_string() == "flour");
+        REQUIRE(result[1].get_string() == "dates");
+
+        result = parse(records, "store[size(store) - 3 : 1000000].qty");
+        REQUIRE(result.size() == 2);
+        REQUIRE(result[1].get_number() == 4);
+
+        REQUIRE(parse(records, "store[0:0]").empty());
+        REQUIRE(parse(records, "store[::0]").empty());
+        REQUIRE(parse(records, "store[3:1]").empty());
+        REQUIRE(parse(records, "limit[0:1]").empty());
+
+        result = parse(records, "min(store[0:3].qty)");
+        REQUIRE(result[0].get_number() == 1);
+    }());
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "store[1.5:]");
+        }(),
+        ExprValueErr,
+        EqualsJError(9, "slice bound must evaluate to an integer"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "store[1:2:3:4]");
+        }(),
+        ExprSyntaxErr, EqualsJError(11, "expected ]"));
+}
+
+TEST_CASE("aggregate functions", "[expression]") {
+    REQUIRE_NOTHROW([] {
+        JsonArray result = parse(records, "sum(store[*].qty)");
+        REQUIRE(result.size() == 1);
+        REQUIRE(result[0].get_number() == 27);
+
+        result = parse(records, "avg(store[*].qty)");
+        REQUIRE(result[0].get_number() == 4.5);
+
+        result = parse(records, "variance(store[*].qty)");
+        REQUIRE(std::abs(result[0].get_number() - 57.5 / 6) < 1e-9);
+
+        result = parse(records, "stddev(store[*].qty)");
+        REQUIRE(std::abs(result[0].get_number() - std::sqrt(57.5 / 6)) <
+                1e-9);
+
+        result = parse(records, "count(store[*].qty)");
+        REQUIRE(result[0].get_number() == 6);
+
+        // a single array argument stands for its elements
+        result = parse(records, "count(store)");
+        REQUIRE(result[0].get_number() == 7);
+
+        result = parse(from_string("[1, 2, 3, 4, 5, 6, 7, 8, 9]"), "sum($)");
+        REQUIRE(result[0].get_number() == 45);
+
+        result = parse(records, "sum(1, 2, limit) / count(1, 2, limit)");
+        REQUIRE(result[0].get_number() == 13.0 / 3);
+
+        result = parse(records, "sum(store[2].tags)");
+        REQUIRE(result[0].get_number() == 0);
+    }());
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "sum(store[*].price)");
+        }(),
+        ExprValueErr,
+        EqualsJError(18, "function sum() only accepts numerical arguments but "
+                         "argument 4 is:\n\"unknown\""));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "avg(store[2].tags)");
+        }(),
+        ExprValueErr,
+        EqualsJError(17, "function avg() needs at least one number"));
+}
+
+TEST_CASE("column function", "[expression]") {
+    REQUIRE_NOTHROW([] {
+        JsonArray result = parse(records, "column(store, 'price')");
+        REQUIRE(result.size() == 1);
+        JsonArray column = result[0].get_array();
+        REQUIRE(column.size() == 7);
+        REQUIRE(column[1].get_number() == 4.5);
+        REQUIRE(column[4].get_string() == "unknown");
+        REQUIRE(column[5].is_null());
+        REQUIRE(column[6].is_null());
+
+        result = parse(records, "sum(column(store[0:6], \"qty\"))");
+        REQUIRE(result[0].get_number() == 27);
+
+        result = parse(records, "max(column(store[0:4], 'price'))");
+        REQUIRE(result[0].get_number() == 25);
+
+        result = parse(records, "size(column(store[*], 'name'))");
+        REQUIRE(result[0].get_number() == 7);
+
+        result = parse(records, "'string literal'");
+        REQUIRE(result[0].get_string() == "string literal");
+
+        result = parse(records, "size(\"four\")");
+        REQUIRE(result[0].get_number() == 4);
+    }());
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "column(store)");
+        }(),
+        ExprSyntaxErr,
+        EqualsJError(13, "function column() takes exactly two arguments"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "column(store, limit)");
+        }(),
+        ExprValueErr,
+        EqualsJError(19, "second argument of function column() must be a "
+                         "string"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "size('abc)");
+        }(),
+        ExprSyntaxErr,
+        EqualsJError(10, "query ended early: unterminated string literal"));
+}
+
+TEST_CASE("array arithmetic", "[expression]") {
+    REQUIRE_NOTHROW([] {
+        auto numbers = [](const JsonArray& result) {
+            REQUIRE(result.size() == 1);
+            std::vector<double> res;
+            for (const Json& number : result[0].get_array()) {
+                res.push_back(number.get_number());
+            }
+            return res;
+        };
+
+        JsonArray result = parse(records, "column(store[0:4], 'price') * 2");
+        REQUIRE(numbers(result) == std::vector<double>{24, 9, 50, 22});
+
+        result = parse(records, "100 - column(store[0:4], 'qty')");
+        REQUIRE(numbers(result) == std::vector<double>{97, 90, 99, 93});
+
+        result = parse(records, "column(store[0:4], 'price') * "
+                                "column(store[0:4], 'qty') -1");
+        REQUIRE(numbers(result) == std::vector<double>{35, 44, 24, 76});
+
+        result = parse(records, "column(store[0:2], 'qty') / "
+                                "size(column(store[0:2], 'qty'))");
+        REQUIRE(numbers(result) == std::vector<double>{1.5, 5});
+
+        result = parse(records, "sum(column(store[0:4], 'qty') * 10)");
+        REQUIRE(result[0].get_number() == 210);
+
+        // a minus sign right after an operand is subtraction, with or
+        // without spaces, not a negative number literal
+        for (const char* query :
+             {"store[0].qty-1", "store[0].qty -1", "store[0].qty - 1"}) {
+            result = parse(records, query);
+            REQUIRE(result.size() == 1);
+            REQUIRE(result[0].get_number() == 2);
+        }
+        REQUIRE(parse(records, "2-1")[0].get_number() == 1);
+
+        result = parse(records, "store[6][1:1]");
+        REQUIRE(result.empty());
+
+        // without an operator, the array itself is selected
+        result = parse(records, "store[6]");
+        REQUIRE(result[0].get_array().size() == 3);
+    }());
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "column(store[0:4], 'qty') / "
+                           "(column(store[0:4], 'qty') - 1)");
+        }(),
+        ExprValueErr, EqualsJError(59, "division by zero"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "column(store[0:4], 'qty') + "
+                           "column(store[0:3], 'qty')");
+        }(),
+        ExprValueErr,
+        EqualsJError(53, "binary operator on arrays of different lengths"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "store[6] * 2");
+        }(),
+        ExprValueErr,
+        EqualsJError(9, "array to the left of binary operator doesn't only "
+                        "contain numbers"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "2 * column(store, 'price')");
+        }(),
+        ExprValueErr,
+        EqualsJError(26, "array to the right of binary operator doesn't "
+                         "only contain numbers"));
+}
+
+TEST_CASE("topk, sort and distinct functions", "[expression]") {
+    REQUIRE_NOTHROW([] {
+        JsonArray result = parse(records, "topk(store[*].qty, 3)");
+        REQUIRE(result.size() == 3);
+        REQUIRE(result[0].get_number() == 10);
+        REQUIRE(result[1].get_number() == 7);
+        REQUIRE(result[2].get_number() == 4);
+
+        result = parse(records, "topk(column(store[0:4], 'price'), 10)");
+        REQUIRE(result.size() == 4);
+        REQUIRE(result[3].get_number() == 4.5);
+
+        // k past the range of size_t keeps every value
+        result = parse(records, "topk(store[0:2].qty, 1e20)");
+        REQUIRE(result.size() == 2);
+        REQUIRE(result[0].get_number() == 10);
+        REQUIRE(result[1].get_number() == 3);
+
+        result = parse(records, "sort(store[*].name)");
+        REQUIRE(result.size() == 6);
+        REQUIRE(result[0].get_string() == "apple");
+        REQUIRE(result[5].get_string() == "flour");
+
+        result = parse(records, "sort(store[*].qty)");
+        REQUIRE(result[0].get_number() == 1);
+        REQUIRE(result[5].get_number() == 10);
+
+        result = parse(records, "sum(topk(store[*].qty, 2))");
+        REQUIRE(result[0].get_number() == 17);
+
+        result = parse(records, "distinct(store..tags[*])");
+        REQUIRE(result.size() == 2);
+        REQUIRE(result[0].get_string() == "fruit");
+        REQUIRE(result[1].get_string() == "dry");
+
+        result = parse(records, "distinct(store[6])");
+        REQUIRE(result.size() == 3);
+
+        result = parse(records, "count_by(store..tags[*])");
+        REQUIRE(result.size() == 1);
+        REQUIRE(result[0]["fruit"].get_number() == 2);
+        REQUIRE(result[0]["dry"].get_number() == 1);
+
+        result = parse(records, "count_by(column(store, 'price'))");
+        REQUIRE(result[0]["null"].get_number() == 2);
+        REQUIRE(result[0]["unknown"].get_number() == 1);
+        REQUIRE(result[0]["12"].get_number() == 1);
+    }());
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "topk(store[*].qty)");
+        }(),
+        ExprSyntaxErr,
+        EqualsJError(18, "function topk() takes exactly two arguments"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "topk(store[*].qty, -1)");
+        }(),
+        ExprValueErr,
+        EqualsJError(21, "second argument of function topk() must be a "
+                         "non-negative integer"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "sort(column(store, 'price'))");
+        }(),
+        ExprValueErr,
+        EqualsJError(27, "function sort() only accepts all numbers or all "
+                         "strings but argument 4 is:\n\"unknown\""));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "distinct(store[*])");
+        }(),
+        ExprValueErr,
+        EqualsJError(17, "function distinct() doesn't accept arrays and "
+                         "objects but argument 0 is:\n" +
+                             records["store"][0].to_string()));
+}
+
+TEST_CASE("first function", "[expression]") {
+    REQUIRE_NOTHROW([] {
+        JsonArray result = parse(records, "first(store[*].name)");
+        REQUIRE(Json(result) == from_string(R"(["apple"])"));
+
+        result = parse(records, "size(first(store[?@.price > 20]))");
+        REQUIRE(result[0].get_number() == 4);
+
+        result = parse(records, "first(store[*].tags[0])");
+        REQUIRE(result[0].get_string() == "fruit");
+
+        result = parse(records, "first($..qty) + 1");
+        REQUIRE(result[0].get_number() == 4);
+
+        REQUIRE(names_of(parse(records, "store[?first(@.tags[*]) == "
+                                        "'fruit']")) ==
+                std::vector<std::string>{"apple", "dates"});
+
+        // Nothing selected, nothing returned
+        result = parse(records, "first(store[*].missing)");
+        REQUIRE(result.empty());
+        result = parse(records, "first(store[?@.qty > 100])");
+        REQUIRE(result.empty());
+
+        // The filter stops at the first match, bread (qty 10) is never
+        // evaluated
+        result = parse(records, "first(store[?@.qty / (@.qty - 10) < 0])");
+        REQUIRE(result[0]["name"].get_string() == "apple");
+    }());
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "store[?@.qty / (@.qty - 10) < 0]");
+        }(),
+        ExprValueErr, EqualsJError(27, "division by zero"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "first(store, limit)");
+        }(),
+        ExprSyntaxErr,
+        EqualsJError(19, "function first() only accepts one argument"));
+}
+
+TEST_CASE("indexed filters", "[expression]") {
+    REQUIRE_NOTHROW([] {
+        Json indexed = records;
+        indexed.build_index("store", "price");
+        indexed.build_index("store", "name");
+
+        std::vector<std::string> queries = {
+            "store[?@.price == 12]",
+            "store[?@.price == 13]",
+            "store[?@.price >= 11]",
+            "store[?@.price < 11.5 && @.qty > 2]",
+            "store[?@.qty > 2 && @.price <= 12]",
+            "store[?@.price != 12]",
+            "store[?@.name == 'eggs']",
+            "store[?@['name'] == \"flour\"].qty",
+            "store[?@.name == true]",
+            "store[?@.name == null]",
+        };
+        for (const std::string& query : queries) {
+            REQUIRE(Json(parse(indexed, query)) == Json(parse(records, query)));
+        }
+
+        JsonArray result = parse(indexed, "lookup(store, 'name', favourite)");
+        REQUIRE(names_of(result) == std::vector<std::string>{"dates"});
+        result = parse(records, "lookup(store, 'price', 4.5)");
+        REQUIRE(names_of(result) == std::vector<std::string>{"bread"});
+        result = parse(records, "lookup(store, 'tags', store[0].tags)");
+        REQUIRE(names_of(result) == std::vector<std::string>{"apple"});
+        result = parse(indexed, "lookup(store, 'price', 1)");
+        REQUIRE(result.empty());
+    }());
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "lookup(store, 'name')");
+        }(),
+        ExprSyntaxErr,
+        EqualsJError(21, "function lookup() takes exactly three arguments"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            parse(records, "lookup(limit, 'name', 1)");
+        }(),
+        ExprValueErr,
+        EqualsJError(24, "first argument of function lookup() must be an "
+                         "array"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            JsonExpressionParser::select(records, "size(store)");
+        }(),
+        ExprValueErr,
+        EqualsJError(11, "expression must select nodes of the json, not "
+                         "compute values"));
+
+    // Values computed while filtering aren't part of the result
+    REQUIRE_NOTHROW([] {
+        std::vector<const Json*> nodes =
+            JsonExpressionParser::select(records, "store[?@.qty > 1 + 1]");
+        REQUIRE(nodes.size() == parse(records, "store[?@.qty > 2]").size());
+        REQUIRE(!nodes.empty());
+    }());
+}
+
+TEST_CASE("query profile", "[expression]") {
+    REQUIRE_NOTHROW([] {
+        QueryProfile profile;
+        JsonArray result =
+            parse(records, "max(store[?@.qty > 2].price) + 1", &profile);
+        REQUIRE(result[0].get_number() == 13);
+
+        REQUIRE(profile.explain() == "function max(store[?@.qty > 2].price)\n"
+                                     "  name store\n"
+                                     "  filter [?@.qty > 2]\n"
+                                     "  name .price\n"
+                                     "  evaluate\n");
+
+        const std::vector<QueryStep>& steps = profile.steps();
+        REQUIRE(steps.size() == 5);
+        // Column-wise, the filter runs once over all children of store
+        REQUIRE(steps[2].calls == 1);
+        REQUIRE(steps[2].nodes_in == 1);
+        REQUIRE(steps[2].nodes_out == 4);
+        REQUIRE(steps[3].nodes_out == 3);
+        REQUIRE(steps[4].nodes_in == 3);
+        REQUIRE(steps[4].parent == 0);
+        REQUIRE(steps[4].bytes_copied > 0);
+        REQUIRE(profile.result_nodes() == 1);
+    }());
+
+    // Selectors inside a filter which isn't column-wise run once per
+    // candidate
+    QueryProfile profile;
+    parse(records, "store[?@.name == favourite]", &profile);
+    REQUIRE(profile.steps().size() == 4);
+    REQUIRE(profile.steps()[2].text == ".name");
+    REQUIRE(profile.steps()[2].calls == 7);
+    REQUIRE(profile.steps()[2].parent == 1);
+}
+
+TEST_CASE("parallel evaluation", "[expression]") {
+    JsonArray items;
+    for (int i = 0; i < 2000; ++i) {
+        JsonObject item;
+        item["id"] = Json(static_cast<double>(i));
+        item["tags"] = Json(JsonArray{Json("t" + std::to_string(i % 7))});
+        if (i % 3 == 0) {
+            item["odd"] = Json(i % 2 == 1);
+        }
+        items.push_back(Json(item));
+    }
+    Json big = Json(JsonObject{{"items", Json(items)}});
+
+    std::vector<std::string> queries = {
+        "items[*].id",
+        "items[*].odd",
+        "items[*].tags[0]",
+        "items[*].tags[-1]",
+        "items[?@.odd == true].id",
+        "items[?@.tags[0] == 't3' && @.id > 1000].id",
+        "items[?size(@.tags) == 1 && @.id > 1990]",
+    };
+
+    for (const std::string& query : queries) {
+        JsonArray sequential = parse(big, query);
+        set_parallel_threshold(1);
+        JsonArray parallel = parse(big, query);
+        set_parallel_threshold(1 << 16);
+        REQUIRE(Json(sequential) == Json(parallel));
+    }
+
+    // The error of the first failing candidate, as if sequential
+    set_parallel_threshold(1);
+    REQUIRE_THROWS_MATCHES(
+        [big] {
+            parse(big, "items[?@.id / (@.id - 1500) > 0]");
+        }(),
+        ExprValueErr, EqualsJError(27, "division by zero"));
+    set_parallel_threshold(1 << 16);
+}
+
+TEST_CASE("query budget", "[expression]") {
+    REQUIRE_NOTHROW([] {
+        QueryBudget budget;
+        budget.max_nodes = 100;
+        budget.max_bytes = 1000;
+        JsonArray result =
+            parse(records, "store[?@.price > 10].name", nullptr, &budget);
+        REQUIRE(result.size() == 3);
+
+        // Not counted without a budget
+        result = parse(records, "$..*");
+        REQUIRE(result.size() == 36);
+    }());
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            QueryBudget budget;
+            budget.max_nodes = 20;
+            parse(records, "$..*", nullptr, &budget);
+        }(),
+        ExprBudgetErr, EqualsJError("query visited more than 20 nodes"));
+
+    // Every candidate of a filter is visited
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            QueryBudget budget;
+            budget.max_nodes = 5;
+            parse(records, "store[?@.qty > 100]", nullptr, &budget);
+        }(),
+        ExprBudgetErr, EqualsJError("query visited more than 5 nodes"));
+
+    // The copied result counts too
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            QueryBudget budget;
+            budget.max_bytes = 100;
+            parse(records, "store", nullptr, &budget);
+        }(),
+        ExprBudgetErr, EqualsJError("query copied more than 100 bytes"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            std::stop_source source;
+            QueryBudget budget;
+            budget.stop = source.get_token();
+            source.request_stop();
+            parse(records, "store[*].name", nullptr, &budget);
+        }(),
+        ExprBudgetErr, EqualsJError("query was cancelled"));
+
+    // The clock is read by the first work, then every few nodes
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            QueryBudget budget;
+            budget.deadline = std::chrono::steady_clock::now();
+            parse(records, "store[?@.qty > 100 || size($..*) > 0]", nullptr,
+                  &budget);
+        }(),
+        ExprBudgetErr, EqualsJError("query ran past its deadline"));
+
+    // Large queries are stopped while their loops run, not once they're done
+    JsonArray rows;
+    for (int i = 0; i < 200000; ++i) {
+        JsonObject row;
+        row.emplace("x", Json(static_cast<double>(i % 97)));
+        rows.push_back(Json(row));
+    }
+    Json large(rows);
+
+    REQUIRE_THROWS_MATCHES(
+        [&large] {
+            QueryBudget budget;
+            budget.deadline =
+                std::chrono::steady_clock::now() + std::chrono::milliseconds(1);
+            parse(large, "sum(column($, 'x') * column($, 'x') * 2)", nullptr,
+                  &budget);
+        }(),
+        ExprBudgetErr, EqualsJError("query ran past its deadline"));
+
+    REQUIRE_THROWS_MATCHES(
+        [&large] {
+            QueryBudget budget;
+            budget.max_nodes = 10000;
+            JsonExpressionParser::select(large, "$[*].x", nullptr, &budget);
+        }(),
+        ExprBudgetErr, EqualsJError("query visited more than 10000 nodes"));
+
+    // Building the key index for $..name visits the whole document
+    REQUIRE_THROWS_MATCHES(
+        [&large] {
+            QueryBudget budget;
+            budget.max_nodes = 10000;
+            parse(large, "size($..nope)", nullptr, &budget);
+        }(),
+        ExprBudgetErr, EqualsJError("query visited more than 10000 nodes"));
+    REQUIRE(parse(large, "size($..nope)") == JsonArray{Json(0.0)});
+}
+
+TEST_CASE("normalized paths", "[expression]") {
+    REQUIRE_NOTHROW([] {
+        auto paths = [](const Json& root, const std::string& query) {
+            std::vector<std::string> res;
+            for (const JsonPath& path :
+                 locate(root, JsonExpressionParser::select(root, query))) {
+                res.push_back(normalized_path(path));
+            }
+            return res;
+        };
+
+        REQUIRE(paths(records, "store[?@.price > 20].name") ==
+                std::vector<std::string>{"$['store'][2]['name']"});
+        REQUIRE(paths(records, "$") == std::vector<std::string>{"$"});
+        REQUIRE(paths(records, "store[3:5].qty") ==
+                std::vector<std::string>{"$['store'][3]['qty']",
+                                         "$['store'][4]['qty']"});
+        REQUIRE(paths(records, "limit") ==
+                std::vector<std::string>{"$['limit']"});
+        REQUIRE(paths(records, "store[1].price") ==
+                std::vector<std::string>{"$['store'][1]['price']"});
+        REQUIRE(paths(records, "store[?@.qty > 5].qty") ==
+                std::vector<std::string>{"$['store'][1]['qty']",
+                                         "$['store'][3]['qty']"});
+
+        Json names = from_string(R"({"it's": [{"a\\b\n\u0001": 1}]})");
+        REQUIRE(paths(names, "$..*") ==
+                std::vector<std::string>{"$['it\\'s']",
+                                         "$['it\\'s'][0]",
+                                         "$['it\\'s'][0]['a\\\\b\\n\\u0001']"});
+
+        // In the order of the nodes, duplicates included
+        const Json* store = records.obj_find("store");
+        const Json* second = &store->get_array_ref()[1];
+        std::vector<JsonPath> located =
+            locate(records, {second, store, second});
+        REQUIRE(located.size() == 3);
+        REQUIRE(located[1] == JsonPath{std::string_view("store")});
+        REQUIRE(located[2] == located[0]);
+        REQUIRE(located[0] == JsonPath{std::string_view("store"), size_t(1)});
+    }());
+}
@@ -1,8 +1,16 @@
 #include "json.hpp"
 #include "err_matcher.hpp"
+#include "expressions.hpp"
+#include "index.hpp"
+#include "thread_pool.hpp"
+#include "writer.hpp"
 
 #include "catch_amalgamated.hpp"
 
+#include <sstream>
+#include <thread>
+#include <vector>
+
 using namespace k4json;
 
 TEST_CASE("json type error", "[json]") {
@@ -52,3 +60,229 @@ TEST_CASE("json type error", "[json]") {
         REQUIRE(j["a"][1].get_string() == "abc");
     }());
 }
+
+TEST_CASE("key index", "[json]") {
+    Json j = Json::from_string(R"({ "a": [ { "id": 1 }, { "id": 2 } ],
+                                    "b": { "id": 3 } })");
+    REQUIRE(j.index_memory_usage() == 0);
+
+    auto& ids = j.key_index().postings("id");
+    REQUIRE(ids.size() == 3);
+    REQUIRE(ids[0]->get_number() == 1);
+    REQUIRE(ids[2]->get_number() == 3);
+    REQUIRE(j.key_index().postings("nope").empty());
+    REQUIRE(j.index_memory_usage() > 0);
+
+    // the index points into j, copies don't share it
+    Json copy = j;
+    REQUIRE(copy.index_memory_usage() == 0);
+
+    j.obj_add(KeyedJson("id", Json(4.0)));
+    REQUIRE(j.index_memory_usage() == 0);
+    REQUIRE(j.key_index().postings("id").size() == 4);
+
+    // Threads asking for it at once all get the one index
+    Json fresh = j;
+    std::vector<const KeyIndex*> seen(8);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < seen.size(); ++i) {
+        threads.emplace_back([&fresh, &seen, i] {
+            seen[i] = &fresh.key_index();
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (const KeyIndex* index : seen) {
+        REQUIRE(index == &fresh.key_index());
+    }
+}
+
+TEST_CASE("field index", "[json]") {
+    Json j = Json::from_string(R"({ "users": [
+        { "id": 3, "name": "c", "admin": true },
+        { "id": 1, "name": "a", "admin": null },
+        "not a record",
+        { "id": 2, "name": "b" },
+        { "id": 1, "name": "a2", "admin": false },
+        { "id": [1], "name": 5 }
+    ] })");
+    j.build_index("users", "id");
+    j.build_index("$['users']", "name");
+    j.build_index("users", "admin");
+
+    const Json* users = j.obj_find("users");
+    REQUIRE(j.field_index("id") == nullptr);
+    REQUIRE(users->field_index("nope") == nullptr);
+    const FieldIndex* ids = users->field_index("id");
+    REQUIRE(ids != nullptr);
+    REQUIRE(users->index_memory_usage() > 0);
+
+    REQUIRE(ids->equal(Json(1.0)) == std::vector<uint32_t>{1, 4});
+    REQUIRE(ids->equal(Json(7.0)).empty());
+    REQUIRE(ids->equal(Json(std::string("1"))).empty());
+    REQUIRE(ids->compare(Comparison::LT, 3) == std::vector<uint32_t>{1, 3, 4});
+    REQUIRE(ids->compare(Comparison::LE, 2) == std::vector<uint32_t>{1, 3, 4});
+    REQUIRE(ids->compare(Comparison::GT, 1) == std::vector<uint32_t>{0, 3});
+    REQUIRE(ids->compare(Comparison::GE, 3) == std::vector<uint32_t>{0});
+    REQUIRE(ids->compare(Comparison::EQ, 2) == std::vector<uint32_t>{3});
+
+    const FieldIndex* names = users->field_index("name");
+    REQUIRE(names->equal(Json(std::string("a2"))) ==
+            std::vector<uint32_t>{4});
+    const FieldIndex* admins = users->field_index("admin");
+    REQUIRE(admins->equal(Json(true)) == std::vector<uint32_t>{0});
+    REQUIRE(admins->equal(Json()) == std::vector<uint32_t>{1});
+
+    REQUIRE_THROWS_MATCHES(
+        [j] {
+            j.build_index("users[0]", "id");
+        }(),
+        JsonTypeErr,
+        EqualsJError("build_index() path must select exactly one array"));
+
+    // modifying the array drops its indexes
+    Json arr = *users;
+    arr.build_index("$", "id");
+    REQUIRE(arr.field_index("id") != nullptr);
+    arr.array_add(Json(1.0));
+    REQUIRE(arr.field_index("id") == nullptr);
+}
+
+TEST_CASE("subtree statistics", "[json]") {
+    Json j = Json::from_string(R"({ "a": [ 1, [ 2, [ 3 ] ] ], "b": null })");
+    REQUIRE(j.nchildren() == 8);
+    REQUIRE(j.depth() == 4);
+    REQUIRE(j["a"].nchildren() == 6);
+    REQUIRE(j["a"].depth() == 3);
+    REQUIRE(j["b"].depth() == 0);
+
+    j.obj_add(KeyedJson("c", Json(JsonArray{Json(1.0), Json(2.0)})));
+    REQUIRE(j.nchildren() == 11);
+    REQUIRE(j.depth() == 4);
+
+    // replacing the deepest value
+    j.obj_add(KeyedJson("a", Json(true)));
+    REQUIRE(j.nchildren() == 6);
+    REQUIRE(j.depth() == 2);
+
+    // replacing a null
+    j.obj_add(KeyedJson("b", Json(JsonObject())));
+    REQUIRE(j.nchildren() == 6);
+    REQUIRE(j.depth() == 2);
+
+    Json arr((JsonArray()));
+    REQUIRE(arr.nchildren() == 1);
+    REQUIRE(arr.depth() == 0);
+    arr.array_add(j);
+    REQUIRE(arr.nchildren() == 7);
+    REQUIRE(arr.depth() == 3);
+}
+
+TEST_CASE("serialization", "[json]") {
+    Json j = Json::from_string(
+        R"({ "a": [1, 2.5, "x\"y"], "b": { }, "c": [], "d\n": null })");
+    std::string expected = "{\n"
+                           "  \"a\": [\n"
+                           "    1,\n"
+                           "    2.5,\n"
+                           "    \"x\\\"y\"\n"
+                           "  ],\n"
+                           "  \"b\": { },\n"
+                           "  \"c\": [ ],\n"
+                           "  \"d\\n\": null\n"
+                           "}";
+    REQUIRE(j.to_string() == expected);
+
+    // Several writes and more than a block of output through a sink
+    std::ostringstream out;
+    JsonArray big(20000, j);
+    {
+        JsonWriter writer(out);
+        writer.write(j);
+        writer.write_raw("\n");
+        writer.write_array(big);
+    }
+    REQUIRE(out.str() == expected + "\n" + Json(big).to_string());
+
+    JsonWriter writer;
+    writer.write_array(JsonArray());
+    REQUIRE(writer.take() == "[ ]");
+    writer.write(Json(true));
+    REQUIRE(writer.take() == "true");
+
+    // Integers print as such unless scientific notation is shorter,
+    // other numbers as the shortest text which reads back the same
+    FormatOptions minified;
+    minified.minified = true;
+    Json numbers = Json::from_string(
+        "[100000, 120000, -3, 123456789012, 1e21, 1.1, 1.5e-7, -0]");
+    REQUIRE(numbers.to_string(minified) ==
+            "[1e+05,120000,-3,123456789012,1e+21,1.1,1.5e-07,-0]");
+
+    // '/' doesn't need escaping, other control characters do
+    Json strings(std::string("a/b \x01 \"long enough to span words\\\n"));
+    REQUIRE(strings.to_string() ==
+            "\"a/b \\u0001 \\\"long enough to span words\\\\\\n\"");
+}
+
+TEST_CASE("serialization options", "[json]") {
+    Json j = Json::from_string(
+        R"({ "a": [1, { "b": [] }], "é": "x\u00e9\u2b50\ud801\udd01" })");
+
+    FormatOptions minified;
+    minified.minified = true;
+    REQUIRE(j.to_string(minified) ==
+            "{\"a\":[1,{\"b\":[]}],\"é\":\"xé⭐𐔁\"}");
+
+    FormatOptions ascii;
+    ascii.minified = true;
+    ascii.ascii_only = true;
+    REQUIRE(j.to_string(ascii) == "{\"a\":[1,{\"b\":[]}],\"\\u00e9\":"
+                                  "\"x\\u00e9\\u2b50\\ud801\\udd01\"}");
+    // The escapes load back to the same strings
+    REQUIRE(Json::from_string(j.to_string(ascii)) == j);
+
+    FormatOptions indent;
+    indent.indent = 4;
+    REQUIRE(Json::from_string("[1, [2]]").to_string(indent) ==
+            "[\n    1,\n    [\n        2\n    ]\n]");
+
+    JsonWriter writer(minified);
+    writer.write_array(JsonArray{Json(1.0), Json()});
+    REQUIRE(writer.take() == "[1,null]");
+}
+
+TEST_CASE("parallel serialization", "[json]") {
+    JsonArray items;
+    JsonObject members;
+    for (int i = 0; i < 40000; ++i) {
+        JsonObject item;
+        item["id"] = Json(static_cast<double>(i));
+        item["name"] = Json("item \"" + std::to_string(i) + '"');
+        items.push_back(Json(item));
+        members["k" + std::to_string(i)] = Json(JsonArray{Json(true)});
+    }
+    JsonObject root;
+    root["items"] = Json(items);
+    root["members"] = Json(members);
+    root["small"] = Json(1.0);
+    Json big(root);
+
+    FormatOptions minified;
+    minified.minified = true;
+    std::vector<std::string> sequential = {
+        big.to_string(), big.to_string(minified), Json(items).to_string()};
+
+    // The same bytes when written by chunks
+    set_parallel_threshold(1);
+    REQUIRE(big.to_string() == sequential[0]);
+    REQUIRE(big.to_string(minified) == sequential[1]);
+    std::ostringstream out;
+    {
+        JsonWriter writer(out);
+        writer.write_array(items);
+    }
+    set_parallel_threshold(1 << 16);
+    REQUIRE(out.str() == sequential[2]);
+}
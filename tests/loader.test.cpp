@@ -1,5 +1,6 @@
 #include "loader.hpp"
 #include "err_matcher.hpp"
+#include "expressions.hpp"
 #include "json.hpp"
 
 #include "catch_amalgamated.hpp"
@@ -364,3 +365,57 @@ TEST_CASE("bad numbers", "[loader]") {
             EqualsJError(1, 1, "(negative) number cannot have leading zeroes"));
     }
 }
+
+TEST_CASE("source spans", "[loader]") {
+    std::string data = R"({
+    "b": [1.50, "x\"y", {"c": 1e2}],
+    "ab": true,
+    "d": {"e": 1},
+    "d": [ null , 2 ]
+})";
+
+    REQUIRE_NOTHROW([data] {
+        SourceDocument doc = SourceDocument::from_string(data);
+        const Json& json = doc.json();
+        REQUIRE(doc.source(json) == data);
+        const Json& b = *json.obj_find("b");
+        REQUIRE(doc.source(b) == R"([1.50, "x\"y", {"c": 1e2}])");
+        REQUIRE(doc.source(b.get_array_ref()[0]) == "1.50");
+        REQUIRE(doc.source(b.get_array_ref()[1]) == R"("x\"y")");
+        REQUIRE(doc.source(b.get_array_ref()[2]) == R"({"c": 1e2})");
+        REQUIRE(doc.source(*json.obj_find("ab")) == "true");
+        // The last of duplicate keys is the one loaded
+        REQUIRE(doc.source(*json.obj_find("d")) == "[ null , 2 ]");
+        REQUIRE(doc.source(json.obj_find("d")->get_array_ref()[1]) == "2");
+        REQUIRE(doc.span(json.obj_find("d")->get_array_ref()[0])->offset ==
+                data.find("null"));
+
+        // Nodes which aren't part of the document have no source
+        Json copy = b;
+        REQUIRE(!doc.span(copy));
+
+        // Selected numbers are the nodes themselves, not computed copies
+        for (const char* query : {"b[0]", "$.b[0:1]", "b[?@ == 1.5]"}) {
+            std::vector<const Json*> nodes =
+                JsonExpressionParser::select(json, query);
+            REQUIRE(nodes.size() == 1);
+            REQUIRE(doc.source(*nodes[0]) == "1.50");
+        }
+        REQUIRE(doc.source(*JsonExpressionParser::select(json, "d[1]")[0]) ==
+                "2");
+        REQUIRE_THROWS_AS(JsonExpressionParser::select(json, "b[0] * 1"),
+                          ExprValueErr);
+    }());
+
+    REQUIRE_NOTHROW([] {
+        SourceDocument doc =
+            SourceDocument::from_file(data_loc + "records.json");
+        // Moving the document keeps its nodes where they are
+        SourceDocument moved = std::move(doc);
+        for (const Json* node :
+             JsonExpressionParser::select(moved.json(), "$..*")) {
+            REQUIRE(from_string("[" + std::string(*moved.source(*node)) +
+                                "]")[0] == *node);
+        }
+    }());
+}
@@ -0,0 +1,261 @@
+#include "packed.hpp"
+#include "cache.hpp"
+#include "expressions.hpp"
+#include "json.hpp"
+#include "packed_query.hpp"
+#include "stream.hpp"
+#include "utils.hpp"
+
+#include "catch_amalgamated.hpp"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include <unistd.h>
+
+using namespace k4json;
+
+// Packs the json file into a temporary file, returns its name
+std::string pack_file(const std::string& file_name) {
+    std::string packed_name =
+        (std::filesystem::temp_directory_path() /
+         ("k4json_" + std::filesystem::path(file_name).stem().string() +
+          ".pack"))
+            .string();
+    std::ofstream out(packed_name, std::ios::binary);
+    pack(from_file(file_name), out);
+    return packed_name;
+}
+
+TEST_CASE("packed documents", "[packed]") {
+    REQUIRE_NOTHROW([] {
+        for (const char* file : {"tests/data/a.json", "tests/data/records.json",
+                                 "tests/data/uni.json"}) {
+            std::string packed_name = pack_file(file);
+            REQUIRE(is_packed_file(packed_name));
+            REQUIRE(!is_packed_file(file));
+
+            PackedDocument doc(packed_name);
+            REQUIRE_NOTHROW(doc.verify());
+            REQUIRE(doc.root().to_json() == from_file(file));
+            // from_file converts packed files
+            REQUIRE(from_file(packed_name) == from_file(file));
+            std::remove(packed_name.c_str());
+        }
+    }());
+
+    REQUIRE_NOTHROW([] {
+        std::string packed_name = pack_file("tests/data/records.json");
+        PackedDocument doc(packed_name);
+        PackedNode root = doc.root();
+        REQUIRE(root.get_type() == JsonType::OBJECT);
+
+        std::optional<PackedNode> store = root.obj_find("store");
+        REQUIRE(store);
+        REQUIRE(store->size() == 7);
+        REQUIRE((*store)[1].obj_find("price")->get_number() == 4.5);
+        REQUIRE((*store)[0].key(0) == "name");
+        REQUIRE((*store)[0].obj_find("name")->get_string() == "apple");
+        REQUIRE(!(*store)[0].obj_find("nope"));
+        REQUIRE(!(*store)[6].obj_find("name"));
+        REQUIRE_THROWS_AS((*store)[7], std::out_of_range);
+        REQUIRE_THROWS_AS(root.get_number(), JsonTypeErr);
+
+        // Views stay valid when the document is moved
+        PackedDocument moved = std::move(doc);
+        REQUIRE(store->size() == 7);
+        std::remove(packed_name.c_str());
+    }());
+
+    REQUIRE_THROWS_AS(PackedDocument("tests/data/records.json"), PackErr);
+
+    // A table pointing back at its own slot (or an ancestor's) is rejected
+    // instead of being followed forever
+    REQUIRE_NOTHROW([] {
+        std::string packed_name =
+            (std::filesystem::temp_directory_path() / "k4json_cycle.pack")
+                .string();
+        std::string data = pack(from_string("[]"));
+        REQUIRE(data.size() == sizeof(PackHeader));
+        PackHeader header;
+        std::memcpy(&header, data.data(), sizeof(header));
+        header.root.count = 1;
+        header.root.payload = offsetof(PackHeader, root);
+        std::ofstream(packed_name, std::ios::binary)
+            .write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        PackedDocument doc(packed_name);
+        REQUIRE(doc.root().size() == 1);
+        REQUIRE_THROWS_AS(doc.root()[0], PackErr);
+        REQUIRE_THROWS_AS(doc.root().to_json(), PackErr);
+        REQUIRE_THROWS_AS(PackedQuery("$[*][0]").run(doc.root()), PackErr);
+        std::remove(packed_name.c_str());
+    }());
+
+    // Slots sharing a table would make the document a DAG, which expands
+    // exponentially, even with a recomputed checksum
+    REQUIRE_NOTHROW([] {
+        std::string packed_name =
+            (std::filesystem::temp_directory_path() / "k4json_shared.pack")
+                .string();
+        std::string data = pack(from_string("[[1], [2]]"));
+        PackedSlot slots[2];
+        std::memcpy(slots, data.data() + sizeof(PackHeader), sizeof(slots));
+        slots[1].payload = slots[0].payload;
+        std::memcpy(data.data() + sizeof(PackHeader), slots, sizeof(slots));
+        constexpr size_t start = offsetof(PackHeader, root);
+        uint64_t sum = finish_hash(
+            hash_words(hash_seed, data.data() + start, data.size() - start));
+        std::memcpy(data.data() + offsetof(PackHeader, checksum), &sum,
+                    sizeof(sum));
+        std::ofstream(packed_name, std::ios::binary) << data;
+
+        PackedDocument doc(packed_name);
+        REQUIRE(doc.root().to_json() == from_string("[[1], [1]]"));
+        REQUIRE_THROWS_MATCHES(doc.verify(), PackErr,
+                               Catch::Matchers::Message(
+                                   "Pack Error: container tables overlap or "
+                                   "are out of order"));
+        REQUIRE_THROWS_AS(from_file(packed_name), PackErr);
+        std::remove(packed_name.c_str());
+    }());
+}
+
+TEST_CASE("packed queries match the dom", "[packed]") {
+    REQUIRE_NOTHROW([] {
+        std::vector<std::pair<std::string, std::string>> cases = {
+            {"tests/data/a.json", "$"},
+            {"tests/data/a.json", "mm.arr"},
+            {"tests/data/a.json", "$.mm['key'].c"},
+            {"tests/data/a.json", "$.mm.arr[*]"},
+            {"tests/data/a.json", "mm.arr[7][1].b[0]"},
+            {"tests/data/a.json", "mm.arr[100]"},
+            {"tests/data/a.json", "$['⭐']"},
+            {"tests/data/a.json", "nothing.here"},
+            {"tests/data/records.json", "store[*].name"},
+            {"tests/data/records.json", "$.store[*][1]"},
+            {"tests/data/records.json", "store.*.price"},
+            {"tests/data/records.json", "$.*"},
+            {"tests/data/records.json", "store[-1][0]"},
+            {"tests/data/records.json", "store[1:4].name"},
+            {"tests/data/records.json", "store[::-2]"},
+            {"tests/data/records.json", "store[5:1:-1]['qty']"},
+            {"tests/data/records.json", "$..tags[0]"},
+            {"tests/data/records.json", "$..*"},
+            {"tests/data/records.json", "store..[1]"},
+            {"tests/data/records.json", "store[?@.price > 10].name"},
+            {"tests/data/records.json", "store[?@.price <= 'z'].qty"},
+            {"tests/data/records.json",
+             "$.store[?@.tags && !@.tags[1] || @.qty == 10].name"},
+            {"tests/data/records.json",
+             "store[?(@.qty < 3 || @.qty > 6) && @.name != \"eggs\"]"},
+            {"tests/data/records.json", "store[?@[0] == 'not'][2]"},
+            {"tests/data/records.json", "store[?@.qty == $.limit].name"},
+            {"tests/data/records.json", "$[?@ == 'dates']"},
+            {"tests/data/records.json", "store[?@.tags[?@ == 'dry']].name"},
+            {"tests/data/a.json", "$..[?@ == null]"},
+            {"tests/data/a.json", "mm.key[?@ == true || @ == false]"},
+        };
+        for (auto& [file, query_str] : cases) {
+            std::string packed_name = pack_file(file);
+            PackedDocument doc(packed_name);
+            JsonArray res;
+            for (const PackedNode& node :
+                 PackedQuery(query_str).run(doc.root())) {
+                res.push_back(node.to_json());
+            }
+            REQUIRE(Json(res) == Json(parse(from_file(file), query_str)));
+            std::remove(packed_name.c_str());
+        }
+    }());
+
+    // Functions, arithmetic and expressions in selectors are left to the
+    // expression engine
+    for (const char* query_str :
+         {"max(store[*].qty)", "store[?@.qty * 2 > 6]", "store[limit]",
+          "store[?length(@.tags) > 0]", "store[?@.tags[*] == 'dry']",
+          "store[?@..qty == 1]", "store[?1]", "store.name + 1"}) {
+        REQUIRE_THROWS_AS(PackedQuery(query_str), StreamQueryErr);
+    }
+}
+
+TEST_CASE("document cache", "[packed]") {
+    REQUIRE_NOTHROW([] {
+        namespace fs = std::filesystem;
+        fs::path dir = fs::temp_directory_path() / "k4json_cache_test";
+        fs::remove_all(dir);
+        fs::create_directories(dir);
+        std::string file_name = (dir / "records.json").string();
+        fs::copy_file("tests/data/records.json", file_name);
+        fs::path cache_dir = dir / "cache";
+        Json json = from_file(file_name);
+
+        // Nothing until it is stored
+        REQUIRE(!CacheEntry(cache_dir, file_name).open());
+        CacheEntry(cache_dir, file_name).store(json);
+        std::optional<PackedDocument> cached =
+            CacheEntry(cache_dir, file_name).open();
+        REQUIRE(cached);
+        REQUIRE(cached->root().to_json() == json);
+
+        // A changed file doesn't find the old entry, storing its new
+        // version replaces it
+        std::ofstream(file_name, std::ios::app) << "\n";
+        REQUIRE(!CacheEntry(cache_dir, file_name).open());
+        CacheEntry(cache_dir, file_name).store(json);
+        REQUIRE(std::distance(fs::directory_iterator(cache_dir),
+                              fs::directory_iterator()) == 1);
+
+        // Damaged entries are dropped
+        fs::path entry_file = fs::directory_iterator(cache_dir)->path();
+        fs::resize_file(entry_file, fs::file_size(entry_file) - 1);
+        REQUIRE(!CacheEntry(cache_dir, file_name).open());
+        REQUIRE(!fs::exists(entry_file));
+
+        // Including ones which still look fine, but don't match their
+        // checksum
+        CacheEntry(cache_dir, file_name).store(json);
+        REQUIRE(CacheEntry(cache_dir, file_name).open());
+        {
+            std::fstream entry(entry_file, std::ios::in | std::ios::out |
+                                               std::ios::binary);
+            entry.seekp(-2, std::ios::end);
+            entry.put('#');
+        }
+        REQUIRE(!CacheEntry(cache_dir, file_name).open());
+        REQUIRE(!fs::exists(entry_file));
+
+        REQUIRE(hash_file(file_name) != hash_file("tests/data/records.json"));
+        fs::remove_all(dir);
+    }());
+}
+
+TEST_CASE("shared documents", "[packed]") {
+    REQUIRE_NOTHROW([] {
+        std::string name = "k4json_test_" + std::to_string(::getpid());
+        Json json = from_file("tests/data/records.json");
+        publish_shared(json, name);
+
+        PackedDocument doc = PackedDocument::attach_shared(name);
+        REQUIRE(doc.root().to_json() == json);
+        // Same object, with or without the slash
+        PackedDocument again = PackedDocument::attach_shared('/' + name);
+        REQUIRE(PackedQuery("store[1].qty").run(again.root())[0]
+                    .get_number() == 10);
+
+        // Republishing leaves the attached processes on the old version
+        publish_shared(from_string("[1]"), name);
+        REQUIRE(doc.root().to_json() == json);
+        REQUIRE(PackedDocument::attach_shared(name).root().to_json() ==
+                from_string("[1]"));
+
+        remove_shared(name);
+        REQUIRE(doc.root().to_json() == json);
+    }());
+
+    REQUIRE_THROWS_AS(PackedDocument::attach_shared("k4json_test_missing"),
+                      std::runtime_error);
+}
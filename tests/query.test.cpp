@@ -0,0 +1,49 @@
+#include "query.hpp"
+#include "expressions.hpp"
+#include "json.hpp"
+
+#include "catch_amalgamated.hpp"
+
+using namespace k4json;
+
+namespace {
+Json a = from_file("tests/data/a.json");
+Json records = from_file("tests/data/records.json");
+
+// What the runtime parser finds for the same query
+template <fixed_string Q>
+bool matches_runtime(const Json& json) {
+    const Json* node = query<Q>(json);
+    JsonArray expected = parse(json, std::string(Q.view()));
+    if (node == nullptr) {
+        return expected.empty();
+    }
+    return expected.size() == 1 && expected[0] == *node;
+}
+} // namespace
+
+TEST_CASE("compiled queries", "[query]") {
+    static_assert(detail::compile("$").size == 0);
+    static_assert(detail::compile("a.b[0]").size == 3);
+    static_assert(detail::compile(" mm [ 'key' ] [\"a\"] [-1]").size == 4);
+    static_assert(detail::compile("$['x']").steps[0].is_name);
+    static_assert(detail::compile("arr[-2]").steps[1].index == -2);
+
+    REQUIRE(query<"$">(a) == &a);
+    REQUIRE(query<"mm.key.a">(a)->get_bool());
+    REQUIRE(query<"store[0].price">(records)->get_number() == 12);
+    REQUIRE(query<"store[-1][2]">(records)->get_string() == "record");
+    REQUIRE(query<"$.store[6].name">(records) == nullptr);
+    REQUIRE(query<"store[7]">(records) == nullptr);
+    REQUIRE(query<"limit.x">(records) == nullptr);
+
+    REQUIRE(matches_runtime<"mm['this is']">(a));
+    REQUIRE(matches_runtime<"mm[ 'key' ].a">(a));
+    REQUIRE(matches_runtime<"mm[ \"key\"][ 0 ]">(a));
+    REQUIRE(matches_runtime<"$['⭐']">(a));
+    REQUIRE(matches_runtime<"mm.arr[7][1].b[0]">(a));
+    REQUIRE(matches_runtime<"mm.arr[-2].a">(a));
+    REQUIRE(matches_runtime<"mm.arr[100]">(a));
+    REQUIRE(matches_runtime<"[0]">(a));
+    REQUIRE(matches_runtime<"store[3].tags[-1]">(records));
+}
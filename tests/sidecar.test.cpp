@@ -0,0 +1,110 @@
+#include "sidecar.hpp"
+#include "expressions.hpp"
+#include "json.hpp"
+#include "loader.hpp"
+
+#include "catch_amalgamated.hpp"
+
+#include <filesystem>
+#include <fstream>
+
+using namespace k4json;
+
+namespace fs = std::filesystem;
+
+// A copy of the json file in a temporary directory, so its sidecar
+// doesn't end up in tests/data
+std::string sidecar_copy(const std::string& file_name) {
+    fs::path dir = fs::temp_directory_path() / "k4json_sidecar_test";
+    fs::create_directories(dir);
+    fs::path copy = dir / fs::path(file_name).filename();
+    fs::copy_file(file_name, copy, fs::copy_options::overwrite_existing);
+    fs::remove(sidecar_name(copy.string()));
+    return copy.string();
+}
+
+TEST_CASE("sidecar queries match the dom", "[sidecar]") {
+    REQUIRE_NOTHROW([] {
+        std::vector<std::pair<std::string, std::string>> cases = {
+            {"tests/data/a.json", "$"},
+            {"tests/data/a.json", "mm.arr"},
+            {"tests/data/a.json", "$.mm['key'].c"},
+            {"tests/data/a.json", "$.mm.arr[*]"},
+            {"tests/data/a.json", "mm.arr[7][1].b[0]"},
+            {"tests/data/a.json", "mm.arr[100]"},
+            {"tests/data/a.json", "$['⭐']"},
+            {"tests/data/a.json", "nothing.here"},
+            {"tests/data/records.json", "store[*].name"},
+            {"tests/data/records.json", "$.store[*][1]"},
+            {"tests/data/records.json", "store.*.price"},
+            {"tests/data/records.json", "$.*"},
+        };
+        for (auto& [file, query] : cases) {
+            Json dom = from_file(file);
+            for (uint32_t depth : {1, 2, 5}) {
+                SidecarIndex index = SidecarIndex::build(file, depth);
+                REQUIRE(Json(index.query(SimplePath(query))) ==
+                        Json(parse(dom, query)));
+            }
+        }
+
+        // Indices past the range of size_t don't wrap around to [1]
+        SidecarIndex index = SidecarIndex::build("tests/data/records.json", 2);
+        REQUIRE(index.query(SimplePath("store[18446744073709551617]")).empty());
+    }());
+}
+
+TEST_CASE("sidecar index", "[sidecar]") {
+    REQUIRE_NOTHROW([] {
+        // Duplicate and escaped keys are resolved like the loader does,
+        // scalars are loaded on their own
+        std::string data =
+            R"({"a": 1, "b\"c": [true, null, "s"], "a": {"x": [2]}})";
+        std::string file_name = sidecar_copy("tests/data/a.json");
+        std::ofstream(file_name) << data;
+        SidecarIndex index = SidecarIndex::build(file_name, 2);
+        REQUIRE(index.size() == 8);
+        REQUIRE(Json(index.query(SimplePath("a.x[0]"))) ==
+                from_string("[2]"));
+        REQUIRE(Json(index.query(SimplePath("$['b\"c'][*]"))) ==
+                from_string("[true, null, \"s\"]"));
+        REQUIRE(Json(index.query(SimplePath("$.*"))) ==
+                Json(parse(from_string(data), "$.*")));
+    }());
+
+    REQUIRE_NOTHROW([] {
+        std::string file_name = sidecar_copy("tests/data/records.json");
+        std::string sidecar = sidecar_name(file_name);
+
+        // Written on first use, read afterwards
+        SidecarIndex::open(file_name);
+        REQUIRE(fs::exists(sidecar));
+        auto written = fs::last_write_time(sidecar);
+        SidecarIndex index = SidecarIndex::open(file_name);
+        REQUIRE(fs::last_write_time(sidecar) == written);
+        REQUIRE(index.query(SimplePath("store[2].price"))[0].get_number() ==
+                25);
+
+        // Rebuilt when the file changes
+        std::ofstream(file_name) << R"({"store": [{"price": 7}]})";
+        index = SidecarIndex::open(file_name);
+        REQUIRE(index.query(SimplePath("store[0].price"))[0].get_number() ==
+                7);
+        REQUIRE(index.query(SimplePath("store[2].price")).empty());
+
+        // And when it is damaged
+        fs::resize_file(sidecar, fs::file_size(sidecar) - 1);
+        index = SidecarIndex::open(file_name);
+        REQUIRE(index.size() == 3);
+        REQUIRE(fs::file_size(sidecar) > 56);
+    }());
+
+    REQUIRE_THROWS_AS(
+        [] {
+            std::string file_name = sidecar_copy("tests/data/records.json");
+            std::ofstream(file_name) << R"({"a": [1, 2)";
+            SidecarIndex::build(file_name, 2);
+        }(),
+        JsonLoadErr);
+    fs::remove_all(fs::temp_directory_path() / "k4json_sidecar_test");
+}
@@ -0,0 +1,148 @@
+#include "stream.hpp"
+#include "err_matcher.hpp"
+#include "expressions.hpp"
+#include "json.hpp"
+#include "loader.hpp"
+
+#include "catch_amalgamated.hpp"
+
+#include <fstream>
+#include <sstream>
+
+using namespace k4json;
+
+JsonArray stream_file(const std::string& file_name, const std::string& query) {
+    std::ifstream infile(file_name, std::ios::binary);
+    JsonArray res;
+    stream_query(infile, query, [&res](Json&& match) {
+        res.push_back(std::move(match));
+    });
+    return res;
+}
+
+JsonArray stream_string(const std::string& data, const std::string& query) {
+    std::istringstream in(data);
+    JsonArray res;
+    stream_query(in, query, [&res](Json&& match) {
+        res.push_back(std::move(match));
+    });
+    return res;
+}
+
+TEST_CASE("streaming matches the dom", "[stream]") {
+    REQUIRE_NOTHROW([] {
+        std::vector<std::pair<std::string, std::string>> cases = {
+            {"tests/data/a.json", "$"},
+            {"tests/data/a.json", "mm.arr"},
+            {"tests/data/a.json", "$.mm['key'].c"},
+            {"tests/data/a.json", "$.mm.arr[1]"},
+            {"tests/data/a.json", "$.mm.arr[*]"},
+            {"tests/data/a.json", "mm.arr[7][1].b[0]"},
+            {"tests/data/a.json", "mm.arr[100]"},
+            {"tests/data/a.json", "ic"},
+            {"tests/data/a.json", "$['⭐']"},
+            {"tests/data/a.json", "mm.num"},
+            {"tests/data/a.json", "nothing.here"},
+            {"tests/data/records.json", "store[*].name"},
+            {"tests/data/records.json", "$.store[*][1]"},
+            {"tests/data/records.json", "store[3].tags[*]"},
+            {"tests/data/records.json", "store.*.price"},
+        };
+        for (auto& [file, query] : cases) {
+            Json dom = from_file(file);
+            REQUIRE(Json(stream_file(file, query)) == Json(parse(dom, query)));
+        }
+    }());
+}
+
+TEST_CASE("streaming documents", "[stream]") {
+    REQUIRE_NOTHROW([] {
+        // Object members come in document order, escaped keys still match
+        JsonArray res =
+            stream_string(R"({"b": 1, "ab": 2, "a": [3, "]}"]})", "$.*");
+        REQUIRE(Json(res) == from_string("[1, 2, [3, \"]}\"]]"));
+
+        res = stream_string(R"({"x": {"ab": true}})", "x.ab");
+        REQUIRE(res.size() == 1);
+        REQUIRE(res[0].get_bool());
+
+        // Larger than one read
+        std::string big = "[";
+        for (int i = 0; i < 50000; ++i) {
+            big += R"({"skip": ["\"]", {"deep": [1, 2]}], "v": )" +
+                   std::to_string(i) + "},";
+        }
+        big += "{\"v\": \"last\"}]";
+        res = stream_string(big, "[*].v");
+        REQUIRE(res.size() == 50001);
+        REQUIRE(res[49999].get_number() == 49999);
+        REQUIRE(res[50000].get_string() == "last");
+
+        // Indices past the range of size_t don't wrap around to [1]
+        REQUIRE(SimplePath("arr[18446744073709551617]").steps()[1].index ==
+                SIZE_MAX);
+        REQUIRE(stream_string("[0, 1]", "$[18446744073709551617]").empty());
+    }());
+
+    REQUIRE_THROWS_AS(stream_string("[1, 2", "[*]"), JsonLoadErr);
+    REQUIRE_THROWS_AS(stream_string("[1] 2", "[*]"), JsonLoadErr);
+    REQUIRE_THROWS_AS(stream_string("\"abc\"", "[0]"), JsonLoadErr);
+    // Matches are loaded, so they are validated
+    REQUIRE_THROWS_AS(stream_string("[12abc]", "[0]"), JsonLoadErr);
+}
+
+TEST_CASE("streaming early stop", "[stream]") {
+    REQUIRE_NOTHROW([] {
+        // Singular paths stop at their match, the rest isn't read
+        JsonArray res = stream_string(R"({"a": [1, {"b": 2}], "c": )", "a[1].b");
+        REQUIRE(Json(res) == from_string("[2]"));
+
+        // As does a limit
+        std::istringstream in(R"([{"v": 1}, {"v": 2}, {"v": 3}, {"v": )");
+        res.clear();
+        size_t n = stream_query(
+            in, "[*].v",
+            [&res](Json&& match) {
+                res.push_back(std::move(match));
+            },
+            2);
+        REQUIRE(n == 2);
+        REQUIRE(Json(res) == from_string("[1, 2]"));
+    }());
+
+    REQUIRE_THROWS_AS(stream_string(R"({"a": [1, {"x": 2}], "c": )", "a[1].b"),
+                      JsonLoadErr);
+}
+
+TEST_CASE("streaming unsupported queries", "[stream]") {
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            SimplePath("$..a");
+        }(),
+        StreamQueryErr,
+        EqualsJError(2, "the descendant segment needs the whole document"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            SimplePath("arr[-1]");
+        }(),
+        StreamQueryErr,
+        EqualsJError(4, "negative indices need the length of the array, "
+                        "which needs the whole array"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            SimplePath("arr[?@.a]");
+        }(),
+        StreamQueryErr,
+        EqualsJError(4, "only name, index and wildcard selectors can be "
+                        "streamed"));
+
+    REQUIRE_THROWS_MATCHES(
+        [] {
+            SimplePath("size(arr)");
+        }(),
+        StreamQueryErr,
+        EqualsJError(4, "only name, index and wildcard selectors can be "
+                        "streamed"));
+}
@@ -0,0 +1,68 @@
+#include "thread_pool.hpp"
+
+#include "catch_amalgamated.hpp"
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+
+using namespace k4json;
+
+TEST_CASE("parallel for", "[thread_pool]") {
+    ThreadPool& pool = ThreadPool::instance();
+    REQUIRE(pool.size() >= 1);
+
+    std::vector<std::atomic<int>> hits(1000);
+    pool.parallel_for(hits.size(), [&](size_t i) {
+        hits[i] += 1;
+    });
+    for (std::atomic<int>& hit : hits) {
+        REQUIRE(hit == 1);
+    }
+
+    // Nested calls can't starve each other
+    std::atomic<int> total = 0;
+    pool.parallel_for(16, [&](size_t) {
+        pool.parallel_for(16, [&](size_t) {
+            total += 1;
+        });
+    });
+    REQUIRE(total == 256);
+}
+
+TEST_CASE("parallel ranges", "[thread_pool]") {
+    std::vector<size_t> covered(103, 0);
+    size_t last = 0;
+    std::vector<size_t> starts(8);
+    size_t nchunks =
+        parallel_ranges(covered.size(), 8, [&](size_t chunk, size_t begin,
+                                               size_t end) {
+            starts[chunk] = begin;
+            for (size_t i = begin; i < end; ++i) {
+                covered[i] += 1;
+            }
+        });
+    REQUIRE(nchunks == 8);
+    for (size_t c : covered) {
+        REQUIRE(c == 1);
+    }
+    for (size_t start : starts) {
+        REQUIRE(start >= last);
+        last = start;
+    }
+
+    // Never more chunks than elements
+    REQUIRE(parallel_ranges(3, 8, [](size_t, size_t, size_t) {}) == 3);
+}
+
+TEST_CASE("parallel errors", "[thread_pool]") {
+    // The lowest failing chunk wins, whichever thread got there first
+    REQUIRE_THROWS_WITH(ThreadPool::instance().parallel_for(
+                            64,
+                            [](size_t i) {
+                                if (i % 10 == 7) {
+                                    throw std::runtime_error(std::to_string(i));
+                                }
+                            }),
+                        "7");
+}